@@ -43,10 +43,43 @@
 #include <amqp.h>
 #include <amqp_framing.h>
 
-#include <assert.h>
+#ifdef _WIN32
+# ifndef WIN32_LEAN_AND_MEAN
+#  define WIN32_LEAN_AND_MEAN
+# endif
+# include <Winsock2.h>
+#else
+# include <sys/time.h>
+#endif
 
 #include "utils.h"
 
+static void AMQP_CALL print_reply(void *user_data, int status,
+                                  amqp_envelope_t const *reply)
+{
+  amqp_basic_properties_t const *p;
+
+  (void)user_data;
+  if (status != AMQP_STATUS_OK) {
+    fprintf(stderr, "No reply: %s\n", amqp_error_string2(status));
+    return;
+  }
+
+  printf("Delivery: %u exchange: %.*s routingkey: %.*s\n",
+         (unsigned) reply->delivery_tag,
+         (int) reply->exchange.len, (char *) reply->exchange.bytes,
+         (int) reply->routing_key.len, (char *) reply->routing_key.bytes);
+
+  p = &reply->message.properties;
+  if (p->_flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
+    printf("Content-type: %.*s\n",
+           (int) p->content_type.len, (char *) p->content_type.bytes);
+  }
+  printf("----\n");
+
+  amqp_dump(reply->message.body.bytes, reply->message.body.len);
+}
+
 int main(int argc, char *argv[])
 {
   char const *hostname;
@@ -56,7 +89,7 @@ int main(int argc, char *argv[])
   char const *messagebody;
   amqp_socket_t *socket = NULL;
   amqp_connection_state_t conn;
-  amqp_bytes_t reply_to_queue;
+  amqp_rpc_client_t *client;
 
   if (argc < 6) { /* minimum number of mandatory arguments */
     fprintf(stderr, "usage:\namqp_rpc_sendstring_client host port exchange routingkey messagebody\n");
@@ -91,18 +124,10 @@ int main(int argc, char *argv[])
   die_on_amqp_error(amqp_get_rpc_reply(conn), "Opening channel");
 
   /*
-     create private reply_to queue
+     replies come back through direct reply-to, so no reply queue is needed
   */
 
-  {
-    amqp_queue_declare_ok_t *r = amqp_queue_declare(conn, 1, amqp_empty_bytes, 0, 0, 0, 1, amqp_empty_table);
-    die_on_amqp_error(amqp_get_rpc_reply(conn), "Declaring queue");
-    reply_to_queue = amqp_bytes_malloc_dup(r->queue);
-    if (reply_to_queue.bytes == NULL) {
-      fprintf(stderr, "Out of memory while copying queue name");
-      return 1;
-    }
-  }
+  die_on_error(amqp_rpc_client_new(conn, 1, &client), "Creating RPC client");
 
   /*
      send the message
@@ -110,129 +135,38 @@ int main(int argc, char *argv[])
 
   {
     /*
-      set properties
+      set properties, the client fills in reply_to and correlation_id
     */
     amqp_basic_properties_t props;
+    struct timeval timeout;
+
     props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG |
-                   AMQP_BASIC_DELIVERY_MODE_FLAG |
-                   AMQP_BASIC_REPLY_TO_FLAG |
-                   AMQP_BASIC_CORRELATION_ID_FLAG;
+                   AMQP_BASIC_DELIVERY_MODE_FLAG;
     props.content_type = amqp_cstring_bytes("text/plain");
     props.delivery_mode = 2; /* persistent delivery mode */
-    props.reply_to = amqp_bytes_malloc_dup(reply_to_queue);
-    if (props.reply_to.bytes == NULL) {
-      fprintf(stderr, "Out of memory while copying queue name");
-      return 1;
-    }
-    props.correlation_id = amqp_cstring_bytes("1");
 
-    /*
-      publish
-    */
-    die_on_error(amqp_basic_publish(conn,
-                                    1,
-                                    amqp_cstring_bytes(exchange),
-                                    amqp_cstring_bytes(routingkey),
-                                    0,
-                                    0,
-                                    &props,
-                                    amqp_cstring_bytes(messagebody)),
+    timeout.tv_sec = 30;
+    timeout.tv_usec = 0;
+
+    die_on_error(amqp_rpc_client_call(client,
+                                      amqp_cstring_bytes(exchange),
+                                      amqp_cstring_bytes(routingkey),
+                                      &props,
+                                      amqp_cstring_bytes(messagebody),
+                                      &timeout,
+                                      print_reply,
+                                      NULL),
                  "Publishing");
-
-    amqp_bytes_free(props.reply_to);
   }
 
   /*
     wait an answer
   */
 
-  {
-    amqp_basic_consume(conn, 1, reply_to_queue, amqp_empty_bytes, 0, 1, 0, amqp_empty_table);
-    die_on_amqp_error(amqp_get_rpc_reply(conn), "Consuming");
-    amqp_bytes_free(reply_to_queue);
-
-    {
-      amqp_frame_t frame;
-      int result;
-
-      amqp_basic_deliver_t *d;
-      amqp_basic_properties_t *p;
-      size_t body_target;
-      size_t body_received;
-
-      while (1) {
-        amqp_maybe_release_buffers(conn);
-        result = amqp_simple_wait_frame(conn, &frame);
-        printf("Result: %d\n", result);
-        if (result < 0) {
-          break;
-        }
-
-        printf("Frame type: %d channel: %d\n", frame.frame_type, frame.channel);
-        if (frame.frame_type != AMQP_FRAME_METHOD) {
-          continue;
-        }
-
-        printf("Method: %s\n", amqp_method_name(frame.payload.method.id));
-        if (frame.payload.method.id != AMQP_BASIC_DELIVER_METHOD) {
-          continue;
-        }
-
-        d = (amqp_basic_deliver_t *) frame.payload.method.decoded;
-        printf("Delivery: %u exchange: %.*s routingkey: %.*s\n",
-               (unsigned) d->delivery_tag,
-               (int) d->exchange.len, (char *) d->exchange.bytes,
-               (int) d->routing_key.len, (char *) d->routing_key.bytes);
-
-        result = amqp_simple_wait_frame(conn, &frame);
-        if (result < 0) {
-          break;
-        }
-
-        if (frame.frame_type != AMQP_FRAME_HEADER) {
-          fprintf(stderr, "Expected header!");
-          abort();
-        }
-        p = (amqp_basic_properties_t *) frame.payload.properties.decoded;
-        if (p->_flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
-          printf("Content-type: %.*s\n",
-                 (int) p->content_type.len, (char *) p->content_type.bytes);
-        }
-        printf("----\n");
-
-        body_target = frame.payload.properties.body_size;
-        body_received = 0;
-
-        while (body_received < body_target) {
-          result = amqp_simple_wait_frame(conn, &frame);
-          if (result < 0) {
-            break;
-          }
-
-          if (frame.frame_type != AMQP_FRAME_BODY) {
-            fprintf(stderr, "Expected body!");
-            abort();
-          }
-
-          body_received += frame.payload.body_fragment.len;
-          assert(body_received <= body_target);
-
-          amqp_dump(frame.payload.body_fragment.bytes,
-                    frame.payload.body_fragment.len);
-        }
-
-        if (body_received != body_target) {
-          /* Can only happen when amqp_simple_wait_frame returns <= 0 */
-          /* We break here to close the connection */
-          break;
-        }
-
-        /* everything was fine, we can quit now because we received the reply */
-        break;
-      }
-
-    }
+  while (amqp_rpc_client_pending(client) > 0) {
+    die_on_error(amqp_rpc_client_process(client, NULL), "Waiting for reply");
   }
+  amqp_rpc_client_free(client);
 
   /*
      closing
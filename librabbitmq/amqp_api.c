@@ -72,7 +72,14 @@ static const char *base_error_strings[] = {
   "unexpected method received",         /* AMQP_STATUS_WRONG_METHOD             -0x000C */
   "request timed out",                  /* AMQP_STATUS_TIMEOUT                  -0x000D */
   "system timer has failed",            /* AMQP_STATUS_TIMER_FAILED             -0x000E */
-  "heartbeat timeout, connection closed"/* AMQP_STATUS_HEARTBEAT_TIMEOUT        -0x000F */
+  "heartbeat timeout, connection closed",/* AMQP_STATUS_HEARTBEAT_TIMEOUT       -0x000F */
+  "unexpected protocol state",          /* AMQP_STATUS_UNEXPECTED_STATE         -0x0010 */
+  "a file error occurred",              /* AMQP_STATUS_FILE_ERROR               -0x0011 */
+  "connection blocked by the broker",   /* AMQP_STATUS_CONNECTION_BLOCKED       -0x0012 */
+  "chunk missing from transfer",        /* AMQP_STATUS_CHUNK_MISSING            -0x0013 */
+  "duplicate chunk received",           /* AMQP_STATUS_CHUNK_DUPLICATE          -0x0014 */
+  "message body checksum mismatch",     /* AMQP_STATUS_CHECKSUM_MISMATCH        -0x0015 */
+  "too many chunked transfers"          /* AMQP_STATUS_TOO_MANY_TRANSFERS       -0x0016 */
 };
 
 static const char *tcp_error_strings[] = {
@@ -164,6 +171,160 @@ const amqp_array_t amqp_empty_array = { 0, NULL };
    ? (replytype *) state->most_recent_api_result.reply.decoded\
    : NULL)
 
+int amqp_select_confirms(amqp_connection_state_t state, amqp_channel_t channel)
+{
+  amqp_rpc_reply_t reply;
+
+  /* confirm.select-ok has no fields, so only the reply tells success */
+  amqp_confirm_select(state, channel);
+  reply = amqp_get_rpc_reply(state);
+  switch (reply.reply_type) {
+    case AMQP_RESPONSE_NORMAL:
+      return AMQP_STATUS_OK;
+    case AMQP_RESPONSE_LIBRARY_EXCEPTION:
+      return reply.library_error;
+    default:
+      return AMQP_STATUS_UNEXPECTED_STATE;
+  }
+}
+
+int amqp_wait_confirm(amqp_connection_state_t state, amqp_channel_t channel,
+                      struct timeval *timeout, amqp_confirm_fn fn,
+                      void *context)
+{
+  amqp_frame_t frame;
+  int res = amqp_wait_frame_on_channel(state, channel, &frame, timeout);
+
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  if (AMQP_FRAME_METHOD == frame.frame_type) {
+    switch (frame.payload.method.id) {
+    case AMQP_BASIC_ACK_METHOD: {
+      amqp_basic_ack_t *ack = frame.payload.method.decoded;
+      fn(context, ack->delivery_tag, ack->multiple, 0);
+      break;
+    }
+
+    case AMQP_BASIC_NACK_METHOD: {
+      amqp_basic_nack_t *nack = frame.payload.method.decoded;
+      fn(context, nack->delivery_tag, nack->multiple, 1);
+      break;
+    }
+
+    case AMQP_BASIC_RETURN_METHOD: {
+      /* An unroutable mandatory message, its confirm follows */
+      amqp_message_t message;
+      amqp_rpc_reply_t reply = amqp_read_message(state, channel, &message, 0);
+      if (AMQP_RESPONSE_NORMAL == reply.reply_type) {
+        amqp_destroy_message(&message);
+      }
+      break;
+    }
+
+    case AMQP_CHANNEL_CLOSE_METHOD:
+    case AMQP_CONNECTION_CLOSE_METHOD:
+      return AMQP_STATUS_CONNECTION_CLOSED;
+
+    default:
+      break;
+    }
+  }
+
+  amqp_maybe_release_buffers_on_channel(state, channel);
+  return AMQP_STATUS_OK;
+}
+
+int amqp_encode_basic_properties(amqp_basic_properties_t const *properties,
+                                 amqp_bytes_t *encoded)
+{
+  size_t size = 256;
+
+  while (1) {
+    amqp_bytes_t buffer = amqp_bytes_malloc(size);
+    int res;
+
+    if (NULL == buffer.bytes) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+
+    res = amqp_encode_properties(AMQP_BASIC_CLASS, (void *)properties, buffer);
+    if (res >= 0) {
+      buffer.len = res;
+      *encoded = buffer;
+      return AMQP_STATUS_OK;
+    }
+
+    amqp_bytes_free(buffer);
+    if ((AMQP_STATUS_BAD_AMQP_DATA != res &&
+         AMQP_STATUS_TABLE_TOO_BIG != res) ||
+        size >= AMQP_MAX_ENCODED_PROPERTIES_SIZE) {
+      return res;
+    }
+    size *= 2;
+  }
+}
+
+static int publish_checked(amqp_connection_state_t state,
+                           amqp_channel_t channel,
+                           amqp_bytes_t exchange,
+                           amqp_bytes_t routing_key,
+                           amqp_boolean_t mandatory,
+                           amqp_boolean_t immediate,
+                           amqp_basic_properties_t const *properties,
+                           amqp_bytes_t body)
+{
+  int res;
+
+  if (amqp_heartbeat_enabled(state)) {
+    /* One clock read for the whole publish, the frames sent below reuse it
+     * when the connection uses a cached clock */
+    uint64_t current_timestamp = amqp_clock_refresh(&state->clock);
+    if (0 == current_timestamp) {
+      return AMQP_STATUS_TIMER_FAILURE;
+    }
+
+    if (current_timestamp > state->next_recv_heartbeat) {
+      res = amqp_try_recv(state, current_timestamp);
+      if (AMQP_STATUS_TIMEOUT == res) {
+        return AMQP_STATUS_HEARTBEAT_TIMEOUT;
+      } else if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+  }
+
+  if (AMQP_BLOCKED_POLICY_IGNORE != state->blocked_policy ||
+      state->first_parked_publish) {
+    /* Notice a connection.blocked the broker sent since the last read */
+    res = amqp_poll_frames(state);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    if (state->blocked) {
+      switch (state->blocked_policy) {
+      case AMQP_BLOCKED_POLICY_FAIL:
+        return AMQP_STATUS_CONNECTION_BLOCKED;
+      case AMQP_BLOCKED_POLICY_QUEUE:
+        return amqp_park_publish(state, channel, exchange, routing_key,
+                                 mandatory, immediate, properties, body);
+      default:
+        break;
+      }
+    } else {
+      res = amqp_send_parked_publishes(state);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+  }
+
+  return amqp_send_basic_publish(state, channel, exchange, routing_key,
+                                 mandatory, immediate, properties, body);
+}
+
 int amqp_basic_publish(amqp_connection_state_t state,
                        amqp_channel_t channel,
                        amqp_bytes_t exchange,
@@ -172,6 +333,44 @@ int amqp_basic_publish(amqp_connection_state_t state,
                        amqp_boolean_t immediate,
                        amqp_basic_properties_t const *properties,
                        amqp_bytes_t body)
+{
+  amqp_basic_properties_t compressed_properties;
+  amqp_basic_properties_t checksum_properties;
+  amqp_table_entry_t *checksum_entries;
+  amqp_bytes_t compressed;
+  int res;
+
+  if (NULL == state->codec_compress &&
+      !(state->checksum_flags & AMQP_CHECKSUM_PUBLISH)) {
+    return publish_checked(state, channel, exchange, routing_key, mandatory,
+                           immediate, properties, body);
+  }
+
+  res = amqp_compress_publish(state, &properties, &body,
+                              &compressed_properties, &compressed);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  /* the checksum covers the body as sent */
+  res = amqp_checksum_publish(state, &properties, body, &checksum_properties,
+                              &checksum_entries);
+  if (AMQP_STATUS_OK == res) {
+    res = publish_checked(state, channel, exchange, routing_key, mandatory,
+                          immediate, properties, body);
+  }
+  free(checksum_entries);
+  amqp_bytes_free(compressed);
+  return res;
+}
+
+int amqp_send_basic_publish(amqp_connection_state_t state,
+                            amqp_channel_t channel,
+                            amqp_bytes_t exchange,
+                            amqp_bytes_t routing_key,
+                            amqp_boolean_t mandatory,
+                            amqp_boolean_t immediate,
+                            amqp_basic_properties_t const *properties,
+                            amqp_bytes_t body)
 {
   amqp_frame_t f;
   size_t body_offset;
@@ -187,22 +386,6 @@ int amqp_basic_publish(amqp_connection_state_t state,
   m.immediate = immediate;
   m.ticket = 0;
 
-  if (amqp_heartbeat_enabled(state)) {
-    uint64_t current_timestamp = amqp_get_monotonic_timestamp();
-    if (0 == current_timestamp) {
-      return AMQP_STATUS_TIMER_FAILURE;
-    }
-
-    if (current_timestamp > state->next_recv_heartbeat) {
-      res = amqp_try_recv(state, current_timestamp);
-      if (AMQP_STATUS_TIMEOUT == res) {
-        return AMQP_STATUS_HEARTBEAT_TIMEOUT;
-      } else if (AMQP_STATUS_OK != res) {
-        return res;
-      }
-    }
-  }
-
   res = amqp_send_method(state, channel, AMQP_BASIC_PUBLISH_METHOD, &m);
   if (res < 0) {
     return res;
@@ -0,0 +1,373 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A batch is a message whose body is a sequence of items:
+ *
+ *   headers (field table, with its 32 bit length prefix)
+ *   payload (32 bit length, bytes)
+ *
+ * and whose content_type is AMQP_BATCH_CONTENT_TYPE.
+ */
+
+#define AMQP_BATCH_INITIAL_SIZE 4096
+
+struct amqp_batch_packer_t_ {
+  amqp_connection_state_t state;
+  amqp_channel_t channel;
+  amqp_bytes_t exchange;
+  amqp_bytes_t routing_key;
+  amqp_boolean_t has_properties;
+  amqp_bytes_t properties;    /* encoded */
+  size_t max_size;
+  uint64_t max_delay;         /* ns */
+  uint64_t first_added;       /* when the oldest pending item was added */
+  amqp_clock_t *clock;        /* the connection's, or own_clock */
+  amqp_clock_t own_clock;
+  amqp_bytes_t buffer;
+  size_t size;
+  size_t count;
+  amqp_pool_t pool;
+};
+
+int
+amqp_batch_packer_new(amqp_connection_state_t state, amqp_channel_t channel,
+                      amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                      struct amqp_basic_properties_t_ const *properties,
+                      size_t max_size, int max_delay_ms,
+                      amqp_batch_packer_t **packer)
+{
+  amqp_batch_packer_t *p;
+  int res;
+
+  if (NULL == packer || 0 == max_size || max_delay_ms < 0) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  p = calloc(1, sizeof(amqp_batch_packer_t));
+  if (NULL == p) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  p->state = state;
+  p->channel = channel;
+  p->max_size = max_size;
+  p->max_delay = (uint64_t)max_delay_ms * AMQP_NS_PER_MS;
+  p->own_clock.source = AMQP_CLOCK_SOURCE_MONOTONIC;
+  p->clock = state ? &state->clock : &p->own_clock;
+  init_amqp_pool(&p->pool, 4096);
+
+  res = amqp_bytes_dup(exchange, &p->exchange);
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_bytes_dup(routing_key, &p->routing_key);
+  }
+  if (AMQP_STATUS_OK == res && properties) {
+    p->has_properties = 1;
+    res = amqp_encode_basic_properties(properties, &p->properties);
+  }
+  if (AMQP_STATUS_OK != res) {
+    amqp_batch_packer_free(p);
+    return res;
+  }
+
+  *packer = p;
+  return AMQP_STATUS_OK;
+}
+
+void
+amqp_batch_packer_free(amqp_batch_packer_t *packer)
+{
+  if (NULL == packer) {
+    return;
+  }
+  amqp_bytes_free(packer->exchange);
+  amqp_bytes_free(packer->routing_key);
+  amqp_bytes_free(packer->properties);
+  amqp_bytes_free(packer->buffer);
+  empty_amqp_pool(&packer->pool);
+  free(packer);
+}
+
+void
+amqp_batch_packer_set_clock(amqp_batch_packer_t *packer,
+                            amqp_clock_fn clock_fn, void *user_data)
+{
+  if (NULL == clock_fn) {
+    packer->own_clock.source = AMQP_CLOCK_SOURCE_MONOTONIC;
+    packer->own_clock.clock_fn = NULL;
+    packer->own_clock.user_data = NULL;
+    packer->clock = packer->state ? &packer->state->clock : &packer->own_clock;
+  } else {
+    packer->own_clock.source = AMQP_CLOCK_SOURCE_USER;
+    packer->own_clock.clock_fn = clock_fn;
+    packer->own_clock.user_data = user_data;
+    packer->clock = &packer->own_clock;
+  }
+  packer->own_clock.cached_timestamp = 0;
+  /* The new clock need not share an epoch with the old one */
+  if (packer->count) {
+    packer->first_added = amqp_clock_now(packer->clock);
+  }
+}
+
+size_t
+amqp_batch_packer_count(amqp_batch_packer_t *packer)
+{
+  return packer->count;
+}
+
+amqp_bytes_t
+amqp_batch_packer_body(amqp_batch_packer_t *packer)
+{
+  amqp_bytes_t body;
+  body.bytes = packer->buffer.bytes;
+  body.len = packer->size;
+  return body;
+}
+
+void
+amqp_batch_packer_clear(amqp_batch_packer_t *packer)
+{
+  packer->size = 0;
+  packer->count = 0;
+}
+
+int
+amqp_batch_flush(amqp_batch_packer_t *packer)
+{
+  amqp_basic_properties_t *decoded = NULL;
+  amqp_basic_properties_t properties;
+  int res;
+
+  if (0 == packer->count) {
+    return AMQP_STATUS_OK;
+  }
+  if (NULL == packer->state) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  if (packer->has_properties) {
+    res = amqp_decode_properties(AMQP_BASIC_CLASS, &packer->pool,
+                                 packer->properties, (void **)&decoded);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    properties = *decoded;
+  } else {
+    memset(&properties, 0, sizeof(properties));
+  }
+  properties._flags |= AMQP_BASIC_CONTENT_TYPE_FLAG;
+  properties.content_type = amqp_cstring_bytes(AMQP_BATCH_CONTENT_TYPE);
+
+  res = amqp_basic_publish(packer->state, packer->channel, packer->exchange,
+                           packer->routing_key, 0, 0, &properties,
+                           amqp_batch_packer_body(packer));
+  recycle_amqp_pool(&packer->pool);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  amqp_batch_packer_clear(packer);
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_batch_flush_due(amqp_batch_packer_t *packer)
+{
+  uint64_t now;
+
+  if (0 == packer->count || 0 == packer->max_delay) {
+    return AMQP_STATUS_OK;
+  }
+  now = amqp_clock_now(packer->clock);
+  if (0 == now) {
+    return AMQP_STATUS_TIMER_FAILURE;
+  }
+  if (now - packer->first_added < packer->max_delay) {
+    return AMQP_STATUS_OK;
+  }
+  return amqp_batch_flush(packer);
+}
+
+/* Appends an item to the pending batch, growing the buffer as needed */
+static int
+append_item(amqp_batch_packer_t *packer, amqp_table_t const *headers,
+            amqp_bytes_t payload)
+{
+  amqp_table_t empty = amqp_empty_table;
+
+  if (NULL == headers) {
+    headers = &empty;
+  }
+
+  while (1) {
+    size_t offset = packer->size;
+    int res = AMQP_STATUS_TABLE_TOO_BIG;
+
+    if (packer->buffer.len) {
+      res = amqp_encode_table(packer->buffer, (amqp_table_t *)headers,
+                              &offset);
+    }
+    if (AMQP_STATUS_OK == res) {
+      if (amqp_encode_32(packer->buffer, &offset, (uint32_t)payload.len) &&
+          (0 == payload.len ||
+           amqp_encode_bytes(packer->buffer, &offset, payload))) {
+        packer->size = offset;
+        return AMQP_STATUS_OK;
+      }
+      res = AMQP_STATUS_TABLE_TOO_BIG;
+    }
+
+    if (AMQP_STATUS_TABLE_TOO_BIG != res &&
+        AMQP_STATUS_BAD_AMQP_DATA != res) {
+      return res;
+    } else {
+      size_t len = packer->buffer.len ? packer->buffer.len * 2
+                                      : AMQP_BATCH_INITIAL_SIZE;
+      void *grown;
+
+      while (len < packer->size + payload.len + 8) {
+        len *= 2;
+      }
+      if (len > UINT32_MAX || len < packer->buffer.len) {
+        return AMQP_STATUS_TABLE_TOO_BIG;
+      }
+      grown = realloc(packer->buffer.bytes, len);
+      if (NULL == grown) {
+        return AMQP_STATUS_NO_MEMORY;
+      }
+      packer->buffer.bytes = grown;
+      packer->buffer.len = len;
+    }
+  }
+}
+
+int
+amqp_batch_add(amqp_batch_packer_t *packer, amqp_table_t const *headers,
+               amqp_bytes_t payload)
+{
+  size_t before = packer->size;
+  int res;
+
+  res = append_item(packer, headers, payload);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  if (packer->count && packer->size > packer->max_size && packer->state) {
+    /* Send what was there before this item, and start over with it */
+    size_t item = packer->size - before;
+
+    packer->size = before;
+    res = amqp_batch_flush(packer);
+    if (AMQP_STATUS_OK != res) {
+      packer->size = before + item;
+      packer->count++;
+      return res;
+    }
+    memmove(packer->buffer.bytes, (char *)packer->buffer.bytes + before,
+            item);
+    packer->size = item;
+  }
+
+  if (0 == packer->count) {
+    packer->first_added = amqp_clock_now(packer->clock);
+  }
+  packer->count++;
+
+  if (NULL == packer->state) {
+    return AMQP_STATUS_OK;
+  }
+  if (packer->size >= packer->max_size) {
+    return amqp_batch_flush(packer);
+  }
+  return amqp_batch_flush_due(packer);
+}
+
+amqp_boolean_t
+amqp_batch_is_batch(amqp_message_t const *message)
+{
+  amqp_basic_properties_t const *properties = &message->properties;
+  size_t len = sizeof(AMQP_BATCH_CONTENT_TYPE) - 1;
+
+  return (properties->_flags & AMQP_BASIC_CONTENT_TYPE_FLAG) &&
+         properties->content_type.len == len &&
+         0 == memcmp(properties->content_type.bytes, AMQP_BATCH_CONTENT_TYPE,
+                     len);
+}
+
+void
+amqp_batch_reader_init(amqp_batch_reader_t *reader, amqp_bytes_t body)
+{
+  reader->body = body;
+  reader->offset = 0;
+}
+
+amqp_boolean_t
+amqp_batch_has_next(amqp_batch_reader_t const *reader)
+{
+  return reader->offset < reader->body.len;
+}
+
+int
+amqp_batch_next(amqp_batch_reader_t *reader, amqp_pool_t *pool,
+                amqp_table_t *headers, amqp_bytes_t *payload)
+{
+  size_t offset = reader->offset;
+  uint32_t len;
+
+  if (pool && headers) {
+    int res = amqp_decode_table(reader->body, pool, headers, &offset);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  } else {
+    /* skip the headers */
+    if (!amqp_decode_32(reader->body, &offset, &len) ||
+        len > reader->body.len - offset) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+    offset += len;
+    if (headers) {
+      *headers = amqp_empty_table;
+    }
+  }
+
+  if (!amqp_decode_32(reader->body, &offset, &len) ||
+      !amqp_decode_bytes(reader->body, &offset, payload, len)) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  reader->offset = offset;
+  return AMQP_STATUS_OK;
+}
@@ -0,0 +1,236 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* A publish made while the connection was blocked, with the exchange,
+ * routing key and body stored after it */
+typedef struct amqp_parked_publish_t_ {
+  struct amqp_parked_publish_t_ *next;
+  amqp_channel_t channel;
+  amqp_bytes_t exchange;
+  amqp_bytes_t routing_key;
+  amqp_boolean_t mandatory;
+  amqp_boolean_t immediate;
+  amqp_boolean_t has_properties;
+  amqp_bytes_t properties;    /* encoded */
+  amqp_bytes_t body;
+} amqp_parked_publish_t;
+
+int
+amqp_set_blocked_policy(amqp_connection_state_t state,
+                        amqp_blocked_policy_enum policy, size_t max_queued)
+{
+  switch (policy) {
+  case AMQP_BLOCKED_POLICY_IGNORE:
+  case AMQP_BLOCKED_POLICY_FAIL:
+    break;
+  case AMQP_BLOCKED_POLICY_QUEUE:
+    if (0 == max_queued) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+    break;
+  default:
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  state->blocked_policy = policy;
+  state->max_parked_publishes = max_queued;
+  return AMQP_STATUS_OK;
+}
+
+amqp_boolean_t
+amqp_connection_blocked(amqp_connection_state_t state)
+{
+  return state->blocked;
+}
+
+char const *
+amqp_get_blocked_reason(amqp_connection_state_t state)
+{
+  return state->blocked ? state->blocked_reason : NULL;
+}
+
+size_t
+amqp_get_queued_publishes(amqp_connection_state_t state)
+{
+  return state->parked_publish_count;
+}
+
+amqp_boolean_t
+amqp_handle_blocked_method(amqp_connection_state_t state,
+                           amqp_channel_t channel, amqp_method_t *method)
+{
+  if (0 != channel) {
+    return 0;
+  }
+
+  switch (method->id) {
+  case AMQP_CONNECTION_BLOCKED_METHOD: {
+    amqp_connection_blocked_t *blocked = method->decoded;
+    size_t len = blocked->reason.len;
+
+    if (len >= sizeof(state->blocked_reason)) {
+      len = sizeof(state->blocked_reason) - 1;
+    }
+    if (len) {
+      memcpy(state->blocked_reason, blocked->reason.bytes, len);
+    }
+    state->blocked_reason[len] = '\0';
+    state->blocked = 1;
+    return 1;
+  }
+
+  case AMQP_CONNECTION_UNBLOCKED_METHOD:
+    state->blocked = 0;
+    state->blocked_reason[0] = '\0';
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+int
+amqp_park_publish(amqp_connection_state_t state, amqp_channel_t channel,
+                  amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                  amqp_boolean_t mandatory, amqp_boolean_t immediate,
+                  amqp_basic_properties_t const *properties,
+                  amqp_bytes_t body)
+{
+  amqp_parked_publish_t *publish;
+  char *data;
+
+  if (state->parked_publish_count >= state->max_parked_publishes) {
+    return AMQP_STATUS_CONNECTION_BLOCKED;
+  }
+
+  publish = malloc(sizeof(amqp_parked_publish_t) + exchange.len +
+                   routing_key.len + body.len);
+  if (NULL == publish) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  publish->next = NULL;
+  publish->channel = channel;
+  publish->mandatory = mandatory;
+  publish->immediate = immediate;
+  publish->has_properties = properties != NULL;
+  publish->properties = amqp_empty_bytes;
+  if (properties) {
+    int res = amqp_encode_basic_properties(properties, &publish->properties);
+    if (AMQP_STATUS_OK != res) {
+      free(publish);
+      return res;
+    }
+  }
+
+  data = (char *)(publish + 1);
+  publish->exchange.len = exchange.len;
+  publish->exchange.bytes = data;
+  memcpy(data, exchange.bytes, exchange.len);
+  data += exchange.len;
+  publish->routing_key.len = routing_key.len;
+  publish->routing_key.bytes = data;
+  memcpy(data, routing_key.bytes, routing_key.len);
+  data += routing_key.len;
+  publish->body.len = body.len;
+  publish->body.bytes = data;
+  memcpy(data, body.bytes, body.len);
+
+  if (state->last_parked_publish) {
+    state->last_parked_publish->next = publish;
+  } else {
+    state->first_parked_publish = publish;
+  }
+  state->last_parked_publish = publish;
+  state->parked_publish_count++;
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_send_parked_publishes(amqp_connection_state_t state)
+{
+  amqp_pool_t pool;
+  int res = AMQP_STATUS_OK;
+
+  if (NULL == state->first_parked_publish) {
+    return AMQP_STATUS_OK;
+  }
+
+  init_amqp_pool(&pool, 4096);
+
+  while (state->first_parked_publish) {
+    amqp_parked_publish_t *publish = state->first_parked_publish;
+    amqp_basic_properties_t *properties = NULL;
+
+    if (publish->has_properties) {
+      res = amqp_decode_properties(AMQP_BASIC_CLASS, &pool,
+                                   publish->properties, (void **)&properties);
+      if (AMQP_STATUS_OK != res) {
+        break;
+      }
+    }
+
+    res = amqp_send_basic_publish(state, publish->channel, publish->exchange,
+                                  publish->routing_key, publish->mandatory,
+                                  publish->immediate, properties,
+                                  publish->body);
+    recycle_amqp_pool(&pool);
+    if (AMQP_STATUS_OK != res) {
+      break;
+    }
+
+    state->first_parked_publish = publish->next;
+    if (NULL == state->first_parked_publish) {
+      state->last_parked_publish = NULL;
+    }
+    state->parked_publish_count--;
+    amqp_bytes_free(publish->properties);
+    free(publish);
+  }
+
+  empty_amqp_pool(&pool);
+  return res;
+}
+
+void
+amqp_free_parked_publishes(amqp_connection_state_t state)
+{
+  while (state->first_parked_publish) {
+    amqp_parked_publish_t *publish = state->first_parked_publish;
+    state->first_parked_publish = publish->next;
+    amqp_bytes_free(publish->properties);
+    free(publish);
+  }
+  state->last_parked_publish = NULL;
+  state->parked_publish_count = 0;
+}
@@ -0,0 +1,204 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef ENABLE_THREAD_SAFETY
+# include <pthread.h>
+#endif
+
+/*
+ * Message bodies over the connection's body_file_threshold are read into
+ * an unlinked temporary file mapped into memory. The pages are backed by
+ * the file rather than by anonymous memory, so the kernel can write them
+ * out and drop them instead of growing the process.
+ *
+ * amqp_destroy_message() has no connection to ask, so mapped bodies are
+ * remembered here to tell them apart from malloc'd ones.
+ */
+
+struct amqp_mapped_body_t_ {
+  void *bytes;
+  size_t len;
+  struct amqp_mapped_body_t_ *next;
+};
+
+static struct amqp_mapped_body_t_ *mapped_bodies = NULL;
+
+#ifdef ENABLE_THREAD_SAFETY
+static pthread_mutex_t mapped_bodies_mutex = PTHREAD_MUTEX_INITIALIZER;
+# define LOCK_MAPPED_BODIES() pthread_mutex_lock(&mapped_bodies_mutex)
+# define UNLOCK_MAPPED_BODIES() pthread_mutex_unlock(&mapped_bodies_mutex)
+#else
+# define LOCK_MAPPED_BODIES()
+# define UNLOCK_MAPPED_BODIES()
+#endif
+
+int
+amqp_set_body_file_threshold(amqp_connection_state_t state, size_t threshold,
+                             char const *dir)
+{
+  char *copy = NULL;
+
+  if (threshold) {
+    if (NULL == dir) {
+      dir = getenv("TMPDIR");
+    }
+    if (NULL == dir || '\0' == *dir) {
+      dir = "/tmp";
+    }
+    copy = strdup(dir);
+    if (NULL == copy) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    if (threshold < AMQP_MIN_BODY_FILE_SIZE) {
+      threshold = AMQP_MIN_BODY_FILE_SIZE;
+    }
+  }
+
+  free(state->body_file_dir);
+  state->body_file_dir = copy;
+  state->body_file_threshold = threshold;
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_map_body(char const *dir, size_t len, amqp_bytes_t *body)
+{
+  struct amqp_mapped_body_t_ *mapped;
+  size_t path_len = strlen(dir) + sizeof("/amqp-body-XXXXXX");
+  char *path;
+  void *bytes;
+  int fd;
+  int res;
+
+  mapped = malloc(sizeof(struct amqp_mapped_body_t_));
+  path = malloc(path_len);
+  if (NULL == mapped || NULL == path) {
+    free(mapped);
+    free(path);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  snprintf(path, path_len, "%s/amqp-body-XXXXXX", dir);
+
+  fd = mkstemp(path);
+  if (-1 == fd) {
+    free(mapped);
+    free(path);
+    return AMQP_STATUS_FILE_ERROR;
+  }
+  unlink(path);
+  free(path);
+
+  /* Reserve the blocks now; running out of disk while writing to the
+   * mapping would be a SIGBUS rather than an error */
+  do {
+    res = posix_fallocate(fd, 0, (off_t)len);
+  } while (EINTR == res);
+  if (EINVAL == res || EOPNOTSUPP == res) {
+    res = ftruncate(fd, (off_t)len) ? errno : 0;
+  }
+  if (res) {
+    close(fd);
+    free(mapped);
+    return AMQP_STATUS_FILE_ERROR;
+  }
+
+  bytes = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == bytes) {
+    free(mapped);
+    return AMQP_STATUS_FILE_ERROR;
+  }
+
+  mapped->bytes = bytes;
+  mapped->len = len;
+  LOCK_MAPPED_BODIES();
+  mapped->next = mapped_bodies;
+  mapped_bodies = mapped;
+  UNLOCK_MAPPED_BODIES();
+
+  body->bytes = bytes;
+  body->len = len;
+  return AMQP_STATUS_OK;
+}
+
+amqp_boolean_t
+amqp_unmap_body(amqp_bytes_t body)
+{
+  struct amqp_mapped_body_t_ **link;
+  struct amqp_mapped_body_t_ *mapped = NULL;
+
+  LOCK_MAPPED_BODIES();
+  for (link = &mapped_bodies; *link; link = &(*link)->next) {
+    if ((*link)->bytes == body.bytes) {
+      mapped = *link;
+      *link = mapped->next;
+      break;
+    }
+  }
+  UNLOCK_MAPPED_BODIES();
+
+  if (NULL == mapped) {
+    return 0;
+  }
+  munmap(mapped->bytes, mapped->len);
+  free(mapped);
+  return 1;
+}
+
+int
+amqp_write_fd(int fd, amqp_bytes_t data)
+{
+  char *bytes = data.bytes;
+  size_t left = data.len;
+
+  while (left) {
+    ssize_t res = write(fd, bytes, left);
+
+    if (res < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return AMQP_STATUS_FILE_ERROR;
+    }
+    bytes += res;
+    left -= (size_t)res;
+  }
+  return AMQP_STATUS_OK;
+}
@@ -0,0 +1,428 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+# include <errno.h>
+# include <unistd.h>
+#endif
+
+/*
+ * A large message is sent as a sequence of chunk messages, each carrying
+ * these headers next to any headers of the original message:
+ *
+ *   x-chunk-id      the transfer the chunk belongs to
+ *   x-chunk-index   the position of the chunk in the transfer, from 0
+ *   x-chunk-offset  the position of the chunk body in the message
+ *   x-chunk-last    true on the final chunk of the transfer
+ *
+ * When the message length is a multiple of the chunk size the final chunk
+ * has an empty body.
+ */
+
+#define AMQP_CHUNK_HEADER_COUNT 4
+
+static const char chunk_id_key[] = "x-chunk-id";
+static const char chunk_index_key[] = "x-chunk-index";
+static const char chunk_offset_key[] = "x-chunk-offset";
+static const char chunk_last_key[] = "x-chunk-last";
+
+struct amqp_chunk_transfer_t_ {
+  amqp_bytes_t id;
+  uint64_t next_index;
+  uint64_t next_offset;
+  struct amqp_chunk_transfer_t_ *next;
+};
+
+struct amqp_chunk_reassembler_t_ {
+  amqp_chunk_sink_fn sink;
+  void *user_data;
+  size_t max_transfers;
+  size_t transfer_count;
+  struct amqp_chunk_transfer_t_ *transfers;
+};
+
+static int
+key_equals(amqp_bytes_t key, const char *name)
+{
+  return key.len == strlen(name) && 0 == memcmp(key.bytes, name, key.len);
+}
+
+static int
+field_to_u64(amqp_field_value_t const *value, uint64_t *out)
+{
+  switch (value->kind) {
+    case AMQP_FIELD_KIND_U8:
+      *out = value->value.u8;
+      return 1;
+    case AMQP_FIELD_KIND_U16:
+      *out = value->value.u16;
+      return 1;
+    case AMQP_FIELD_KIND_U32:
+      *out = value->value.u32;
+      return 1;
+    case AMQP_FIELD_KIND_U64:
+      *out = value->value.u64;
+      return 1;
+    case AMQP_FIELD_KIND_I8:
+      *out = (uint64_t)value->value.i8;
+      return value->value.i8 >= 0;
+    case AMQP_FIELD_KIND_I16:
+      *out = (uint64_t)value->value.i16;
+      return value->value.i16 >= 0;
+    case AMQP_FIELD_KIND_I32:
+      *out = (uint64_t)value->value.i32;
+      return value->value.i32 >= 0;
+    case AMQP_FIELD_KIND_I64:
+      *out = (uint64_t)value->value.i64;
+      return value->value.i64 >= 0;
+    default:
+      return 0;
+  }
+}
+
+int
+amqp_chunk_info(amqp_message_t const *message, amqp_bytes_t *transfer_id,
+                uint64_t *index, uint64_t *offset, amqp_boolean_t *last)
+{
+  amqp_table_t const *headers = &message->properties.headers;
+  int found = 0;
+  int i;
+
+  if (!(message->properties._flags & AMQP_BASIC_HEADERS_FLAG)) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  for (i = 0; i < headers->num_entries; i++) {
+    amqp_table_entry_t const *entry = &headers->entries[i];
+
+    if (key_equals(entry->key, chunk_id_key)) {
+      if (AMQP_FIELD_KIND_UTF8 != entry->value.kind &&
+          AMQP_FIELD_KIND_BYTES != entry->value.kind) {
+        return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      *transfer_id = entry->value.value.bytes;
+      found |= 1;
+    } else if (key_equals(entry->key, chunk_index_key)) {
+      if (!field_to_u64(&entry->value, index)) {
+        return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      found |= 2;
+    } else if (key_equals(entry->key, chunk_offset_key)) {
+      if (!field_to_u64(&entry->value, offset)) {
+        return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      found |= 4;
+    } else if (key_equals(entry->key, chunk_last_key)) {
+      if (AMQP_FIELD_KIND_BOOLEAN != entry->value.kind) {
+        return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      *last = entry->value.value.boolean ? 1 : 0;
+      found |= 8;
+    }
+  }
+
+  if (0 == found) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (15 != found || 0 == transfer_id->len) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Fill buffer from the stream, stopping early only at the end of it */
+static int
+fill_chunk(amqp_chunk_read_fn read_fn, void *user_data, amqp_bytes_t buffer,
+           size_t *filled, amqp_boolean_t *eof)
+{
+  *filled = 0;
+  *eof = 0;
+
+  while (*filled < buffer.len) {
+    amqp_bytes_t rest;
+    size_t got = 0;
+    int res;
+
+    rest.bytes = (char *)buffer.bytes + *filled;
+    rest.len = buffer.len - *filled;
+    res = read_fn(user_data, rest, &got);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    if (0 == got) {
+      *eof = 1;
+      break;
+    }
+    if (got > rest.len) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+    *filled += got;
+  }
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_chunk_publish(amqp_connection_state_t state, amqp_channel_t channel,
+                   amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                   amqp_basic_properties_t const *properties,
+                   amqp_bytes_t transfer_id, size_t chunk_size,
+                   amqp_chunk_read_fn read_fn, void *user_data)
+{
+  amqp_basic_properties_t chunk_properties;
+  amqp_table_entry_t *entries;
+  amqp_table_entry_t *chunk_entries;
+  int user_entries = 0;
+  amqp_bytes_t buffer;
+  uint64_t index = 0;
+  uint64_t offset = 0;
+  int res;
+
+  if (0 == transfer_id.len || 0 == chunk_size || NULL == read_fn) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  if (properties) {
+    chunk_properties = *properties;
+    if (properties->_flags & AMQP_BASIC_HEADERS_FLAG) {
+      user_entries = properties->headers.num_entries;
+    }
+  } else {
+    memset(&chunk_properties, 0, sizeof(chunk_properties));
+  }
+
+  entries = malloc((user_entries + AMQP_CHUNK_HEADER_COUNT) *
+                   sizeof(amqp_table_entry_t));
+  buffer = amqp_bytes_malloc(chunk_size);
+  if (NULL == entries || NULL == buffer.bytes) {
+    free(entries);
+    amqp_bytes_free(buffer);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  if (user_entries) {
+    memcpy(entries, properties->headers.entries,
+           user_entries * sizeof(amqp_table_entry_t));
+  }
+  chunk_entries = entries + user_entries;
+  chunk_entries[0].key = amqp_cstring_bytes(chunk_id_key);
+  chunk_entries[0].value.kind = AMQP_FIELD_KIND_UTF8;
+  chunk_entries[0].value.value.bytes = transfer_id;
+  chunk_entries[1].key = amqp_cstring_bytes(chunk_index_key);
+  chunk_entries[1].value.kind = AMQP_FIELD_KIND_I64;
+  chunk_entries[2].key = amqp_cstring_bytes(chunk_offset_key);
+  chunk_entries[2].value.kind = AMQP_FIELD_KIND_I64;
+  chunk_entries[3].key = amqp_cstring_bytes(chunk_last_key);
+  chunk_entries[3].value.kind = AMQP_FIELD_KIND_BOOLEAN;
+
+  chunk_properties._flags |= AMQP_BASIC_HEADERS_FLAG;
+  chunk_properties.headers.num_entries = user_entries + AMQP_CHUNK_HEADER_COUNT;
+  chunk_properties.headers.entries = entries;
+
+  while (1) {
+    amqp_bytes_t body;
+    amqp_boolean_t eof;
+
+    res = fill_chunk(read_fn, user_data, buffer, &body.len, &eof);
+    if (AMQP_STATUS_OK != res) {
+      break;
+    }
+    body.bytes = buffer.bytes;
+
+    chunk_entries[1].value.value.i64 = (int64_t)index;
+    chunk_entries[2].value.value.i64 = (int64_t)offset;
+    chunk_entries[3].value.value.boolean = eof;
+
+    res = amqp_basic_publish(state, channel, exchange, routing_key, 0, 0,
+                             &chunk_properties, body);
+    if (AMQP_STATUS_OK != res || eof) {
+      break;
+    }
+    index++;
+    offset += body.len;
+  }
+
+  amqp_bytes_free(buffer);
+  free(entries);
+  return res;
+}
+
+#ifndef _WIN32
+static int
+read_fd(void *user_data, amqp_bytes_t buffer, size_t *read_len)
+{
+  int fd = *(int *)user_data;
+  ssize_t res;
+
+  do {
+    res = read(fd, buffer.bytes, buffer.len);
+  } while (-1 == res && EINTR == errno);
+
+  if (res < 0) {
+    return AMQP_STATUS_FILE_ERROR;
+  }
+  *read_len = (size_t)res;
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_chunk_publish_fd(amqp_connection_state_t state, amqp_channel_t channel,
+                      amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                      amqp_basic_properties_t const *properties,
+                      amqp_bytes_t transfer_id, size_t chunk_size, int fd)
+{
+  return amqp_chunk_publish(state, channel, exchange, routing_key, properties,
+                            transfer_id, chunk_size, read_fd, &fd);
+}
+#endif
+
+int
+amqp_chunk_reassembler_new(amqp_chunk_sink_fn sink, void *user_data,
+                           size_t max_transfers,
+                           amqp_chunk_reassembler_t **reassembler)
+{
+  amqp_chunk_reassembler_t *r;
+
+  if (NULL == sink || 0 == max_transfers) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  r = calloc(1, sizeof(amqp_chunk_reassembler_t));
+  if (NULL == r) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  r->sink = sink;
+  r->user_data = user_data;
+  r->max_transfers = max_transfers;
+
+  *reassembler = r;
+  return AMQP_STATUS_OK;
+}
+
+static void
+drop_transfer(amqp_chunk_reassembler_t *r,
+              struct amqp_chunk_transfer_t_ **link)
+{
+  struct amqp_chunk_transfer_t_ *transfer = *link;
+
+  *link = transfer->next;
+  amqp_bytes_free(transfer->id);
+  free(transfer);
+  r->transfer_count--;
+}
+
+void
+amqp_chunk_reassembler_free(amqp_chunk_reassembler_t *reassembler)
+{
+  if (NULL == reassembler) {
+    return;
+  }
+  while (reassembler->transfers) {
+    drop_transfer(reassembler, &reassembler->transfers);
+  }
+  free(reassembler);
+}
+
+size_t
+amqp_chunk_reassembler_pending(amqp_chunk_reassembler_t *reassembler)
+{
+  return reassembler->transfer_count;
+}
+
+int
+amqp_chunk_reassembler_add(amqp_chunk_reassembler_t *reassembler,
+                           amqp_message_t const *message)
+{
+  struct amqp_chunk_transfer_t_ **link;
+  struct amqp_chunk_transfer_t_ *transfer;
+  amqp_bytes_t transfer_id;
+  uint64_t index;
+  uint64_t offset;
+  amqp_boolean_t last;
+  int res;
+
+  res = amqp_chunk_info(message, &transfer_id, &index, &offset, &last);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  for (link = &reassembler->transfers; *link; link = &(*link)->next) {
+    if ((*link)->id.len == transfer_id.len &&
+        0 == memcmp((*link)->id.bytes, transfer_id.bytes, transfer_id.len)) {
+      break;
+    }
+  }
+  transfer = *link;
+
+  if (NULL == transfer) {
+    if (0 != index) {
+      /* Either the start of the transfer went missing, or this is a
+       * redelivery of a transfer that already finished or failed. A
+       * redelivered index 0 chunk starts the transfer over below. */
+      return AMQP_STATUS_CHUNK_MISSING;
+    }
+    if (0 != offset) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+    if (reassembler->transfer_count >= reassembler->max_transfers) {
+      return AMQP_STATUS_TOO_MANY_TRANSFERS;
+    }
+    transfer = calloc(1, sizeof(struct amqp_chunk_transfer_t_));
+    if (NULL == transfer) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    transfer->id = amqp_bytes_malloc_dup(transfer_id);
+    if (NULL == transfer->id.bytes) {
+      free(transfer);
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    *link = transfer;
+    reassembler->transfer_count++;
+  } else if (index < transfer->next_index) {
+    return AMQP_STATUS_CHUNK_DUPLICATE;
+  } else if (index > transfer->next_index ||
+             offset != transfer->next_offset) {
+    drop_transfer(reassembler, link);
+    return AMQP_STATUS_CHUNK_MISSING;
+  }
+
+  res = reassembler->sink(reassembler->user_data, transfer->id, offset,
+                          message->body, last);
+  if (AMQP_STATUS_OK != res || last) {
+    drop_transfer(reassembler, link);
+    return res;
+  }
+
+  transfer->next_index = index + 1;
+  transfer->next_offset = offset + message->body.len;
+  return AMQP_STATUS_OK;
+}
@@ -0,0 +1,250 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WITH_ZLIB
+# include <zlib.h>
+#endif
+
+/* Largest body a compressed message is allowed to inflate to */
+#ifndef AMQP_MAX_INFLATED_BODY_SIZE
+# define AMQP_MAX_INFLATED_BODY_SIZE (256 * 1024 * 1024)
+#endif
+
+int
+amqp_set_compression(amqp_connection_state_t state, char const *encoding,
+                     size_t threshold, amqp_codec_fn compress,
+                     amqp_codec_fn decompress, void *user_data)
+{
+  char *copy = NULL;
+
+  if (encoding) {
+    if (NULL == compress || NULL == decompress || '\0' == *encoding) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+    copy = strdup(encoding);
+    if (NULL == copy) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+  }
+
+  free(state->codec_encoding);
+  state->codec_encoding = copy;
+  state->codec_threshold = threshold;
+  state->codec_compress = encoding ? compress : NULL;
+  state->codec_decompress = encoding ? decompress : NULL;
+  state->codec_user_data = user_data;
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_compress_publish(amqp_connection_state_t state,
+                      amqp_basic_properties_t const **properties,
+                      amqp_bytes_t *body,
+                      amqp_basic_properties_t *compressed_properties,
+                      amqp_bytes_t *compressed)
+{
+  int res;
+
+  *compressed = amqp_empty_bytes;
+  if (NULL == state->codec_compress || body->len < state->codec_threshold ||
+      (*properties &&
+       ((*properties)->_flags & AMQP_BASIC_CONTENT_ENCODING_FLAG))) {
+    return AMQP_STATUS_OK;
+  }
+
+  res = state->codec_compress(state->codec_user_data, *body, compressed);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  if (compressed->len >= body->len) {
+    /* not worth it, send the body as is */
+    amqp_bytes_free(*compressed);
+    *compressed = amqp_empty_bytes;
+    return AMQP_STATUS_OK;
+  }
+
+  if (*properties) {
+    *compressed_properties = **properties;
+  } else {
+    memset(compressed_properties, 0, sizeof(amqp_basic_properties_t));
+  }
+  compressed_properties->_flags |= AMQP_BASIC_CONTENT_ENCODING_FLAG;
+  compressed_properties->content_encoding =
+    amqp_cstring_bytes(state->codec_encoding);
+
+  *properties = compressed_properties;
+  *body = *compressed;
+  return AMQP_STATUS_OK;
+}
+
+void
+amqp_decompress_message(amqp_connection_state_t state,
+                        amqp_message_t *message)
+{
+  amqp_basic_properties_t *properties = &message->properties;
+  amqp_bytes_t decompressed;
+
+  if (NULL == state->codec_decompress ||
+      !(properties->_flags & AMQP_BASIC_CONTENT_ENCODING_FLAG) ||
+      properties->content_encoding.len != strlen(state->codec_encoding) ||
+      memcmp(properties->content_encoding.bytes, state->codec_encoding,
+             properties->content_encoding.len)) {
+    return;
+  }
+
+  /* On failure the message is delivered as received, content_encoding
+   * still tells the application what the body is */
+  if (AMQP_STATUS_OK != state->codec_decompress(state->codec_user_data,
+                                                message->body,
+                                                &decompressed)) {
+    return;
+  }
+
+  amqp_free_message_body(message->body);
+  message->body = decompressed;
+  properties->_flags &= ~AMQP_BASIC_CONTENT_ENCODING_FLAG;
+  properties->content_encoding = amqp_empty_bytes;
+}
+
+#ifdef WITH_ZLIB
+static const int zlib_levels[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+
+static int AMQP_CALL
+zlib_compress(void *user_data, amqp_bytes_t input, amqp_bytes_t *output)
+{
+  uLongf len = compressBound(input.len);
+  amqp_bytes_t buffer = amqp_bytes_malloc(len);
+
+  if (NULL == buffer.bytes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  if (Z_OK != compress2(buffer.bytes, &len, input.bytes, input.len,
+                        *(const int *)user_data)) {
+    amqp_bytes_free(buffer);
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  buffer.len = len;
+  *output = buffer;
+  return AMQP_STATUS_OK;
+}
+
+static int AMQP_CALL
+zlib_decompress(void *user_data, amqp_bytes_t input, amqp_bytes_t *output)
+{
+  amqp_bytes_t buffer;
+  size_t size = input.len * 4 > 4096 ? input.len * 4 : 4096;
+  z_stream stream;
+  int res = AMQP_STATUS_OK;
+
+  (void)user_data;
+
+  memset(&stream, 0, sizeof(stream));
+  if (Z_OK != inflateInit(&stream)) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  buffer = amqp_bytes_malloc(size);
+  if (NULL == buffer.bytes) {
+    inflateEnd(&stream);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  stream.next_in = input.bytes;
+  stream.avail_in = input.len;
+
+  while (1) {
+    int z;
+
+    stream.next_out = (Bytef *)buffer.bytes + stream.total_out;
+    stream.avail_out = size - stream.total_out;
+    z = inflate(&stream, Z_NO_FLUSH);
+
+    if (Z_STREAM_END == z) {
+      break;
+    }
+    if (Z_OK != z && Z_BUF_ERROR != z) {
+      res = AMQP_STATUS_BAD_AMQP_DATA;
+      break;
+    }
+    if (0 != stream.avail_out) {
+      /* the input ended before the stream did */
+      res = AMQP_STATUS_BAD_AMQP_DATA;
+      break;
+    }
+
+    if (size >= AMQP_MAX_INFLATED_BODY_SIZE) {
+      res = AMQP_STATUS_BAD_AMQP_DATA;
+      break;
+    } else {
+      void *grown = realloc(buffer.bytes, size * 2);
+      if (NULL == grown) {
+        res = AMQP_STATUS_NO_MEMORY;
+        break;
+      }
+      buffer.bytes = grown;
+      size *= 2;
+    }
+  }
+
+  if (AMQP_STATUS_OK == res) {
+    buffer.len = stream.total_out;
+    *output = buffer;
+  } else {
+    amqp_bytes_free(buffer);
+  }
+  inflateEnd(&stream);
+  return res;
+}
+#endif
+
+int
+amqp_set_zlib_compression(amqp_connection_state_t state, size_t threshold,
+                          int level)
+{
+#ifdef WITH_ZLIB
+  if (Z_DEFAULT_COMPRESSION == level) {
+    level = 6;
+  }
+  if (level < 0 || level > 9) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  return amqp_set_compression(state, "deflate", threshold, zlib_compress,
+                              zlib_decompress, (void *)&zlib_levels[level]);
+#else
+  (void)state;
+  (void)threshold;
+  (void)level;
+  return AMQP_STATUS_INVALID_PARAMETER;
+#endif
+}
@@ -52,10 +52,6 @@
 #define AMQP_INITIAL_FRAME_POOL_PAGE_SIZE 65536
 #endif
 
-#ifndef AMQP_INITIAL_INBOUND_SOCK_BUFFER_SIZE
-#define AMQP_INITIAL_INBOUND_SOCK_BUFFER_SIZE 131072
-#endif
-
 
 #define ENFORCE_STATE(statevec, statenum)                                                 \
   {                                                                                       \
@@ -90,18 +86,14 @@ amqp_connection_state_t amqp_new_connection(void)
      is also the minimum frame size */
   state->target_size = 8;
 
-  state->sock_inbound_buffer.len = AMQP_INITIAL_INBOUND_SOCK_BUFFER_SIZE;
-  state->sock_inbound_buffer.bytes = malloc(AMQP_INITIAL_INBOUND_SOCK_BUFFER_SIZE);
-  if (state->sock_inbound_buffer.bytes == NULL) {
-    goto out_nomem;
-  }
+  /* sock_inbound_buffer is allocated on the first read from the socket */
+  state->sock_inbound_buffer = amqp_empty_bytes;
 
   init_amqp_pool(&state->properties_pool, 512);
 
   return state;
 
 out_nomem:
-  free(state->sock_inbound_buffer.bytes);
   free(state);
   return NULL;
 }
@@ -139,6 +131,7 @@ int amqp_tune_connection(amqp_connection_state_t state,
                          int heartbeat)
 {
   void *newbuf;
+  size_t outbound_len;
 
   ENFORCE_STATE(state, CONNECTION_STATE_IDLE);
 
@@ -147,7 +140,7 @@ int amqp_tune_connection(amqp_connection_state_t state,
   state->heartbeat = heartbeat;
 
   if (amqp_heartbeat_enabled(state)) {
-    uint64_t current_time = amqp_get_monotonic_timestamp();
+    uint64_t current_time = amqp_clock_refresh(&state->clock);
     if (0 == current_time) {
       return AMQP_STATUS_TIMER_FAILURE;
     }
@@ -155,12 +148,20 @@ int amqp_tune_connection(amqp_connection_state_t state,
     state->next_recv_heartbeat = amqp_calc_next_recv_heartbeat(state, current_time);
   }
 
-  state->outbound_buffer.len = frame_max;
-  newbuf = realloc(state->outbound_buffer.bytes, frame_max);
+  /* In low memory mode the outbound buffer starts small and grows on demand
+   * in amqp_send_frame() */
+  if (state->low_memory && frame_max > AMQP_LOW_MEMORY_BUFFER_SIZE) {
+    outbound_len = AMQP_LOW_MEMORY_BUFFER_SIZE;
+  } else {
+    outbound_len = frame_max;
+  }
+
+  newbuf = realloc(state->outbound_buffer.bytes, outbound_len);
   if (newbuf == NULL) {
     return AMQP_STATUS_NO_MEMORY;
   }
   state->outbound_buffer.bytes = newbuf;
+  state->outbound_buffer.len = outbound_len;
 
   return AMQP_STATUS_OK;
 }
@@ -170,6 +171,105 @@ int amqp_get_channel_max(amqp_connection_state_t state)
   return state->channel_max;
 }
 
+int amqp_set_low_memory_mode(amqp_connection_state_t state,
+                             amqp_boolean_t enable)
+{
+  state->low_memory = enable ? 1 : 0;
+  if (state->low_memory) {
+    amqp_shrink_buffers(state);
+  }
+  return AMQP_STATUS_OK;
+}
+
+static size_t pool_footprint(amqp_pool_t *pool)
+{
+  return pool->pages.num_blocks * (pool->pagesize + sizeof(void *))
+         + pool->large_blocks.num_blocks * sizeof(void *);
+}
+
+size_t amqp_get_connection_footprint(amqp_connection_state_t state)
+{
+  size_t footprint = sizeof(struct amqp_connection_state_t_);
+  int i;
+
+  footprint += state->outbound_buffer.len;
+  footprint += state->sock_inbound_buffer.len;
+  footprint += pool_footprint(&state->properties_pool);
+
+  for (i = 0; i < POOL_TABLE_SIZE; ++i) {
+    amqp_pool_table_entry_t *entry = state->pool_table[i];
+    for ( ; NULL != entry; entry = entry->next) {
+      footprint += sizeof(amqp_pool_table_entry_t) + pool_footprint(&entry->pool);
+    }
+  }
+
+  return footprint;
+}
+
+int amqp_resize_sock_inbound_buffer(amqp_connection_state_t state, size_t size)
+{
+  void *newbuf;
+
+  /* Never discard data that has been read but not yet consumed, the only
+   * bytes that survive a resize are a retained partial frame header at the
+   * front of the buffer */
+  assert(state->sock_inbound_offset >= state->sock_inbound_limit);
+  assert(size > state->sock_inbound_tail);
+
+  newbuf = realloc(state->sock_inbound_buffer.bytes, size);
+  if (NULL == newbuf) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  state->sock_inbound_buffer.bytes = newbuf;
+  state->sock_inbound_buffer.len = size;
+  state->sock_inbound_offset = 0;
+  state->sock_inbound_limit = 0;
+
+  return AMQP_STATUS_OK;
+}
+
+static int grow_outbound_buffer(amqp_connection_state_t state)
+{
+  void *newbuf;
+  size_t newlen = state->outbound_buffer.len * 2;
+
+  if (newlen > (size_t)state->frame_max) {
+    newlen = state->frame_max;
+  }
+
+  newbuf = realloc(state->outbound_buffer.bytes, newlen);
+  if (NULL == newbuf) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  state->outbound_buffer.bytes = newbuf;
+  state->outbound_buffer.len = newlen;
+
+  return AMQP_STATUS_OK;
+}
+
+void amqp_shrink_buffers(amqp_connection_state_t state)
+{
+  if (!state->low_memory) {
+    return;
+  }
+
+  if (state->outbound_buffer.len > AMQP_LOW_MEMORY_BUFFER_SIZE) {
+    void *newbuf = realloc(state->outbound_buffer.bytes,
+                           AMQP_LOW_MEMORY_BUFFER_SIZE);
+    /* failing to shrink is harmless, keep the bigger buffer */
+    if (NULL != newbuf) {
+      state->outbound_buffer.bytes = newbuf;
+      state->outbound_buffer.len = AMQP_LOW_MEMORY_BUFFER_SIZE;
+    }
+  }
+
+  if (state->sock_inbound_buffer.len > AMQP_LOW_MEMORY_BUFFER_SIZE &&
+      state->sock_inbound_offset >= state->sock_inbound_limit) {
+    /* likewise: a failed shrink leaves the buffer untouched */
+    amqp_resize_sock_inbound_buffer(state, AMQP_LOW_MEMORY_BUFFER_SIZE);
+  }
+}
+
 int amqp_destroy_connection(amqp_connection_state_t state)
 {
   int status = AMQP_STATUS_OK;
@@ -185,6 +285,9 @@ int amqp_destroy_connection(amqp_connection_state_t state)
       }
     }
 
+    amqp_free_parked_publishes(state);
+    free(state->codec_encoding);
+    free(state->body_file_dir);
     free(state->outbound_buffer.bytes);
     free(state->sock_inbound_buffer.bytes);
     amqp_socket_delete(state->socket);
@@ -354,6 +457,22 @@ int amqp_handle_input(amqp_connection_state_t state,
       encoded.len = state->target_size - HEADER_SIZE - 12 - FOOTER_SIZE;
       decoded_frame->payload.properties.raw = encoded;
 
+      if (state->header_filter &&
+          state->header_filter_channel == decoded_frame->channel &&
+          AMQP_BASIC_CLASS == decoded_frame->payload.properties.class_id &&
+          0 == amqp_header_filter_accepts(state->header_filter, encoded)) {
+        /* The message will be left out, so don't decode its properties.
+         * Without headers it won't pass the filter again later. */
+        decoded_frame->payload.properties.decoded =
+          amqp_pool_alloc(channel_pool, sizeof(amqp_basic_properties_t));
+        if (NULL == decoded_frame->payload.properties.decoded) {
+          return AMQP_STATUS_NO_MEMORY;
+        }
+        memset(decoded_frame->payload.properties.decoded, 0,
+               sizeof(amqp_basic_properties_t));
+        break;
+      }
+
       res = amqp_decode_properties(decoded_frame->payload.properties.class_id,
                                    channel_pool, encoded,
                                    &decoded_frame->payload.properties.decoded);
@@ -406,6 +525,8 @@ void amqp_release_buffers(amqp_connection_state_t state)
       amqp_maybe_release_buffers_on_channel(state, entry->channel);
     }
   }
+
+  amqp_shrink_buffers(state);
 }
 
 void amqp_maybe_release_buffers(amqp_connection_state_t state)
@@ -437,26 +558,86 @@ void amqp_maybe_release_buffers_on_channel(amqp_connection_state_t state, amqp_c
   pool = amqp_get_channel_pool(state, channel);
 
   if (pool != NULL) {
-    recycle_amqp_pool(pool);
+    if (state->low_memory) {
+      empty_amqp_pool(pool);
+    } else {
+      recycle_amqp_pool(pool);
+    }
   }
 }
 
-int amqp_send_frame(amqp_connection_state_t state,
-                    const amqp_frame_t *frame)
+static int encode_frame(amqp_bytes_t buffer, const amqp_frame_t *frame,
+                        size_t *out_frame_len)
 {
-  void *out_frame = state->outbound_buffer.bytes;
+  void *out_frame = buffer.bytes;
+  amqp_bytes_t encoded;
   int res;
 
   amqp_e8(out_frame, 0, frame->frame_type);
   amqp_e16(out_frame, 1, frame->channel);
 
+  switch (frame->frame_type) {
+  case AMQP_FRAME_METHOD:
+    amqp_e32(out_frame, HEADER_SIZE, frame->payload.method.id);
+
+    encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 4);
+    encoded.len = buffer.len - HEADER_SIZE - 4 - FOOTER_SIZE;
+
+    res = amqp_encode_method(frame->payload.method.id,
+                             frame->payload.method.decoded, encoded);
+    if (res < 0) {
+      return res;
+    }
+
+    *out_frame_len = res + 4;
+    break;
+
+  case AMQP_FRAME_HEADER:
+    amqp_e16(out_frame, HEADER_SIZE, frame->payload.properties.class_id);
+    amqp_e16(out_frame, HEADER_SIZE+2, 0); /* "weight" */
+    amqp_e64(out_frame, HEADER_SIZE+4, frame->payload.properties.body_size);
+
+    encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 12);
+    encoded.len = buffer.len - HEADER_SIZE - 12 - FOOTER_SIZE;
+
+    res = amqp_encode_properties(frame->payload.properties.class_id,
+                                 frame->payload.properties.decoded, encoded);
+    if (res < 0) {
+      return res;
+    }
+
+    *out_frame_len = res + 12;
+    break;
+
+  case AMQP_FRAME_HEARTBEAT:
+    *out_frame_len = 0;
+    break;
+
+  default:
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  amqp_e32(out_frame, 3, *out_frame_len);
+  amqp_e8(out_frame, *out_frame_len + HEADER_SIZE, AMQP_FRAME_END);
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_send_frame(amqp_connection_state_t state,
+                    const amqp_frame_t *frame)
+{
+  int res;
+
   if (frame->frame_type == AMQP_FRAME_BODY) {
     /* For a body frame, rather than copying data around, we use
        writev to compose the frame */
     struct iovec iov[3];
+    void *out_frame = state->outbound_buffer.bytes;
     uint8_t frame_end_byte = AMQP_FRAME_END;
     const amqp_bytes_t *body = &frame->payload.body_fragment;
 
+    amqp_e8(out_frame, 0, frame->frame_type);
+    amqp_e16(out_frame, 1, frame->channel);
     amqp_e32(out_frame, 3, body->len);
 
     iov[0].iov_base = out_frame;
@@ -469,57 +650,31 @@ int amqp_send_frame(amqp_connection_state_t state,
     res = amqp_socket_writev(state->socket, iov, 3);
   } else {
     size_t out_frame_len;
-    amqp_bytes_t encoded;
-
-    switch (frame->frame_type) {
-    case AMQP_FRAME_METHOD:
-      amqp_e32(out_frame, HEADER_SIZE, frame->payload.method.id);
-
-      encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 4);
-      encoded.len = state->outbound_buffer.len - HEADER_SIZE - 4 - FOOTER_SIZE;
 
-      res = amqp_encode_method(frame->payload.method.id,
-                               frame->payload.method.decoded, encoded);
-      if (res < 0) {
+    while (1) {
+      res = encode_frame(state->outbound_buffer, frame, &out_frame_len);
+      if (AMQP_STATUS_OK == res) {
+        break;
+      }
+      /* The outbound buffer may be smaller than frame_max in low memory mode,
+       * grow it and try again if the frame didn't fit */
+      if ((AMQP_STATUS_BAD_AMQP_DATA != res &&
+           AMQP_STATUS_TABLE_TOO_BIG != res) ||
+          state->outbound_buffer.len >= (size_t)state->frame_max) {
         return res;
       }
-
-      out_frame_len = res + 4;
-      break;
-
-    case AMQP_FRAME_HEADER:
-      amqp_e16(out_frame, HEADER_SIZE, frame->payload.properties.class_id);
-      amqp_e16(out_frame, HEADER_SIZE+2, 0); /* "weight" */
-      amqp_e64(out_frame, HEADER_SIZE+4, frame->payload.properties.body_size);
-
-      encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 12);
-      encoded.len = state->outbound_buffer.len - HEADER_SIZE - 12 - FOOTER_SIZE;
-
-      res = amqp_encode_properties(frame->payload.properties.class_id,
-                                   frame->payload.properties.decoded, encoded);
-      if (res < 0) {
+      res = grow_outbound_buffer(state);
+      if (AMQP_STATUS_OK != res) {
         return res;
       }
-
-      out_frame_len = res + 12;
-      break;
-
-    case AMQP_FRAME_HEARTBEAT:
-      out_frame_len = 0;
-      break;
-
-    default:
-      return AMQP_STATUS_INVALID_PARAMETER;
     }
 
-    amqp_e32(out_frame, 3, out_frame_len);
-    amqp_e8(out_frame, out_frame_len + HEADER_SIZE, AMQP_FRAME_END);
-    res = amqp_socket_send(state->socket, out_frame,
+    res = amqp_socket_send(state->socket, state->outbound_buffer.bytes,
                            out_frame_len + HEADER_SIZE + FOOTER_SIZE);
   }
 
   if (state->heartbeat > 0) {
-    uint64_t current_time = amqp_get_monotonic_timestamp();
+    uint64_t current_time = amqp_clock_now(&state->clock);
     if (0 == current_time) {
       return AMQP_STATUS_TIMER_FAILURE;
     }
@@ -528,8 +683,67 @@ int amqp_send_frame(amqp_connection_state_t state,
 
   return res;
 }
+
 amqp_table_t *
 amqp_get_server_properties(amqp_connection_state_t state)
 {
   return &state->server_properties;
 }
+
+int amqp_set_clock_source(amqp_connection_state_t state,
+                          amqp_clock_source_enum source,
+                          amqp_clock_fn clock_fn,
+                          void *user_data)
+{
+  amqp_clock_t clock;
+
+  switch (source) {
+  case AMQP_CLOCK_SOURCE_USER:
+    if (NULL == clock_fn) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+    break;
+
+  case AMQP_CLOCK_SOURCE_MONOTONIC:
+  case AMQP_CLOCK_SOURCE_MONOTONIC_COARSE:
+  case AMQP_CLOCK_SOURCE_CACHED:
+    clock_fn = NULL;
+    user_data = NULL;
+    break;
+
+  default:
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  clock.source = source;
+  clock.clock_fn = clock_fn;
+  clock.user_data = user_data;
+  clock.cached_timestamp = 0;
+
+  if (amqp_heartbeat_enabled(state)) {
+    /* The sources need not share an epoch, carry the time left until each
+     * heartbeat deadline over to the new one */
+    uint64_t old_time = amqp_clock_refresh(&state->clock);
+    uint64_t new_time = amqp_clock_refresh(&clock);
+    if (0 == old_time || 0 == new_time) {
+      return AMQP_STATUS_TIMER_FAILURE;
+    }
+
+    state->next_send_heartbeat = new_time +
+      (state->next_send_heartbeat > old_time ?
+       state->next_send_heartbeat - old_time : 0);
+    state->next_recv_heartbeat = new_time +
+      (state->next_recv_heartbeat > old_time ?
+       state->next_recv_heartbeat - old_time : 0);
+  }
+
+  state->clock = clock;
+  state->next_blocked_poll = 0;
+
+  return AMQP_STATUS_OK;
+}
+
+uint64_t amqp_clock_tick(amqp_connection_state_t state)
+{
+  return amqp_clock_refresh(&state->clock);
+}
@@ -117,10 +117,20 @@ int amqp_basic_properties_clone(amqp_basic_properties_t *original,
 }
 
 
+void amqp_free_message_body(amqp_bytes_t body)
+{
+#ifndef _WIN32
+  if (body.len >= AMQP_MIN_BODY_FILE_SIZE && amqp_unmap_body(body)) {
+    return;
+  }
+#endif
+  amqp_bytes_free(body);
+}
+
 void amqp_destroy_message(amqp_message_t *message)
 {
   empty_amqp_pool(&message->pool);
-  amqp_bytes_free(message->body);
+  amqp_free_message_body(message->body);
 }
 
 void amqp_destroy_envelope(amqp_envelope_t *envelope)
@@ -139,9 +149,17 @@ int amqp_bytes_malloc_dup_failed(amqp_bytes_t bytes) {
   return 0;
 }
 
-amqp_rpc_reply_t
-amqp_consume_message(amqp_connection_state_t state, amqp_envelope_t *envelope,
-                     struct timeval *timeout, AMQP_UNUSED int flags)
+static amqp_rpc_reply_t read_message(amqp_connection_state_t state,
+                                     amqp_channel_t channel,
+                                     amqp_message_t *message,
+                                     int fd,
+                                     amqp_header_filter_t const *filter,
+                                     amqp_boolean_t *matched);
+
+static amqp_rpc_reply_t
+consume_message(amqp_connection_state_t state, amqp_envelope_t *envelope,
+                struct timeval *timeout, amqp_header_filter_t const *filter,
+                amqp_boolean_t *matched)
 {
   int res;
   amqp_frame_t frame;
@@ -183,7 +201,13 @@ amqp_consume_message(amqp_connection_state_t state, amqp_envelope_t *envelope,
     goto error_out2;
   }
 
-  ret = amqp_read_message(state, envelope->channel, &envelope->message, 0);
+  /* lets amqp_handle_input() skip decoding the properties of a message
+   * that will be left out anyway */
+  state->header_filter = filter;
+  state->header_filter_channel = envelope->channel;
+  ret = read_message(state, envelope->channel, &envelope->message, -1,
+                     filter, matched);
+  state->header_filter = NULL;
   if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
     goto error_out2;
   }
@@ -199,16 +223,45 @@ error_out1:
   return ret;
 }
 
-amqp_rpc_reply_t amqp_read_message(amqp_connection_state_t state,
-                                   amqp_channel_t channel,
-                                   amqp_message_t *message,
-                                   AMQP_UNUSED int flags)
+amqp_rpc_reply_t
+amqp_consume_message(amqp_connection_state_t state, amqp_envelope_t *envelope,
+                     struct timeval *timeout, AMQP_UNUSED int flags)
+{
+  return consume_message(state, envelope, timeout, NULL, NULL);
+}
+
+amqp_rpc_reply_t
+amqp_consume_message_filtered(amqp_connection_state_t state,
+                              amqp_envelope_t *envelope,
+                              amqp_header_filter_t const *filter,
+                              amqp_boolean_t *matched,
+                              struct timeval *timeout,
+                              AMQP_UNUSED int flags)
+{
+  *matched = 1;
+  return consume_message(state, envelope, timeout, filter, matched);
+}
+
+/* Reads the body into memory when fd is -1, otherwise writes it to fd.
+ * A message that doesn't pass filter is read past, leaving message empty
+ * and matched false. */
+static amqp_rpc_reply_t read_message(amqp_connection_state_t state,
+                                     amqp_channel_t channel,
+                                     amqp_message_t *message,
+                                     int fd,
+                                     amqp_header_filter_t const *filter,
+                                     amqp_boolean_t *matched)
 {
   amqp_frame_t frame;
   amqp_rpc_reply_t ret;
 
+  uint64_t body_size;
+  amqp_boolean_t skip = 0;
   size_t body_read;
   char *body_read_ptr;
+  uint32_t checksum = 0;
+  uint32_t expected_checksum = 0;
+  int verify = 0;
   int res;
 
   memset(&ret, 0, sizeof(amqp_rpc_reply_t));
@@ -239,31 +292,58 @@ amqp_rpc_reply_t amqp_read_message(amqp_connection_state_t state,
     goto error_out1;
   }
 
+  body_size = frame.payload.properties.body_size;
   init_amqp_pool(&message->pool, 4096);
-  res = amqp_basic_properties_clone(frame.payload.properties.decoded,
-                                    &message->properties, &message->pool);
 
-  if (AMQP_STATUS_OK != res) {
-    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-    ret.library_error = res;
-    goto error_out3;
+  if (filter &&
+      !amqp_header_filter_match(filter, frame.payload.properties.decoded)) {
+    *matched = 0;
+    skip = 1;
+  } else {
+    res = amqp_basic_properties_clone(frame.payload.properties.decoded,
+                                      &message->properties, &message->pool);
+
+    if (AMQP_STATUS_OK != res) {
+      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      ret.library_error = res;
+      goto error_out3;
+    }
+  }
+
+  if (!skip) {
+    verify = amqp_checksum_expected(state, &message->properties,
+                                    &expected_checksum);
   }
 
-  if (0 == frame.payload.properties.body_size) {
+  if (0 == body_size || skip) {
     message->body = amqp_empty_bytes;
+  } else if (-1 != fd) {
+    message->body.bytes = NULL;
+    message->body.len = frame.payload.properties.body_size;
+#ifndef _WIN32
+  } else if (state->body_file_threshold &&
+             frame.payload.properties.body_size >= state->body_file_threshold) {
+    res = amqp_map_body(state->body_file_dir,
+                        frame.payload.properties.body_size, &message->body);
+    if (AMQP_STATUS_OK != res) {
+      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      ret.library_error = res;
+      goto error_out3;
+    }
+#endif
   } else {
     message->body = amqp_bytes_malloc(frame.payload.properties.body_size);
     if (NULL == message->body.bytes) {
       ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
       ret.library_error = AMQP_STATUS_NO_MEMORY;
-      goto error_out1;
+      goto error_out3;
     }
   }
 
   body_read = 0;
   body_read_ptr = message->body.bytes;
 
-  while (body_read < message->body.len) {
+  while (body_read < body_size) {
     res = amqp_simple_wait_frame_on_channel(state, channel, &frame);
     if (AMQP_STATUS_OK != res) {
       ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
@@ -284,25 +364,82 @@ amqp_rpc_reply_t amqp_read_message(amqp_connection_state_t state,
       goto error_out2;
     }
 
-    if (body_read + frame.payload.body_fragment.len > message->body.len) {
+    if (body_read + frame.payload.body_fragment.len > body_size) {
       ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
       ret.library_error = AMQP_STATUS_BAD_AMQP_DATA;
       goto error_out2;
     }
 
-    memcpy(body_read_ptr, frame.payload.body_fragment.bytes, frame.payload.body_fragment.len);
+    if (verify > 0) {
+      checksum = amqp_crc32c(checksum, frame.payload.body_fragment.bytes,
+                             frame.payload.body_fragment.len);
+    }
+
+    if (skip) {
+      /* nothing to keep */
+    } else if (-1 == fd) {
+      memcpy(body_read_ptr, frame.payload.body_fragment.bytes, frame.payload.body_fragment.len);
+      body_read_ptr += frame.payload.body_fragment.len;
+#ifndef _WIN32
+    } else {
+      res = amqp_write_fd(fd, frame.payload.body_fragment);
+      if (AMQP_STATUS_OK != res) {
+        ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+        ret.library_error = res;
+        goto error_out2;
+      }
+#endif
+    }
 
     body_read += frame.payload.body_fragment.len;
-    body_read_ptr += frame.payload.body_fragment.len;
+  }
+
+  /* checked before decompressing, the checksum covers the body as sent */
+  if (verify < 0 || (verify > 0 && checksum != expected_checksum)) {
+    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    ret.library_error = AMQP_STATUS_CHECKSUM_MISMATCH;
+    goto error_out2;
+  }
+
+  if (-1 == fd && !skip) {
+    amqp_decompress_message(state, message);
   }
 
   ret.reply_type = AMQP_RESPONSE_NORMAL;
   return ret;
 
 error_out2:
-  amqp_bytes_free(message->body);
+  amqp_free_message_body(message->body);
 error_out3:
   empty_amqp_pool(&message->pool);
 error_out1:
   return ret;
 }
+
+amqp_rpc_reply_t amqp_read_message(amqp_connection_state_t state,
+                                   amqp_channel_t channel,
+                                   amqp_message_t *message,
+                                   AMQP_UNUSED int flags)
+{
+  return read_message(state, channel, message, -1, NULL, NULL);
+}
+
+#ifndef _WIN32
+amqp_rpc_reply_t amqp_read_message_to_fd(amqp_connection_state_t state,
+                                         amqp_channel_t channel,
+                                         amqp_message_t *message,
+                                         int fd,
+                                         AMQP_UNUSED int flags)
+{
+  amqp_rpc_reply_t ret;
+
+  if (fd < 0) {
+    memset(&ret, 0, sizeof(amqp_rpc_reply_t));
+    memset(message, 0, sizeof(amqp_message_t));
+    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    ret.library_error = AMQP_STATUS_INVALID_PARAMETER;
+    return ret;
+  }
+  return read_message(state, channel, message, fd, NULL, NULL);
+}
+#endif
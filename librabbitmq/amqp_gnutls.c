@@ -27,6 +27,7 @@
 
 #include "amqp_ssl_socket.h"
 #include "amqp_private.h"
+#include "amqp_ssl_output.h"
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 #include <stdlib.h>
@@ -43,8 +44,7 @@ struct amqp_ssl_socket_t {
   gnutls_certificate_credentials_t credentials;
   int sockfd;
   char *host;
-  char *buffer;
-  size_t length;
+  amqp_ssl_output_t output;
   int last_error;
 };
 
@@ -65,38 +65,31 @@ amqp_ssl_socket_send(void *base,
   return status;
 }
 
+static ssize_t
+amqp_ssl_socket_output(void *base,
+                       const void *buf,
+                       size_t len)
+{
+  ssize_t status = amqp_ssl_socket_send(base, buf, len, 0);
+  if (status < 0) {
+    return AMQP_STATUS_SSL_ERROR;
+  }
+  return status;
+}
+
 static ssize_t
 amqp_ssl_socket_writev(void *base,
                        const struct iovec *iov,
                        int iovcnt)
 {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
-  ssize_t written = -1;
-  char *bufferp;
-  size_t bytes;
-  int i;
+  ssize_t written;
   self->last_error = 0;
-  bytes = 0;
-  for (i = 0; i < iovcnt; ++i) {
-    bytes += iov[i].iov_len;
-  }
-  if (self->length < bytes) {
-    free(self->buffer);
-    self->buffer = malloc(bytes);
-    if (!self->buffer) {
-      self->length = 0;
-      self->last_error = AMQP_STATUS_NO_MEMORY;
-      goto exit;
-    }
-    self->length = 0;
-  }
-  bufferp = self->buffer;
-  for (i = 0; i < iovcnt; ++i) {
-    memcpy(bufferp, iov[i].iov_base, iov[i].iov_len);
-    bufferp += iov[i].iov_len;
-  }
-  written = amqp_ssl_socket_send(self, self->buffer, bytes, 0);
-exit:
+  written = amqp_ssl_output_writev(&self->output, amqp_ssl_socket_output,
+                                   self, iov, iovcnt);
+  if (AMQP_STATUS_NO_MEMORY == written) {
+    self->last_error = AMQP_STATUS_NO_MEMORY;
+  }
   return written;
 }
 
@@ -162,7 +155,7 @@ amqp_ssl_socket_close(void *base)
     gnutls_deinit(self->session);
     gnutls_certificate_free_credentials(self->credentials);
     free(self->host);
-    free(self->buffer);
+    amqp_ssl_output_destroy(&self->output);
     free(self);
   }
   return status;
@@ -0,0 +1,434 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A filter is a list of clauses, one per header key, that must all hold.
+ * A clause holds when the header is present and, if the clause has
+ * values, equal to one of them. Strings match strings and byte strings,
+ * integers match integers of any width and signedness, booleans match
+ * booleans.
+ *
+ * amqp_header_filter_match_encoded() walks the encoded properties and only
+ * looks at the header values whose keys are in the filter, so nothing is
+ * allocated or copied.
+ */
+
+#define AMQP_HEADER_FILTER_MAX_CLAUSES 64
+
+enum header_value_class {
+  HEADER_VALUE_STRING,
+  HEADER_VALUE_INTEGER,
+  HEADER_VALUE_BOOLEAN
+};
+
+struct header_value {
+  enum header_value_class value_class;
+  amqp_bytes_t bytes;
+  amqp_boolean_t negative;
+  uint64_t magnitude;         /* integers, and booleans as 0 or 1 */
+};
+
+struct header_clause {
+  amqp_bytes_t key;
+  struct header_value *values;
+  size_t value_count;         /* 0 when the header only has to be present */
+};
+
+struct amqp_header_filter_t_ {
+  struct header_clause clauses[AMQP_HEADER_FILTER_MAX_CLAUSES];
+  int clause_count;
+};
+
+/* Returns false for kinds a filter can't compare */
+static amqp_boolean_t
+value_from_field(amqp_field_value_t const *field, struct header_value *value)
+{
+  value->negative = 0;
+  value->magnitude = 0;
+  value->bytes = amqp_empty_bytes;
+
+#define SIGNED_VALUE(member)                                                  \
+  value->value_class = HEADER_VALUE_INTEGER;                                  \
+  value->negative = field->value.member < 0;                                  \
+  value->magnitude = value->negative ?                                        \
+      0 - (uint64_t)field->value.member : (uint64_t)field->value.member;     \
+  return 1
+#define UNSIGNED_VALUE(member)                                                \
+  value->value_class = HEADER_VALUE_INTEGER;                                  \
+  value->magnitude = field->value.member;                                     \
+  return 1
+
+  switch (field->kind) {
+    case AMQP_FIELD_KIND_UTF8:
+    case AMQP_FIELD_KIND_BYTES:
+      value->value_class = HEADER_VALUE_STRING;
+      value->bytes = field->value.bytes;
+      return 1;
+    case AMQP_FIELD_KIND_BOOLEAN:
+      value->value_class = HEADER_VALUE_BOOLEAN;
+      value->magnitude = field->value.boolean ? 1 : 0;
+      return 1;
+    case AMQP_FIELD_KIND_I8:
+      SIGNED_VALUE(i8);
+    case AMQP_FIELD_KIND_I16:
+      SIGNED_VALUE(i16);
+    case AMQP_FIELD_KIND_I32:
+      SIGNED_VALUE(i32);
+    case AMQP_FIELD_KIND_I64:
+      SIGNED_VALUE(i64);
+    case AMQP_FIELD_KIND_U8:
+      UNSIGNED_VALUE(u8);
+    case AMQP_FIELD_KIND_U16:
+      UNSIGNED_VALUE(u16);
+    case AMQP_FIELD_KIND_U32:
+      UNSIGNED_VALUE(u32);
+    case AMQP_FIELD_KIND_U64:
+      UNSIGNED_VALUE(u64);
+    default:
+      return 0;
+  }
+#undef SIGNED_VALUE
+#undef UNSIGNED_VALUE
+}
+
+static amqp_boolean_t
+value_equals(struct header_value const *a, struct header_value const *b)
+{
+  if (a->value_class != b->value_class) {
+    return 0;
+  }
+  if (HEADER_VALUE_STRING == a->value_class) {
+    return a->bytes.len == b->bytes.len &&
+           (0 == a->bytes.len ||
+            0 == memcmp(a->bytes.bytes, b->bytes.bytes, a->bytes.len));
+  }
+  return a->negative == b->negative && a->magnitude == b->magnitude;
+}
+
+static struct header_clause *
+find_clause(amqp_header_filter_t const *filter, amqp_bytes_t key, int *index)
+{
+  int i;
+
+  for (i = 0; i < filter->clause_count; i++) {
+    amqp_bytes_t clause_key = filter->clauses[i].key;
+
+    if (clause_key.len == key.len &&
+        0 == memcmp(clause_key.bytes, key.bytes, key.len)) {
+      *index = i;
+      return (struct header_clause *)&filter->clauses[i];
+    }
+  }
+  return NULL;
+}
+
+int
+amqp_header_filter_new(amqp_header_filter_t **filter)
+{
+  *filter = calloc(1, sizeof(amqp_header_filter_t));
+  return *filter ? AMQP_STATUS_OK : AMQP_STATUS_NO_MEMORY;
+}
+
+void
+amqp_header_filter_free(amqp_header_filter_t *filter)
+{
+  int i;
+
+  if (NULL == filter) {
+    return;
+  }
+  for (i = 0; i < filter->clause_count; i++) {
+    struct header_clause *clause = &filter->clauses[i];
+    size_t j;
+
+    for (j = 0; j < clause->value_count; j++) {
+      amqp_bytes_free(clause->values[j].bytes);
+    }
+    free(clause->values);
+    amqp_bytes_free(clause->key);
+  }
+  free(filter);
+}
+
+int
+amqp_header_filter_add(amqp_header_filter_t *filter, amqp_bytes_t key,
+                       amqp_field_value_t const *value)
+{
+  struct header_clause *clause;
+  struct header_value compiled;
+  struct header_value *values;
+  int index;
+
+  if (0 == key.len ||
+      (value && !value_from_field(value, &compiled))) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  clause = find_clause(filter, key, &index);
+  if (NULL == clause) {
+    if (AMQP_HEADER_FILTER_MAX_CLAUSES == filter->clause_count) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+    clause = &filter->clauses[filter->clause_count];
+    clause->key = amqp_bytes_malloc_dup(key);
+    if (NULL == clause->key.bytes) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    filter->clause_count++;
+  }
+
+  if (NULL == value) {
+    return AMQP_STATUS_OK;
+  }
+
+  if (compiled.bytes.len) {
+    compiled.bytes = amqp_bytes_malloc_dup(compiled.bytes);
+    if (NULL == compiled.bytes.bytes) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+  }
+  values = realloc(clause->values,
+                   (clause->value_count + 1) * sizeof(struct header_value));
+  if (NULL == values) {
+    amqp_bytes_free(compiled.bytes);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  values[clause->value_count++] = compiled;
+  clause->values = values;
+  return AMQP_STATUS_OK;
+}
+
+/* Marks the clause for key as satisfied if value meets it */
+static void
+check_header(amqp_header_filter_t const *filter, amqp_bytes_t key,
+             amqp_field_value_t const *field, uint64_t *satisfied)
+{
+  struct header_clause const *clause;
+  struct header_value value;
+  size_t i;
+  int index;
+
+  clause = find_clause(filter, key, &index);
+  if (NULL == clause || (*satisfied & ((uint64_t)1 << index))) {
+    return;
+  }
+  if (0 == clause->value_count) {
+    *satisfied |= (uint64_t)1 << index;
+    return;
+  }
+  if (!value_from_field(field, &value)) {
+    return;
+  }
+  for (i = 0; i < clause->value_count; i++) {
+    if (value_equals(&clause->values[i], &value)) {
+      *satisfied |= (uint64_t)1 << index;
+      return;
+    }
+  }
+}
+
+static uint64_t
+all_clauses(amqp_header_filter_t const *filter)
+{
+  return AMQP_HEADER_FILTER_MAX_CLAUSES == filter->clause_count ?
+         ~(uint64_t)0 : ((uint64_t)1 << filter->clause_count) - 1;
+}
+
+amqp_boolean_t
+amqp_header_filter_match(amqp_header_filter_t const *filter,
+                         amqp_basic_properties_t const *properties)
+{
+  uint64_t satisfied = 0;
+  uint64_t all = all_clauses(filter);
+  int i;
+
+  if (0 == filter->clause_count) {
+    return 1;
+  }
+  if (!(properties->_flags & AMQP_BASIC_HEADERS_FLAG)) {
+    return 0;
+  }
+
+  for (i = 0; i < properties->headers.num_entries && satisfied != all; i++) {
+    amqp_table_entry_t const *entry = &properties->headers.entries[i];
+    check_header(filter, entry->key, &entry->value, &satisfied);
+  }
+  return satisfied == all;
+}
+
+/* Reads a header value, decoding it into field when it is a kind filters
+ * compare and just stepping over it otherwise */
+static int
+read_value(amqp_bytes_t encoded, size_t *offset, amqp_field_value_t *field)
+{
+  uint8_t kind;
+  uint32_t len;
+  size_t size;
+
+  if (!amqp_decode_8(encoded, offset, &kind)) {
+    return 0;
+  }
+  field->kind = kind;
+
+  switch (kind) {
+    case AMQP_FIELD_KIND_BOOLEAN: {
+      uint8_t val;
+      if (!amqp_decode_8(encoded, offset, &val)) {
+        return 0;
+      }
+      field->value.boolean = val ? 1 : 0;
+      return 1;
+    }
+    case AMQP_FIELD_KIND_I8:
+    case AMQP_FIELD_KIND_U8:
+      return amqp_decode_8(encoded, offset, &field->value.u8);
+    case AMQP_FIELD_KIND_I16:
+    case AMQP_FIELD_KIND_U16:
+      return amqp_decode_16(encoded, offset, &field->value.u16);
+    case AMQP_FIELD_KIND_I32:
+    case AMQP_FIELD_KIND_U32:
+      return amqp_decode_32(encoded, offset, &field->value.u32);
+    case AMQP_FIELD_KIND_I64:
+    case AMQP_FIELD_KIND_U64:
+      return amqp_decode_64(encoded, offset, &field->value.u64);
+    case AMQP_FIELD_KIND_UTF8:
+    case AMQP_FIELD_KIND_BYTES:
+      return amqp_decode_32(encoded, offset, &len) &&
+             amqp_decode_bytes(encoded, offset, &field->value.bytes, len);
+    case AMQP_FIELD_KIND_F32:
+      size = 4;
+      break;
+    case AMQP_FIELD_KIND_F64:
+    case AMQP_FIELD_KIND_TIMESTAMP:
+      size = 8;
+      break;
+    case AMQP_FIELD_KIND_DECIMAL:
+      size = 5;
+      break;
+    case AMQP_FIELD_KIND_VOID:
+      size = 0;
+      break;
+    case AMQP_FIELD_KIND_ARRAY:
+    case AMQP_FIELD_KIND_TABLE:
+      if (!amqp_decode_32(encoded, offset, &len)) {
+        return 0;
+      }
+      size = len;
+      break;
+    default:
+      return 0;
+  }
+
+  if (size > encoded.len - *offset) {
+    return 0;
+  }
+  *offset += size;
+  return 1;
+}
+
+int
+amqp_header_filter_accepts(amqp_header_filter_t const *filter,
+                           amqp_bytes_t encoded)
+{
+  amqp_boolean_t matched;
+  int res = amqp_header_filter_match_encoded(filter, encoded, &matched);
+
+  return AMQP_STATUS_OK == res ? matched : res;
+}
+
+int
+amqp_header_filter_match_encoded(amqp_header_filter_t const *filter,
+                                 amqp_bytes_t encoded,
+                                 amqp_boolean_t *matched)
+{
+  uint64_t satisfied = 0;
+  uint64_t all = all_clauses(filter);
+  size_t offset = 0;
+  uint16_t flags;
+  uint32_t table_len;
+  size_t table_end;
+
+  *matched = 0;
+
+  /* the basic class has fewer than 15 properties, so one flags word */
+  if (!amqp_decode_16(encoded, &offset, &flags) || (flags & 1)) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+  if (0 == filter->clause_count) {
+    *matched = 1;
+    return AMQP_STATUS_OK;
+  }
+  if (!(flags & AMQP_BASIC_HEADERS_FLAG)) {
+    return AMQP_STATUS_OK;
+  }
+
+  if (flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
+    uint8_t len;
+    if (!amqp_decode_8(encoded, &offset, &len) ||
+        len > encoded.len - offset) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+    offset += len;
+  }
+  if (flags & AMQP_BASIC_CONTENT_ENCODING_FLAG) {
+    uint8_t len;
+    if (!amqp_decode_8(encoded, &offset, &len) ||
+        len > encoded.len - offset) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+    offset += len;
+  }
+
+  if (!amqp_decode_32(encoded, &offset, &table_len) ||
+      table_len > encoded.len - offset) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+  table_end = offset + table_len;
+  encoded.len = table_end;
+
+  while (offset < table_end && satisfied != all) {
+    amqp_field_value_t field;
+    amqp_bytes_t key;
+    uint8_t key_len;
+
+    if (!amqp_decode_8(encoded, &offset, &key_len) ||
+        !amqp_decode_bytes(encoded, &offset, &key, key_len) ||
+        !read_value(encoded, &offset, &field)) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+    check_header(filter, key, &field, &satisfied);
+  }
+
+  *matched = satisfied == all;
+  return AMQP_STATUS_OK;
+}
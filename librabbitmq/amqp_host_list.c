@@ -0,0 +1,316 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+# ifndef WIN32_LEAN_AND_MEAN
+#  define WIN32_LEAN_AND_MEAN
+# endif
+# include <Windows.h>
+#else
+# include <poll.h>
+#endif
+
+#define AMQP_HOST_LIST_INITIAL_BACKOFF_MS 100
+#define AMQP_HOST_LIST_MAX_BACKOFF_MS 5000
+
+typedef struct amqp_host_entry_t_ {
+  char *host;
+  int port;
+  uint64_t last_failure;      /* monotonic ns, 0 if it never failed */
+} amqp_host_entry_t;
+
+struct amqp_host_list_t_ {
+  amqp_host_entry_t *entries;
+  int count;
+  int capacity;
+  amqp_host_policy_enum policy;
+  int current;                /* host last connected to, -1 if none */
+  amqp_boolean_t current_healthy;
+  int initial_backoff_ms;
+  int max_backoff_ms;
+  uint64_t seed;
+};
+
+amqp_host_list_t *
+amqp_host_list_new(void)
+{
+  amqp_host_list_t *hosts = calloc(1, sizeof(amqp_host_list_t));
+  if (NULL == hosts) {
+    return NULL;
+  }
+
+  hosts->policy = AMQP_HOST_POLICY_ORDERED;
+  hosts->current = -1;
+  hosts->initial_backoff_ms = AMQP_HOST_LIST_INITIAL_BACKOFF_MS;
+  hosts->max_backoff_ms = AMQP_HOST_LIST_MAX_BACKOFF_MS;
+  hosts->seed = amqp_get_monotonic_timestamp() | 1;
+  return hosts;
+}
+
+void
+amqp_host_list_free(amqp_host_list_t *hosts)
+{
+  int i;
+
+  if (NULL == hosts) {
+    return;
+  }
+  for (i = 0; i < hosts->count; ++i) {
+    free(hosts->entries[i].host);
+  }
+  free(hosts->entries);
+  free(hosts);
+}
+
+int
+amqp_host_list_add(amqp_host_list_t *hosts, const char *host, int port)
+{
+  amqp_host_entry_t *entry;
+
+  if (NULL == host || port < 0 || port > 65535) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  if (hosts->count == hosts->capacity) {
+    int capacity = hosts->capacity ? hosts->capacity * 2 : 4;
+    amqp_host_entry_t *entries = realloc(hosts->entries,
+                                         capacity * sizeof(amqp_host_entry_t));
+    if (NULL == entries) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    hosts->entries = entries;
+    hosts->capacity = capacity;
+  }
+
+  entry = &hosts->entries[hosts->count];
+  entry->host = strdup(host);
+  if (NULL == entry->host) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  entry->port = port;
+  entry->last_failure = 0;
+  hosts->count++;
+
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_host_list_size(amqp_host_list_t *hosts)
+{
+  return hosts->count;
+}
+
+int
+amqp_host_list_get(amqp_host_list_t *hosts, int index,
+                   const char **host, int *port)
+{
+  if (index < 0 || index >= hosts->count) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  *host = hosts->entries[index].host;
+  *port = hosts->entries[index].port;
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_host_list_current(amqp_host_list_t *hosts)
+{
+  return hosts->current;
+}
+
+void
+amqp_host_list_set_policy(amqp_host_list_t *hosts,
+                          amqp_host_policy_enum policy)
+{
+  hosts->policy = policy;
+}
+
+void
+amqp_host_list_set_backoff(amqp_host_list_t *hosts, int initial_ms,
+                           int max_ms)
+{
+  hosts->initial_backoff_ms = initial_ms > 0 ? initial_ms : 0;
+  hosts->max_backoff_ms = max_ms > hosts->initial_backoff_ms
+                          ? max_ms : hosts->initial_backoff_ms;
+}
+
+void
+amqp_host_list_mark_failed(amqp_host_list_t *hosts)
+{
+  if (hosts->current >= 0) {
+    hosts->entries[hosts->current].last_failure =
+        amqp_get_monotonic_timestamp();
+    hosts->current_healthy = 0;
+  }
+}
+
+/* xorshift64*, good enough for shuffling hosts and jittering delays */
+static uint32_t
+next_random(amqp_host_list_t *hosts)
+{
+  hosts->seed ^= hosts->seed >> 12;
+  hosts->seed ^= hosts->seed << 25;
+  hosts->seed ^= hosts->seed >> 27;
+  return (uint32_t)((hosts->seed * UINT64_C(2685821657736338717)) >> 32);
+}
+
+/* Fills order with the indexes of the hosts in the order they should be
+ * tried. A host that is still healthy is always tried first, so a reconnect
+ * sticks to it rather than moving on to the next host in the list. */
+static void
+order_hosts(amqp_host_list_t *hosts, int *order)
+{
+  int i;
+  int j;
+
+  for (i = 0; i < hosts->count; ++i) {
+    order[i] = i;
+  }
+
+  switch (hosts->policy) {
+  case AMQP_HOST_POLICY_RANDOM:
+    for (i = hosts->count - 1; i > 0; --i) {
+      int tmp;
+
+      j = next_random(hosts) % (i + 1);
+      tmp = order[i];
+      order[i] = order[j];
+      order[j] = tmp;
+    }
+    break;
+
+  case AMQP_HOST_POLICY_LEAST_RECENTLY_FAILED:
+    /* Stable insertion sort, hosts that never failed keep the list order */
+    for (i = 1; i < hosts->count; ++i) {
+      int idx = order[i];
+      uint64_t failed = hosts->entries[idx].last_failure;
+
+      for (j = i; j > 0 &&
+           hosts->entries[order[j - 1]].last_failure > failed; --j) {
+        order[j] = order[j - 1];
+      }
+      order[j] = idx;
+    }
+    break;
+
+  case AMQP_HOST_POLICY_ORDERED:
+  default:
+    break;
+  }
+
+  if (hosts->current >= 0 && hosts->current_healthy) {
+    for (i = 0; order[i] != hosts->current; ++i)
+      ;
+    for (; i > 0; --i) {
+      order[i] = order[i - 1];
+    }
+    order[0] = hosts->current;
+  }
+}
+
+/* Sleeps for a random time between zero and the exponential backoff for the
+ * given round ("full jitter") */
+static void
+backoff(amqp_host_list_t *hosts, int round)
+{
+  uint64_t delay = (uint64_t)hosts->initial_backoff_ms;
+  int ms;
+
+  while (--round > 0 && delay < (uint64_t)hosts->max_backoff_ms) {
+    delay *= 2;
+  }
+  if (delay > (uint64_t)hosts->max_backoff_ms) {
+    delay = hosts->max_backoff_ms;
+  }
+  if (0 == delay) {
+    return;
+  }
+
+  ms = (int)(next_random(hosts) % (delay + 1));
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  poll(NULL, 0, ms);
+#endif
+}
+
+int
+amqp_host_list_open(amqp_host_list_t *hosts, amqp_socket_t *socket,
+                    struct timeval *timeout, int max_rounds)
+{
+  int last_error = AMQP_STATUS_INVALID_PARAMETER;
+  int *order;
+  int round;
+  int i;
+
+  if (0 == hosts->count) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (max_rounds < 1) {
+    max_rounds = 1;
+  }
+
+  order = malloc(hosts->count * sizeof(int));
+  if (NULL == order) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  for (round = 0; round < max_rounds; ++round) {
+    if (round > 0) {
+      backoff(hosts, round);
+    }
+
+    order_hosts(hosts, order);
+    for (i = 0; i < hosts->count; ++i) {
+      amqp_host_entry_t *entry = &hosts->entries[order[i]];
+
+      last_error = amqp_socket_open_noblock(socket, entry->host, entry->port,
+                                            timeout);
+      if (AMQP_STATUS_OK == last_error) {
+        hosts->current = order[i];
+        hosts->current_healthy = 1;
+        goto out;
+      }
+
+      entry->last_failure = amqp_get_monotonic_timestamp();
+      if (order[i] == hosts->current) {
+        hosts->current_healthy = 0;
+      }
+    }
+  }
+
+out:
+  free(order);
+  return last_error;
+}
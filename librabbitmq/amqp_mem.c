@@ -195,6 +195,16 @@ amqp_bytes_t amqp_bytes_malloc_dup(amqp_bytes_t src)
   return result;
 }
 
+int amqp_bytes_dup(amqp_bytes_t src, amqp_bytes_t *dest)
+{
+  if (0 == src.len) {
+    *dest = amqp_empty_bytes;
+    return AMQP_STATUS_OK;
+  }
+  *dest = amqp_bytes_malloc_dup(src);
+  return dest->bytes ? AMQP_STATUS_OK : AMQP_STATUS_NO_MEMORY;
+}
+
 amqp_bytes_t amqp_bytes_malloc(size_t amount)
 {
   amqp_bytes_t result;
@@ -230,7 +240,8 @@ amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t state, amqp
   entry->next = state->pool_table[index];
   state->pool_table[index] = entry;
 
-  init_amqp_pool(&entry->pool, state->frame_max);
+  init_amqp_pool(&entry->pool, state->low_memory ? AMQP_LOW_MEMORY_BUFFER_SIZE
+                                                 : (size_t)state->frame_max);
 
   return &entry->pool;
 }
@@ -33,22 +33,38 @@
 #include "amqp_socket.h"
 #include "amqp_hostcheck.h"
 #include "amqp_private.h"
+#include "amqp_ssl_output.h"
 #include "threads.h"
 
 #include <ctype.h>
+#include <stdio.h>
 #include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) && \
+    defined(MSG_NOSIGNAL)
+# define AMQP_SSL_KTLS
+# include <errno.h>
+# include <sys/socket.h>
+#endif
+
+/* OpenSSL 1.1.0 and later initialize themselves once and do their own
+ * locking, older versions need the application to do both */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+# define AMQP_OPENSSL_SELF_LOCKING
+#endif
 
 static int initialize_openssl(void);
 static int destroy_openssl(void);
 
-static int open_ssl_connections = 0;
 static amqp_boolean_t do_initialize_openssl = 1;
-static amqp_boolean_t openssl_initialized = 0;
+static volatile amqp_boolean_t openssl_initialized = 0;
+
+#ifndef AMQP_OPENSSL_SELF_LOCKING
+static int open_ssl_connections = 0;
 
 #ifdef ENABLE_THREAD_SAFETY
 static unsigned long amqp_ssl_threadid_callback(void);
@@ -62,18 +78,50 @@ static pthread_mutex_t openssl_init_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 static pthread_mutex_t *amqp_openssl_lockarray = NULL;
 #endif /* ENABLE_THREAD_SAFETY */
+#endif /* AMQP_OPENSSL_SELF_LOCKING */
+
+#ifndef AMQP_SSL_SESSION_CACHE_SIZE
+#define AMQP_SSL_SESSION_CACHE_SIZE 64
+#endif
+
+typedef struct amqp_ssl_session_entry_t_ {
+  struct amqp_ssl_session_entry_t_ *next;
+  char *key;
+  SSL_SESSION *session;
+} amqp_ssl_session_entry_t;
+
+struct amqp_ssl_context_t_ {
+  SSL_CTX *ctx;
+  volatile long refcount;
+#ifdef ENABLE_THREAD_SAFETY
+  pthread_mutex_t mutex;
+#endif
+  /* client session cache, most recently stored session first */
+  amqp_boolean_t session_cache;
+  amqp_ssl_session_entry_t *sessions;
+  size_t num_sessions;
+  uint64_t session_hits;
+  uint64_t session_misses;
+};
 
 struct amqp_ssl_socket_t {
   const struct amqp_socket_class_t *klass;
-  SSL_CTX *ctx;
+  amqp_ssl_context_t *context;
   int sockfd;
   SSL *ssl;
-  char *buffer;
-  size_t length;
+  char *session_key;
+  amqp_ssl_output_t output;
   amqp_boolean_t verify;
+  amqp_boolean_t ktls;
+  amqp_boolean_t ktls_send;
   int internal_error;
 };
 
+static void context_lock(amqp_ssl_context_t *context);
+static void context_unlock(amqp_ssl_context_t *context);
+static void resume_session(struct amqp_ssl_socket_t *self);
+static void forget_session(struct amqp_ssl_socket_t *self);
+
 static ssize_t
 amqp_ssl_socket_send(void *base,
                      const void *buf,
@@ -107,37 +155,66 @@ amqp_ssl_socket_send(void *base,
   return res;
 }
 
+#ifdef AMQP_SSL_KTLS
+/* With kTLS the kernel does the record layer encryption, so the iovecs can
+ * be handed to the socket as they are */
+static ssize_t
+amqp_ssl_socket_ktls_writev(struct amqp_ssl_socket_t *self,
+                            struct iovec *iov,
+                            int iovcnt)
+{
+  struct msghdr msg;
+  ssize_t res;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+
+  while (msg.msg_iovlen > 0) {
+    res = sendmsg(self->sockfd, &msg, MSG_NOSIGNAL);
+    if (res < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      self->internal_error = errno;
+      return AMQP_STATUS_SOCKET_ERROR;
+    }
+
+    /* skip over what was written */
+    while (msg.msg_iovlen > 0 && (size_t)res >= msg.msg_iov->iov_len) {
+      res -= msg.msg_iov->iov_len;
+      ++msg.msg_iov;
+      --msg.msg_iovlen;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + res;
+      msg.msg_iov->iov_len -= res;
+    }
+  }
+
+  self->internal_error = 0;
+  return AMQP_STATUS_OK;
+}
+#endif /* AMQP_SSL_KTLS */
+
 static ssize_t
 amqp_ssl_socket_writev(void *base,
                        struct iovec *iov,
                        int iovcnt)
 {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
-  ssize_t ret = -1;
-  char *bufferp;
-  size_t bytes;
-  int i;
-  bytes = 0;
-  for (i = 0; i < iovcnt; ++i) {
-    bytes += iov[i].iov_len;
-  }
-  if (self->length < bytes) {
-    self->buffer = realloc(self->buffer, bytes);
-    if (!self->buffer) {
-      self->length = 0;
-      ret = AMQP_STATUS_NO_MEMORY;
-      goto exit;
-    }
-    self->length = bytes;
+  ssize_t res;
+#ifdef AMQP_SSL_KTLS
+  if (self->ktls_send) {
+    return amqp_ssl_socket_ktls_writev(self, iov, iovcnt);
   }
-  bufferp = self->buffer;
-  for (i = 0; i < iovcnt; ++i) {
-    memcpy(bufferp, iov[i].iov_base, iov[i].iov_len);
-    bufferp += iov[i].iov_len;
+#endif
+  res = amqp_ssl_output_writev(&self->output, amqp_ssl_socket_send, self,
+                               iov, iovcnt);
+  if (res < 0) {
+    return res;
   }
-  ret = amqp_ssl_socket_send(self, self->buffer, bytes);
-exit:
-  return ret;
+  return AMQP_STATUS_OK;
 }
 
 static ssize_t
@@ -232,9 +309,19 @@ amqp_ssl_socket_open(void *base, const char *host, int port, struct timeval *tim
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
   long result;
   int status;
+  amqp_timer_t timer;
   ERR_clear_error();
 
-  self->ssl = SSL_new(self->ctx);
+  /* The TCP connect and the TLS handshake share the deadline */
+  AMQP_INIT_TIMER(timer)
+  if (timeout) {
+    status = amqp_timer_update(&timer, timeout);
+    if (AMQP_STATUS_OK != status) {
+      return status;
+    }
+  }
+
+  self->ssl = SSL_new(self->context->ctx);
   if (!self->ssl) {
     self->internal_error = ERR_peek_error();
     status = AMQP_STATUS_SSL_ERROR;
@@ -242,6 +329,26 @@ amqp_ssl_socket_open(void *base, const char *host, int port, struct timeval *tim
   }
 
   SSL_set_mode(self->ssl, SSL_MODE_AUTO_RETRY);
+  SSL_set_app_data(self->ssl, self);
+#ifdef AMQP_SSL_KTLS
+  if (self->ktls) {
+    SSL_set_options(self->ssl, SSL_OP_ENABLE_KTLS);
+  }
+#endif
+
+  if (self->context->session_cache) {
+    /* "host:port" */
+    size_t key_len = strlen(host) + 1 + 5 + 1;
+    free(self->session_key);
+    self->session_key = malloc(key_len);
+    if (!self->session_key) {
+      status = AMQP_STATUS_NO_MEMORY;
+      goto error_out1;
+    }
+    snprintf(self->session_key, key_len, "%s:%d", host, port);
+    resume_session(self);
+  }
+
   self->sockfd = amqp_open_socket_noblock(host, port, timeout);
   if (0 > self->sockfd) {
     status = self->sockfd;
@@ -257,13 +364,61 @@ amqp_ssl_socket_open(void *base, const char *host, int port, struct timeval *tim
     goto error_out2;
   }
 
-  status = SSL_connect(self->ssl);
-  if (!status) {
+  if (timeout) {
+    /* Run the handshake non-blocking so it cannot outlast the timeout */
+    status = amqp_os_socket_setsockblock(self->sockfd, 0);
+    if (AMQP_STATUS_OK != status) {
+      self->internal_error = amqp_os_socket_error();
+      goto error_out2;
+    }
+  }
+
+  while (1) {
+    status = SSL_connect(self->ssl);
+    if (1 == status) {
+      break;
+    }
+
     self->internal_error = SSL_get_error(self->ssl, status);
+    if (timeout && (SSL_ERROR_WANT_READ == self->internal_error ||
+                    SSL_ERROR_WANT_WRITE == self->internal_error)) {
+      status = amqp_os_socket_wait(self->sockfd,
+                                   SSL_ERROR_WANT_WRITE == self->internal_error,
+                                   &timer, timeout);
+      if (AMQP_STATUS_OK != status) {
+        goto error_out2;
+      }
+      continue;
+    }
+
     status = AMQP_STATUS_SSL_CONNECTION_FAILED;
     goto error_out2;
   }
 
+  if (timeout) {
+    status = amqp_os_socket_setsockblock(self->sockfd, 1);
+    if (AMQP_STATUS_OK != status) {
+      self->internal_error = amqp_os_socket_error();
+      goto error_out3;
+    }
+  }
+
+#ifdef AMQP_SSL_KTLS
+  /* Whether the kernel took over depends on the kernel, the negotiated
+   * cipher and how OpenSSL was built; SSL_write is used otherwise */
+  self->ktls_send = self->ktls && BIO_get_ktls_send(SSL_get_wbio(self->ssl));
+#endif
+
+  if (self->context->session_cache) {
+    context_lock(self->context);
+    if (SSL_session_reused(self->ssl)) {
+      ++self->context->session_hits;
+    } else {
+      ++self->context->session_misses;
+    }
+    context_unlock(self->context);
+  }
+
   result = SSL_get_verify_result(self->ssl);
   if (X509_V_OK != result) {
     self->internal_error = result;
@@ -286,6 +441,9 @@ exit:
   return status;
 
 error_out3:
+  if (self->session_key) {
+    forget_session(self);
+  }
   SSL_shutdown(self->ssl);
 error_out2:
   amqp_os_socket_close(self->sockfd);
@@ -307,6 +465,10 @@ amqp_ssl_socket_close(void *base)
     self->ssl = NULL;
   }
 
+  free(self->session_key);
+  self->session_key = NULL;
+  self->ktls_send = 0;
+
   if (-1 != self->sockfd) {
     if (amqp_os_socket_close(self->sockfd)) {
       return AMQP_STATUS_SOCKET_ERROR;
@@ -333,8 +495,8 @@ amqp_ssl_socket_delete(void *base)
   if (self) {
     amqp_ssl_socket_close(self);
 
-    SSL_CTX_free(self->ctx);
-    free(self->buffer);
+    amqp_ssl_context_free(self->context);
+    amqp_ssl_output_destroy(&self->output);
     free(self);
   }
   destroy_openssl();
@@ -350,48 +512,249 @@ static const struct amqp_socket_class_t amqp_ssl_socket_class = {
   amqp_ssl_socket_delete /* delete */
 };
 
-amqp_socket_t *
-amqp_ssl_socket_new(amqp_connection_state_t state)
+amqp_ssl_context_t *
+amqp_ssl_context_new(void)
 {
-  struct amqp_ssl_socket_t *self = calloc(1, sizeof(*self));
-  int status;
-  if (!self) {
+  amqp_ssl_context_t *context = calloc(1, sizeof(*context));
+  if (!context) {
     return NULL;
   }
 
-  self->sockfd = -1;
-  self->klass = &amqp_ssl_socket_class;
-  self->verify = 1;
+  if (initialize_openssl()) {
+    free(context);
+    return NULL;
+  }
 
-  status = initialize_openssl();
-  if (status) {
-    goto error;
+#ifdef ENABLE_THREAD_SAFETY
+  if (pthread_mutex_init(&context->mutex, NULL)) {
+    goto error_out1;
   }
+#endif
 
-  self->ctx = SSL_CTX_new(SSLv23_client_method());
-  if (!self->ctx) {
-    goto error;
+  context->ctx = SSL_CTX_new(SSLv23_client_method());
+  if (!context->ctx) {
+    goto error_out2;
   }
+  context->refcount = 1;
 
-  amqp_set_socket(state, (amqp_socket_t *)self);
+  return context;
 
-  return (amqp_socket_t *)self;
-error:
-  amqp_ssl_socket_delete((amqp_socket_t *)self);
+error_out2:
+#ifdef ENABLE_THREAD_SAFETY
+  pthread_mutex_destroy(&context->mutex);
+error_out1:
+#endif
+  free(context);
+  destroy_openssl();
   return NULL;
 }
 
+static void
+context_lock(AMQP_UNUSED amqp_ssl_context_t *context)
+{
+#ifdef ENABLE_THREAD_SAFETY
+  if (pthread_mutex_lock(&context->mutex)) {
+    amqp_abort("Runtime error: Failure in trying to lock SSL context mutex");
+  }
+#endif
+}
+
+static void
+context_unlock(AMQP_UNUSED amqp_ssl_context_t *context)
+{
+#ifdef ENABLE_THREAD_SAFETY
+  pthread_mutex_unlock(&context->mutex);
+#endif
+}
+
+static long
+atomic_add(volatile long *value, long delta)
+{
+#if !defined(ENABLE_THREAD_SAFETY)
+  return *value += delta;
+#elif defined(_WIN32)
+  return InterlockedExchangeAdd(value, delta) + delta;
+#else
+  return __sync_add_and_fetch(value, delta);
+#endif
+}
+
+static amqp_ssl_context_t *
+amqp_ssl_context_ref(amqp_ssl_context_t *context)
+{
+  atomic_add(&context->refcount, 1);
+  return context;
+}
+
+static void
+session_entry_free(amqp_ssl_session_entry_t *entry)
+{
+  SSL_SESSION_free(entry->session);
+  free(entry->key);
+  free(entry);
+}
+
+/* Called by OpenSSL with a new session, once the handshake completes or, for
+ * TLS 1.3, when the server sends a session ticket */
+static int
+new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+  struct amqp_ssl_socket_t *self = SSL_get_app_data(ssl);
+  amqp_ssl_context_t *context;
+  amqp_ssl_session_entry_t *entry;
+  amqp_ssl_session_entry_t **prev;
+
+  if (!self || !self->session_key) {
+    return 0;
+  }
+  context = self->context;
+
+  context_lock(context);
+  for (prev = &context->sessions; *prev; prev = &(*prev)->next) {
+    if (!strcmp((*prev)->key, self->session_key)) {
+      break;
+    }
+  }
+
+  entry = *prev;
+  if (entry) {
+    /* unlink it, it goes back in at the front */
+    *prev = entry->next;
+    SSL_SESSION_free(entry->session);
+  } else {
+    if (context->num_sessions >= AMQP_SSL_SESSION_CACHE_SIZE) {
+      /* evict the least recently stored session */
+      for (prev = &context->sessions; (*prev)->next; prev = &(*prev)->next)
+        ;
+      session_entry_free(*prev);
+      *prev = NULL;
+      --context->num_sessions;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+      context_unlock(context);
+      return 0;
+    }
+    entry->key = strdup(self->session_key);
+    if (!entry->key) {
+      free(entry);
+      context_unlock(context);
+      return 0;
+    }
+    ++context->num_sessions;
+  }
+
+  entry->session = session;
+  entry->next = context->sessions;
+  context->sessions = entry;
+  context_unlock(context);
+
+  /* we've kept the reference OpenSSL handed to us */
+  return 1;
+}
+
+/* Offer a cached session for host:port, if there is one */
+static void
+resume_session(struct amqp_ssl_socket_t *self)
+{
+  amqp_ssl_context_t *context = self->context;
+  amqp_ssl_session_entry_t *entry;
+
+  context_lock(context);
+  for (entry = context->sessions; entry; entry = entry->next) {
+    if (!strcmp(entry->key, self->session_key)) {
+      SSL_set_session(self->ssl, entry->session);
+      break;
+    }
+  }
+  context_unlock(context);
+}
+
+/* Drop the cached session for host:port, e.g., when the peer failed
+ * verification */
+static void
+forget_session(struct amqp_ssl_socket_t *self)
+{
+  amqp_ssl_context_t *context = self->context;
+  amqp_ssl_session_entry_t **prev;
+
+  context_lock(context);
+  for (prev = &context->sessions; *prev; prev = &(*prev)->next) {
+    if (!strcmp((*prev)->key, self->session_key)) {
+      amqp_ssl_session_entry_t *entry = *prev;
+      *prev = entry->next;
+      session_entry_free(entry);
+      --context->num_sessions;
+      break;
+    }
+  }
+  context_unlock(context);
+}
+
 int
-amqp_ssl_socket_set_cacert(amqp_socket_t *base,
-                           const char *cacert)
+amqp_ssl_context_set_session_cache(amqp_ssl_context_t *context,
+                                   amqp_boolean_t enable)
 {
-  int status;
-  struct amqp_ssl_socket_t *self;
-  if (base->klass != &amqp_ssl_socket_class) {
-    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+  context_lock(context);
+  context->session_cache = enable ? 1 : 0;
+  if (context->session_cache) {
+    SSL_CTX_set_session_cache_mode(context->ctx, SSL_SESS_CACHE_CLIENT |
+                                   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(context->ctx, new_session_cb);
+  } else {
+    SSL_CTX_set_session_cache_mode(context->ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_sess_set_new_cb(context->ctx, NULL);
+    while (context->sessions) {
+      amqp_ssl_session_entry_t *entry = context->sessions;
+      context->sessions = entry->next;
+      session_entry_free(entry);
+    }
+    context->num_sessions = 0;
   }
-  self = (struct amqp_ssl_socket_t *)base;
-  status = SSL_CTX_load_verify_locations(self->ctx, cacert, NULL);
+  context_unlock(context);
+  return AMQP_STATUS_OK;
+}
+
+void
+amqp_ssl_context_get_session_stats(amqp_ssl_context_t *context,
+                                   amqp_ssl_session_stats_t *stats)
+{
+  context_lock(context);
+  stats->hits = context->session_hits;
+  stats->misses = context->session_misses;
+  stats->cached = context->num_sessions;
+  context_unlock(context);
+}
+
+void
+amqp_ssl_context_free(amqp_ssl_context_t *context)
+{
+  if (!context) {
+    return;
+  }
+
+  if (0 == atomic_add(&context->refcount, -1)) {
+    while (context->sessions) {
+      amqp_ssl_session_entry_t *entry = context->sessions;
+      context->sessions = entry->next;
+      session_entry_free(entry);
+    }
+    SSL_CTX_free(context->ctx);
+#ifdef ENABLE_THREAD_SAFETY
+    pthread_mutex_destroy(&context->mutex);
+#endif
+    free(context);
+    destroy_openssl();
+  }
+}
+
+int
+amqp_ssl_context_set_cacert(amqp_ssl_context_t *context,
+                            const char *cacert)
+{
+  int status;
+  status = SSL_CTX_load_verify_locations(context->ctx, cacert, NULL);
   if (1 != status) {
     return AMQP_STATUS_SSL_ERROR;
   }
@@ -399,21 +762,16 @@ amqp_ssl_socket_set_cacert(amqp_socket_t *base,
 }
 
 int
-amqp_ssl_socket_set_key(amqp_socket_t *base,
-                        const char *cert,
-                        const char *key)
+amqp_ssl_context_set_key(amqp_ssl_context_t *context,
+                         const char *cert,
+                         const char *key)
 {
   int status;
-  struct amqp_ssl_socket_t *self;
-  if (base->klass != &amqp_ssl_socket_class) {
-    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
-  }
-  self = (struct amqp_ssl_socket_t *)base;
-  status = SSL_CTX_use_certificate_chain_file(self->ctx, cert);
+  status = SSL_CTX_use_certificate_chain_file(context->ctx, cert);
   if (1 != status) {
     return AMQP_STATUS_SSL_ERROR;
   }
-  status = SSL_CTX_use_PrivateKey_file(self->ctx, key,
+  status = SSL_CTX_use_PrivateKey_file(context->ctx, key,
                                        SSL_FILETYPE_PEM);
   if (1 != status) {
     return AMQP_STATUS_SSL_ERROR;
@@ -432,20 +790,15 @@ password_cb(AMQP_UNUSED char *buffer,
 }
 
 int
-amqp_ssl_socket_set_key_buffer(amqp_socket_t *base,
-                               const char *cert,
-                               const void *key,
-                               size_t n)
+amqp_ssl_context_set_key_buffer(amqp_ssl_context_t *context,
+                                const char *cert,
+                                const void *key,
+                                size_t n)
 {
   int status = AMQP_STATUS_OK;
   BIO *buf = NULL;
   RSA *rsa = NULL;
-  struct amqp_ssl_socket_t *self;
-  if (base->klass != &amqp_ssl_socket_class) {
-    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
-  }
-  self = (struct amqp_ssl_socket_t *)base;
-  status = SSL_CTX_use_certificate_chain_file(self->ctx, cert);
+  status = SSL_CTX_use_certificate_chain_file(context->ctx, cert);
   if (1 != status) {
     return AMQP_STATUS_SSL_ERROR;
   }
@@ -457,10 +810,11 @@ amqp_ssl_socket_set_key_buffer(amqp_socket_t *base,
   if (!rsa) {
     goto error;
   }
-  status = SSL_CTX_use_RSAPrivateKey(self->ctx, rsa);
+  status = SSL_CTX_use_RSAPrivateKey(context->ctx, rsa);
   if (1 != status) {
     goto error;
   }
+  status = AMQP_STATUS_OK;
 exit:
   BIO_vfree(buf);
   RSA_free(rsa);
@@ -471,20 +825,118 @@ error:
 }
 
 int
-amqp_ssl_socket_set_cert(amqp_socket_t *base,
-                         const char *cert)
+amqp_ssl_context_set_cert(amqp_ssl_context_t *context,
+                          const char *cert)
 {
   int status;
+  status = SSL_CTX_use_certificate_chain_file(context->ctx, cert);
+  if (1 != status) {
+    return AMQP_STATUS_SSL_ERROR;
+  }
+  return AMQP_STATUS_OK;
+}
+
+static amqp_socket_t *
+ssl_socket_new(amqp_connection_state_t state,
+               amqp_ssl_context_t *context)
+{
+  struct amqp_ssl_socket_t *self = calloc(1, sizeof(*self));
+  int status;
+  if (!self) {
+    return NULL;
+  }
+
+  self->sockfd = -1;
+  self->klass = &amqp_ssl_socket_class;
+  self->verify = 1;
+
+  status = initialize_openssl();
+  if (status) {
+    goto error;
+  }
+
+  if (context) {
+    self->context = amqp_ssl_context_ref(context);
+  } else {
+    self->context = amqp_ssl_context_new();
+    if (!self->context) {
+      goto error;
+    }
+  }
+
+  amqp_set_socket(state, (amqp_socket_t *)self);
+
+  return (amqp_socket_t *)self;
+error:
+  amqp_ssl_socket_delete((amqp_socket_t *)self);
+  return NULL;
+}
+
+amqp_socket_t *
+amqp_ssl_socket_new(amqp_connection_state_t state)
+{
+  return ssl_socket_new(state, NULL);
+}
+
+amqp_socket_t *
+amqp_ssl_socket_new_with_context(amqp_connection_state_t state,
+                                 amqp_ssl_context_t *context)
+{
+  if (!context) {
+    return NULL;
+  }
+  return ssl_socket_new(state, context);
+}
+
+int
+amqp_ssl_socket_set_cacert(amqp_socket_t *base,
+                           const char *cacert)
+{
   struct amqp_ssl_socket_t *self;
   if (base->klass != &amqp_ssl_socket_class) {
     amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
   }
   self = (struct amqp_ssl_socket_t *)base;
-  status = SSL_CTX_use_certificate_chain_file(self->ctx, cert);
-  if (1 != status) {
-    return AMQP_STATUS_SSL_ERROR;
+  return amqp_ssl_context_set_cacert(self->context, cacert);
+}
+
+int
+amqp_ssl_socket_set_key(amqp_socket_t *base,
+                        const char *cert,
+                        const char *key)
+{
+  struct amqp_ssl_socket_t *self;
+  if (base->klass != &amqp_ssl_socket_class) {
+    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
   }
-  return AMQP_STATUS_OK;
+  self = (struct amqp_ssl_socket_t *)base;
+  return amqp_ssl_context_set_key(self->context, cert, key);
+}
+
+int
+amqp_ssl_socket_set_key_buffer(amqp_socket_t *base,
+                               const char *cert,
+                               const void *key,
+                               size_t n)
+{
+  struct amqp_ssl_socket_t *self;
+  if (base->klass != &amqp_ssl_socket_class) {
+    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+  }
+  self = (struct amqp_ssl_socket_t *)base;
+  return amqp_ssl_context_set_key_buffer(self->context, cert, key, n);
+}
+
+int
+amqp_ssl_socket_set_cert(amqp_socket_t *base,
+                         const char *cert)
+{
+  struct amqp_ssl_socket_t *self;
+  if (base->klass != &amqp_ssl_socket_class) {
+    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+  }
+  self = (struct amqp_ssl_socket_t *)base;
+  return amqp_ssl_context_set_cert(self->context, cert);
 }
 
 void
@@ -499,6 +951,29 @@ amqp_ssl_socket_set_verify(amqp_socket_t *base,
   self->verify = verify;
 }
 
+void
+amqp_ssl_socket_set_ktls(amqp_socket_t *base,
+                         amqp_boolean_t enable)
+{
+  struct amqp_ssl_socket_t *self;
+  if (base->klass != &amqp_ssl_socket_class) {
+    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+  }
+  self = (struct amqp_ssl_socket_t *)base;
+  self->ktls = enable ? 1 : 0;
+}
+
+amqp_boolean_t
+amqp_ssl_socket_ktls_active(amqp_socket_t *base)
+{
+  struct amqp_ssl_socket_t *self;
+  if (base->klass != &amqp_ssl_socket_class) {
+    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+  }
+  self = (struct amqp_ssl_socket_t *)base;
+  return self->ktls_send;
+}
+
 void
 amqp_set_initialize_ssl_library(amqp_boolean_t do_initialize)
 {
@@ -507,6 +982,29 @@ amqp_set_initialize_ssl_library(amqp_boolean_t do_initialize)
   }
 }
 
+#ifdef AMQP_OPENSSL_SELF_LOCKING
+static int
+initialize_openssl(void)
+{
+  /* OPENSSL_init_ssl() is safe to call concurrently and only does the work
+   * once, the flag just saves the call */
+  if (do_initialize_openssl && !openssl_initialized) {
+    if (!OPENSSL_init_ssl(OPENSSL_INIT_LOAD_CONFIG, NULL)) {
+      return -1;
+    }
+    openssl_initialized = 1;
+  }
+  return 0;
+}
+
+static int
+destroy_openssl(void)
+{
+  return 0;
+}
+
+#else /* AMQP_OPENSSL_SELF_LOCKING */
+
 #ifdef ENABLE_THREAD_SAFETY
 unsigned long
 amqp_ssl_threadid_callback(void)
@@ -624,3 +1122,4 @@ destroy_openssl(void)
 #endif /* ENABLE_THREAD_SAFETY */
   return 0;
 }
+#endif /* AMQP_OPENSSL_SELF_LOCKING */
@@ -27,6 +27,7 @@
 
 #include "amqp_ssl_socket.h"
 #include "amqp_private.h"
+#include "amqp_ssl_output.h"
 #include <polarssl/ctr_drbg.h>
 #include <polarssl/entropy.h>
 #include <polarssl/net.h>
@@ -50,8 +51,7 @@ struct amqp_ssl_socket_t {
   x509_cert *cert;
   ssl_context *ssl;
   ssl_session *session;
-  char *buffer;
-  size_t length;
+  amqp_ssl_output_t output;
   int last_error;
 };
 
@@ -73,39 +73,31 @@ amqp_ssl_socket_send(void *base,
   return status;
 }
 
+static ssize_t
+amqp_ssl_socket_output(void *base,
+                       const void *buf,
+                       size_t len)
+{
+  ssize_t status = amqp_ssl_socket_send(base, buf, len, 0);
+  if (status < 0) {
+    return AMQP_STATUS_SSL_ERROR;
+  }
+  return status;
+}
+
 static ssize_t
 amqp_ssl_socket_writev(void *base,
                        const struct iovec *iov,
                        int iovcnt)
 {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
-  ssize_t written = -1;
-  char *bufferp;
-  size_t bytes;
-  int i;
+  ssize_t written;
   self->last_error = 0;
-  bytes = 0;
-  for (i = 0; i < iovcnt; ++i) {
-    bytes += iov[i].iov_len;
-  }
-  if (self->length < bytes) {
-    free(self->buffer);
-    self->buffer = malloc(bytes);
-    if (!self->buffer) {
-      self->length = 0;
-      self->last_error = AMQP_STATUS_NO_MEMORY;
-      goto exit;
-    }
-    self->length = bytes;
-  }
-  bufferp = self->buffer;
-  for (i = 0; i < iovcnt; ++i) {
-    memcpy(bufferp, iov[i].iov_base, iov[i].iov_len);
-    bufferp += iov[i].iov_len;
+  written = amqp_ssl_output_writev(&self->output, amqp_ssl_socket_output,
+                                   self, iov, iovcnt);
+  if (AMQP_STATUS_NO_MEMORY == written) {
+    self->last_error = AMQP_STATUS_NO_MEMORY;
   }
-  written = amqp_ssl_socket_send(self, (const unsigned char *)self->buffer,
-                      bytes, 0);
-exit:
   return written;
 }
 
@@ -188,7 +180,7 @@ amqp_ssl_socket_close(void *base)
     ssl_free(self->ssl);
     free(self->ssl);
     free(self->session);
-    free(self->buffer);
+    amqp_ssl_output_destroy(&self->output);
     if (self->sockfd >= 0) {
       net_close(self->sockfd);
       status = 0;
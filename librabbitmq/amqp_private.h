@@ -134,6 +134,32 @@ typedef struct amqp_link_t_ {
 
 #define POOL_TABLE_SIZE 16
 
+#ifndef AMQP_INITIAL_INBOUND_SOCK_BUFFER_SIZE
+#define AMQP_INITIAL_INBOUND_SOCK_BUFFER_SIZE 131072
+#endif
+
+/* Bounds of the adaptive socket read buffer. It doubles after
+ * AMQP_INBOUND_GROW_AFTER_FULL_READS consecutive reads fill it completely and
+ * halves after AMQP_INBOUND_SHRINK_AFTER_SPARSE_READS consecutive reads that
+ * use less than an eighth of it */
+#ifndef AMQP_MIN_INBOUND_SOCK_BUFFER_SIZE
+#define AMQP_MIN_INBOUND_SOCK_BUFFER_SIZE 16384
+#endif
+
+#ifndef AMQP_MAX_INBOUND_SOCK_BUFFER_SIZE
+#define AMQP_MAX_INBOUND_SOCK_BUFFER_SIZE 2097152
+#endif
+
+#define AMQP_INBOUND_GROW_AFTER_FULL_READS 4
+#define AMQP_INBOUND_SHRINK_AFTER_SPARSE_READS 64
+
+/* Initial (and shrink-to) size of the connection buffers and the channel pool
+ * page size when a connection is in low memory mode */
+#define AMQP_LOW_MEMORY_BUFFER_SIZE 4096
+
+/* Largest encoded message properties amqp_encode_basic_properties() makes */
+#define AMQP_MAX_ENCODED_PROPERTIES_SIZE (1024 * 1024)
+
 typedef struct amqp_pool_table_entry_t_ {
   struct amqp_pool_table_entry_t_ *next;
   amqp_pool_t pool;
@@ -165,6 +191,11 @@ struct amqp_connection_state_t_ {
   amqp_bytes_t sock_inbound_buffer;
   size_t sock_inbound_offset;
   size_t sock_inbound_limit;
+  /* a partial frame header kept at the front of sock_inbound_buffer, the next
+   * read appends to it */
+  size_t sock_inbound_tail;
+  int sock_inbound_full_reads;
+  int sock_inbound_sparse_reads;
 
   amqp_link_t *first_queued_frame;
   amqp_link_t *last_queued_frame;
@@ -174,13 +205,51 @@ struct amqp_connection_state_t_ {
   uint64_t next_recv_heartbeat;
   uint64_t next_send_heartbeat;
 
+  amqp_clock_t clock;
+
+  amqp_boolean_t low_memory;
+
   amqp_table_t server_properties;
   amqp_pool_t properties_pool;
+
+  /* records the topology to replay on reconnect, see amqp_set_recovery() */
+  amqp_recovery_t *recovery;
+
+  /* connection.blocked from the broker, see amqp_set_blocked_policy() */
+  amqp_boolean_t blocked;
+  char blocked_reason[256];
+  amqp_blocked_policy_enum blocked_policy;
+  size_t max_parked_publishes;
+  size_t parked_publish_count;
+  struct amqp_parked_publish_t_ *first_parked_publish;
+  struct amqp_parked_publish_t_ *last_parked_publish;
+  uint64_t next_blocked_poll;
+
+  /* payload compression, see amqp_set_compression() */
+  char *codec_encoding;
+  size_t codec_threshold;
+  amqp_codec_fn codec_compress;
+  amqp_codec_fn codec_decompress;
+  void *codec_user_data;
+
+  /* body checksums, see amqp_set_body_checksum() */
+  int checksum_flags;
+
+  /* large message bodies, see amqp_set_body_file_threshold() */
+  size_t body_file_threshold;
+  char *body_file_dir;
+
+  /* set while amqp_consume_message_filtered() reads a message */
+  amqp_header_filter_t const *header_filter;
+  amqp_channel_t header_filter_channel;
 };
 
 amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t connection, amqp_channel_t channel);
 amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state, amqp_channel_t channel);
 
+int amqp_resize_sock_inbound_buffer(amqp_connection_state_t state, size_t size);
+void amqp_shrink_buffers(amqp_connection_state_t state);
+
 static inline amqp_boolean_t amqp_heartbeat_enabled(amqp_connection_state_t state)
 {
   return (state->heartbeat > 0);
@@ -198,6 +267,136 @@ static inline uint64_t amqp_calc_next_recv_heartbeat(amqp_connection_state_t sta
 
 int amqp_try_recv(amqp_connection_state_t state, uint64_t current_time);
 
+/* Waits for the reply to an RPC already sent on channel. Unlike
+ * amqp_simple_rpc() it also looks for the reply among the queued frames, so
+ * several RPCs can be in flight at once. */
+amqp_rpc_reply_t amqp_simple_rpc_wait_reply(amqp_connection_state_t state,
+                                            amqp_channel_t channel,
+                                            amqp_method_number_t *expected_reply_ids);
+
+/* Waits for the next frame on channel, or a connection.close, for at most
+ * timeout in total. Frames for other channels are queued for whoever reads
+ * them next rather than dropped. */
+int amqp_wait_frame_on_channel(amqp_connection_state_t state,
+                               amqp_channel_t channel,
+                               amqp_frame_t *decoded_frame,
+                               struct timeval *timeout);
+
+/* Puts channel on state in confirm mode */
+int amqp_select_confirms(amqp_connection_state_t state, amqp_channel_t channel);
+
+/* Receives the basic.ack and basic.nack frames seen by amqp_wait_confirm() */
+typedef void (*amqp_confirm_fn)(void *context, uint64_t delivery_tag,
+                                amqp_boolean_t multiple, amqp_boolean_t nack);
+
+/* Waits for the next frame on the channel of a publisher in confirm mode.
+ * Acks and nacks are passed to fn and returned messages are read past.
+ * Returns AMQP_STATUS_CONNECTION_CLOSED if the channel or connection was
+ * closed, otherwise as amqp_wait_frame_on_channel(). */
+int amqp_wait_confirm(amqp_connection_state_t state, amqp_channel_t channel,
+                      struct timeval *timeout, amqp_confirm_fn fn,
+                      void *context);
+
+/* How often amqp_basic_publish() reads the socket for connection.blocked */
+#define AMQP_BLOCKED_POLL_INTERVAL AMQP_NS_PER_MS
+
+/* Queues the frames already in the read buffer. Then, unless the socket was
+ * read less than AMQP_BLOCKED_POLL_INTERVAL ago by the connection's clock,
+ * reads whatever else arrived without blocking and queues it too. */
+int amqp_poll_frames(amqp_connection_state_t state);
+
+/* Copies src into a newly allocated buffer, an empty src gives
+ * amqp_empty_bytes without allocating */
+int amqp_bytes_dup(amqp_bytes_t src, amqp_bytes_t *dest);
+
+/* Encodes basic properties into a newly allocated buffer */
+int amqp_encode_basic_properties(amqp_basic_properties_t const *properties,
+                                 amqp_bytes_t *encoded);
+
+/* amqp_basic_publish() without the heartbeat and connection.blocked checks */
+int amqp_send_basic_publish(amqp_connection_state_t state,
+                            amqp_channel_t channel,
+                            amqp_bytes_t exchange,
+                            amqp_bytes_t routing_key,
+                            amqp_boolean_t mandatory,
+                            amqp_boolean_t immediate,
+                            amqp_basic_properties_t const *properties,
+                            amqp_bytes_t body);
+
+/* Tracks connection.blocked and connection.unblocked, returns true if the
+ * method was one of them */
+amqp_boolean_t amqp_handle_blocked_method(amqp_connection_state_t state,
+                                          amqp_channel_t channel,
+                                          amqp_method_t *method);
+
+/* Keeps a publish made while the connection is blocked */
+int amqp_park_publish(amqp_connection_state_t state, amqp_channel_t channel,
+                      amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                      amqp_boolean_t mandatory, amqp_boolean_t immediate,
+                      amqp_basic_properties_t const *properties,
+                      amqp_bytes_t body);
+
+/* Sends the publishes kept while the connection was blocked, in order */
+int amqp_send_parked_publishes(amqp_connection_state_t state);
+
+void amqp_free_parked_publishes(amqp_connection_state_t state);
+
+/* Compresses the body of a publish when the connection has a codec and the
+ * body is over the threshold. properties and body are pointed at the
+ * compressed versions, compressed must be freed after publishing. */
+int amqp_compress_publish(amqp_connection_state_t state,
+                          amqp_basic_properties_t const **properties,
+                          amqp_bytes_t *body,
+                          amqp_basic_properties_t *compressed_properties,
+                          amqp_bytes_t *compressed);
+
+/* Decompresses a message body in the connection's content encoding */
+void amqp_decompress_message(amqp_connection_state_t state,
+                             amqp_message_t *message);
+
+/* Adds the x-crc32c header for body when the connection publishes
+ * checksums. properties is pointed at the extended copy, entries must be
+ * freed after publishing. */
+int amqp_checksum_publish(amqp_connection_state_t state,
+                          amqp_basic_properties_t const **properties,
+                          amqp_bytes_t body,
+                          amqp_basic_properties_t *checksum_properties,
+                          amqp_table_entry_t **entries);
+
+/* Gets the checksum a consumed body must have when the connection verifies
+ * checksums. Returns 1 if there is one, 0 if the body isn't checked and -1
+ * if the header is malformed. */
+int amqp_checksum_expected(amqp_connection_state_t state,
+                           amqp_basic_properties_t const *properties,
+                           uint32_t *expected);
+
+/* Frees a message body, however amqp_read_message() allocated it */
+void amqp_free_message_body(amqp_bytes_t body);
+
+#ifndef _WIN32
+/* Smallest body read into a mapped file, see amqp_set_body_file_threshold() */
+#define AMQP_MIN_BODY_FILE_SIZE 65536
+
+/* Maps an unlinked temporary file of len bytes in dir */
+int amqp_map_body(char const *dir, size_t len, amqp_bytes_t *body);
+
+/* Unmaps a body from amqp_map_body(), returns false if it wasn't one */
+amqp_boolean_t amqp_unmap_body(amqp_bytes_t body);
+
+/* write(2) all of data, retrying on EINTR */
+int amqp_write_fd(int fd, amqp_bytes_t data);
+#endif
+
+/* Checks a filter against encoded basic properties: 1 if they pass, 0 if
+ * not, or a negative amqp_status_enum value if they are malformed */
+int amqp_header_filter_accepts(amqp_header_filter_t const *filter,
+                               amqp_bytes_t encoded);
+
+/* Records the outcome of an RPC for replay by amqp_recover() */
+void amqp_recovery_record(amqp_recovery_t *recovery, amqp_channel_t channel,
+                          amqp_method_number_t request_id, void *request,
+                          amqp_rpc_reply_t *reply);
+
 static inline void *amqp_offset(void *data, size_t offset)
 {
   return (char *)data + offset;
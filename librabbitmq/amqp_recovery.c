@@ -0,0 +1,744 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Largest encoded method kept for replay */
+#define AMQP_RECOVERY_MAX_METHOD_SIZE (1024 * 1024)
+
+/* A successful RPC that has to be replayed to restore the connection */
+typedef struct amqp_recovery_entry_t_ {
+  struct amqp_recovery_entry_t_ *next;
+  amqp_channel_t channel;
+  amqp_method_number_t id;
+  amqp_bytes_t request;       /* the request as sent, encoded */
+  /* Exchange or queue name for declares, consumer tag for consumes */
+  amqp_bytes_t name;
+  /* Server-named queues: the name the server first gave the queue, and while
+   * replaying, the name it had before the server renamed it */
+  amqp_bytes_t original_name;
+  amqp_bytes_t replaced_name;
+  amqp_boolean_t server_named;
+} amqp_recovery_entry_t;
+
+struct amqp_recovery_t_ {
+  amqp_recovery_entry_t *first;
+  amqp_recovery_entry_t *last;
+  amqp_pool_t pool;
+};
+
+/* A method sent while replaying, and the reply it waits for */
+typedef struct amqp_recovery_call_t_ {
+  amqp_recovery_entry_t *entry;
+  amqp_channel_t channel;
+  amqp_method_number_t reply_id;
+} amqp_recovery_call_t;
+
+static amqp_boolean_t
+bytes_equal(amqp_bytes_t a, amqp_bytes_t b)
+{
+  return a.len == b.len && (0 == a.len || 0 == memcmp(a.bytes, b.bytes, a.len));
+}
+
+static int
+encode_request(amqp_method_number_t id, void *decoded, amqp_bytes_t *encoded)
+{
+  size_t size = 512;
+
+  while (1) {
+    amqp_bytes_t buffer = amqp_bytes_malloc(size);
+    int res;
+
+    if (NULL == buffer.bytes) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+
+    res = amqp_encode_method(id, decoded, buffer);
+    if (res >= 0) {
+      buffer.len = res;
+      *encoded = buffer;
+      return AMQP_STATUS_OK;
+    }
+
+    amqp_bytes_free(buffer);
+    if ((AMQP_STATUS_BAD_AMQP_DATA != res &&
+         AMQP_STATUS_TABLE_TOO_BIG != res) ||
+        size >= AMQP_RECOVERY_MAX_METHOD_SIZE) {
+      return res;
+    }
+    size *= 2;
+  }
+}
+
+/* Decodes the recorded request of entry. The result points into both the
+ * pool and the entry. */
+static void *
+decode_request(amqp_recovery_t *recovery, amqp_recovery_entry_t *entry)
+{
+  void *decoded;
+
+  if (AMQP_STATUS_OK != amqp_decode_method(entry->id, &recovery->pool,
+                                           entry->request, &decoded)) {
+    return NULL;
+  }
+  return decoded;
+}
+
+static void
+free_entry(amqp_recovery_entry_t *entry)
+{
+  amqp_bytes_free(entry->request);
+  amqp_bytes_free(entry->name);
+  amqp_bytes_free(entry->original_name);
+  amqp_bytes_free(entry->replaced_name);
+  free(entry);
+}
+
+amqp_recovery_t *
+amqp_recovery_new(void)
+{
+  amqp_recovery_t *recovery = calloc(1, sizeof(amqp_recovery_t));
+  if (NULL == recovery) {
+    return NULL;
+  }
+  init_amqp_pool(&recovery->pool, 4096);
+  return recovery;
+}
+
+void
+amqp_recovery_free(amqp_recovery_t *recovery)
+{
+  amqp_recovery_entry_t *entry;
+
+  if (NULL == recovery) {
+    return;
+  }
+
+  entry = recovery->first;
+  while (entry) {
+    amqp_recovery_entry_t *next = entry->next;
+    free_entry(entry);
+    entry = next;
+  }
+  empty_amqp_pool(&recovery->pool);
+  free(recovery);
+}
+
+void
+amqp_set_recovery(amqp_connection_state_t state, amqp_recovery_t *recovery)
+{
+  state->recovery = recovery;
+}
+
+amqp_bytes_t
+amqp_recovery_queue_name(amqp_recovery_t *recovery, amqp_bytes_t name)
+{
+  amqp_recovery_entry_t *entry;
+
+  for (entry = recovery->first; entry; entry = entry->next) {
+    if (AMQP_QUEUE_DECLARE_METHOD == entry->id && entry->server_named &&
+        (bytes_equal(entry->original_name, name) ||
+         bytes_equal(entry->name, name))) {
+      return entry->name;
+    }
+  }
+  return name;
+}
+
+/* Predicate selecting the entries to drop, decoded is the entry's request */
+typedef amqp_boolean_t (*entry_match_fn)(amqp_recovery_entry_t *entry,
+                                         void *decoded, void *arg);
+
+static void
+remove_entries(amqp_recovery_t *recovery, amqp_method_number_t id,
+               entry_match_fn match, void *arg)
+{
+  amqp_recovery_entry_t **link = &recovery->first;
+  amqp_recovery_entry_t *prev = NULL;
+
+  while (*link) {
+    amqp_recovery_entry_t *entry = *link;
+    void *decoded = NULL;
+
+    if (entry->id == id) {
+      decoded = decode_request(recovery, entry);
+    }
+
+    if (NULL != decoded && match(entry, decoded, arg)) {
+      *link = entry->next;
+      if (recovery->last == entry) {
+        recovery->last = prev;
+      }
+      free_entry(entry);
+    } else {
+      prev = entry;
+      link = &entry->next;
+    }
+    recycle_amqp_pool(&recovery->pool);
+  }
+}
+
+static amqp_boolean_t
+match_channel(amqp_recovery_entry_t *entry, AMQP_UNUSED void *decoded,
+              void *arg)
+{
+  return entry->channel == *(amqp_channel_t *)arg;
+}
+
+static amqp_boolean_t
+match_name(amqp_recovery_entry_t *entry, AMQP_UNUSED void *decoded, void *arg)
+{
+  return bytes_equal(entry->name, *(amqp_bytes_t *)arg);
+}
+
+static amqp_boolean_t
+match_queue_bind_queue(AMQP_UNUSED amqp_recovery_entry_t *entry,
+                       void *decoded, void *arg)
+{
+  return bytes_equal(((amqp_queue_bind_t *)decoded)->queue,
+                     *(amqp_bytes_t *)arg);
+}
+
+static amqp_boolean_t
+match_queue_bind_exchange(AMQP_UNUSED amqp_recovery_entry_t *entry,
+                          void *decoded, void *arg)
+{
+  return bytes_equal(((amqp_queue_bind_t *)decoded)->exchange,
+                     *(amqp_bytes_t *)arg);
+}
+
+static amqp_boolean_t
+match_queue_unbind(AMQP_UNUSED amqp_recovery_entry_t *entry, void *decoded,
+                   void *arg)
+{
+  amqp_queue_bind_t *bind = decoded;
+  amqp_queue_unbind_t *unbind = arg;
+
+  return bytes_equal(bind->queue, unbind->queue) &&
+         bytes_equal(bind->exchange, unbind->exchange) &&
+         bytes_equal(bind->routing_key, unbind->routing_key);
+}
+
+static amqp_boolean_t
+match_exchange_bind_exchange(AMQP_UNUSED amqp_recovery_entry_t *entry,
+                             void *decoded, void *arg)
+{
+  amqp_exchange_bind_t *bind = decoded;
+
+  return bytes_equal(bind->destination, *(amqp_bytes_t *)arg) ||
+         bytes_equal(bind->source, *(amqp_bytes_t *)arg);
+}
+
+static amqp_boolean_t
+match_exchange_unbind(AMQP_UNUSED amqp_recovery_entry_t *entry,
+                      void *decoded, void *arg)
+{
+  amqp_exchange_bind_t *bind = decoded;
+  amqp_exchange_unbind_t *unbind = arg;
+
+  return bytes_equal(bind->destination, unbind->destination) &&
+         bytes_equal(bind->source, unbind->source) &&
+         bytes_equal(bind->routing_key, unbind->routing_key);
+}
+
+static amqp_boolean_t
+match_consume_queue(AMQP_UNUSED amqp_recovery_entry_t *entry, void *decoded,
+                    void *arg)
+{
+  return bytes_equal(((amqp_basic_consume_t *)decoded)->queue,
+                     *(amqp_bytes_t *)arg);
+}
+
+/* Drops the state that lives and dies with a channel. Declared exchanges,
+ * queues and bindings outlive it, they are replayed on another channel. */
+static void
+forget_channel(amqp_recovery_t *recovery, amqp_channel_t channel)
+{
+  remove_entries(recovery, AMQP_CHANNEL_OPEN_METHOD, match_channel, &channel);
+  remove_entries(recovery, AMQP_BASIC_QOS_METHOD, match_channel, &channel);
+  remove_entries(recovery, AMQP_CONFIRM_SELECT_METHOD, match_channel, &channel);
+  remove_entries(recovery, AMQP_BASIC_CONSUME_METHOD, match_channel, &channel);
+}
+
+static int
+append_entry(amqp_recovery_t *recovery, amqp_channel_t channel,
+             amqp_method_number_t id, void *request, amqp_bytes_t name,
+             amqp_boolean_t server_named)
+{
+  amqp_recovery_entry_t *entry = calloc(1, sizeof(amqp_recovery_entry_t));
+  int res;
+
+  if (NULL == entry) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  entry->channel = channel;
+  entry->id = id;
+  entry->server_named = server_named;
+
+  res = encode_request(id, request, &entry->request);
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_bytes_dup(name, &entry->name);
+  }
+  if (AMQP_STATUS_OK == res && server_named) {
+    res = amqp_bytes_dup(name, &entry->original_name);
+  }
+  if (AMQP_STATUS_OK != res) {
+    free_entry(entry);
+    return res;
+  }
+
+  if (recovery->last) {
+    recovery->last->next = entry;
+  } else {
+    recovery->first = entry;
+  }
+  recovery->last = entry;
+  return AMQP_STATUS_OK;
+}
+
+void
+amqp_recovery_record(amqp_recovery_t *recovery, amqp_channel_t channel,
+                     amqp_method_number_t request_id, void *request,
+                     amqp_rpc_reply_t *reply)
+{
+  if (AMQP_RESPONSE_SERVER_EXCEPTION == reply->reply_type &&
+      AMQP_CHANNEL_CLOSE_METHOD == reply->reply.id) {
+    /* The server closed the channel */
+    forget_channel(recovery, channel);
+    return;
+  }
+  if (AMQP_RESPONSE_NORMAL != reply->reply_type) {
+    return;
+  }
+
+  /* Recording is best effort: the RPC already took effect on the broker, so
+   * failing to allocate the record only means it is not replayed */
+  switch (request_id) {
+  case AMQP_CHANNEL_OPEN_METHOD:
+    forget_channel(recovery, channel);
+    append_entry(recovery, channel, request_id, request, amqp_empty_bytes, 0);
+    break;
+
+  case AMQP_CHANNEL_CLOSE_METHOD:
+    forget_channel(recovery, channel);
+    break;
+
+  case AMQP_EXCHANGE_DECLARE_METHOD: {
+    amqp_exchange_declare_t *m = request;
+    if (!m->passive) {
+      remove_entries(recovery, request_id, match_name, &m->exchange);
+      append_entry(recovery, channel, request_id, request, m->exchange, 0);
+    }
+    break;
+  }
+
+  case AMQP_EXCHANGE_DELETE_METHOD: {
+    amqp_exchange_delete_t *m = request;
+    remove_entries(recovery, AMQP_EXCHANGE_DECLARE_METHOD, match_name,
+                   &m->exchange);
+    remove_entries(recovery, AMQP_EXCHANGE_BIND_METHOD,
+                   match_exchange_bind_exchange, &m->exchange);
+    remove_entries(recovery, AMQP_QUEUE_BIND_METHOD,
+                   match_queue_bind_exchange, &m->exchange);
+    break;
+  }
+
+  case AMQP_EXCHANGE_BIND_METHOD:
+  case AMQP_QUEUE_BIND_METHOD:
+    append_entry(recovery, channel, request_id, request, amqp_empty_bytes, 0);
+    break;
+
+  case AMQP_EXCHANGE_UNBIND_METHOD:
+    remove_entries(recovery, AMQP_EXCHANGE_BIND_METHOD, match_exchange_unbind,
+                   request);
+    break;
+
+  case AMQP_QUEUE_UNBIND_METHOD:
+    remove_entries(recovery, AMQP_QUEUE_BIND_METHOD, match_queue_unbind,
+                   request);
+    break;
+
+  case AMQP_QUEUE_DECLARE_METHOD: {
+    amqp_queue_declare_t *m = request;
+    amqp_queue_declare_ok_t *ok = reply->reply.decoded;
+    if (!m->passive) {
+      remove_entries(recovery, request_id, match_name, &ok->queue);
+      append_entry(recovery, channel, request_id, request, ok->queue,
+                   0 == m->queue.len);
+    }
+    break;
+  }
+
+  case AMQP_QUEUE_DELETE_METHOD: {
+    amqp_queue_delete_t *m = request;
+    remove_entries(recovery, AMQP_QUEUE_DECLARE_METHOD, match_name, &m->queue);
+    remove_entries(recovery, AMQP_QUEUE_BIND_METHOD, match_queue_bind_queue,
+                   &m->queue);
+    remove_entries(recovery, AMQP_BASIC_CONSUME_METHOD, match_consume_queue,
+                   &m->queue);
+    break;
+  }
+
+  case AMQP_BASIC_QOS_METHOD:
+  case AMQP_CONFIRM_SELECT_METHOD:
+    remove_entries(recovery, request_id, match_channel, &channel);
+    append_entry(recovery, channel, request_id, request, amqp_empty_bytes, 0);
+    break;
+
+  case AMQP_BASIC_CONSUME_METHOD: {
+    amqp_basic_consume_ok_t *ok = reply->reply.decoded;
+    append_entry(recovery, channel, request_id, request, ok->consumer_tag, 0);
+    break;
+  }
+
+  case AMQP_BASIC_CANCEL_METHOD: {
+    amqp_basic_cancel_t *m = request;
+    remove_entries(recovery, AMQP_BASIC_CONSUME_METHOD, match_name,
+                   &m->consumer_tag);
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+static amqp_boolean_t
+channel_is_open(amqp_recovery_t *recovery, amqp_channel_t channel)
+{
+  amqp_recovery_entry_t *entry;
+
+  for (entry = recovery->first; entry; entry = entry->next) {
+    if (AMQP_CHANNEL_OPEN_METHOD == entry->id && entry->channel == channel) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Gives the server-named queue a request refers to the name the server just
+ * assigned. Returns 1 if the queue was renamed. */
+static amqp_boolean_t
+rename_queue(amqp_recovery_t *recovery, amqp_bytes_t *queue)
+{
+  amqp_recovery_entry_t *entry;
+
+  for (entry = recovery->first; entry; entry = entry->next) {
+    if (AMQP_QUEUE_DECLARE_METHOD == entry->id && entry->replaced_name.len &&
+        bytes_equal(entry->replaced_name, *queue)) {
+      *queue = entry->name;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Sends the method of a recorded entry for replay. Requests referring to
+ * server-named queues or server generated consumer tags are rewritten, and
+ * re-recorded so the next recovery starts from the new names. */
+static int
+send_entry(amqp_connection_state_t state, amqp_recovery_t *recovery,
+           amqp_recovery_entry_t *entry, amqp_channel_t channel)
+{
+  amqp_boolean_t rewritten = 0;
+  void *decoded = decode_request(recovery, entry);
+  int res;
+
+  if (NULL == decoded) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  switch (entry->id) {
+  case AMQP_QUEUE_BIND_METHOD:
+    rewritten = rename_queue(recovery, &((amqp_queue_bind_t *)decoded)->queue);
+    break;
+
+  case AMQP_BASIC_CONSUME_METHOD: {
+    amqp_basic_consume_t *m = decoded;
+    rewritten = rename_queue(recovery, &m->queue);
+    if (!bytes_equal(m->consumer_tag, entry->name)) {
+      /* Keep the tag the server generated the first time around */
+      m->consumer_tag = entry->name;
+      rewritten = 1;
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+
+  if (rewritten) {
+    amqp_bytes_t request;
+
+    res = encode_request(entry->id, decoded, &request);
+    if (AMQP_STATUS_OK != res) {
+      goto out;
+    }
+
+    /* decoded points into the old request, send before freeing it */
+    res = amqp_send_method(state, channel, entry->id, decoded);
+    amqp_bytes_free(entry->request);
+    entry->request = request;
+  } else {
+    res = amqp_send_method(state, channel, entry->id, decoded);
+  }
+
+out:
+  recycle_amqp_pool(&recovery->pool);
+  return res;
+}
+
+/* Waits for the replies to the methods sent, in the order they were sent */
+static amqp_rpc_reply_t
+wait_replies(amqp_connection_state_t state, amqp_recovery_call_t *calls,
+             int ncalls)
+{
+  amqp_rpc_reply_t result;
+  int i;
+
+  memset(&result, 0, sizeof(result));
+  result.reply_type = AMQP_RESPONSE_NORMAL;
+
+  for (i = 0; i < ncalls; ++i) {
+    amqp_method_number_t replies[2];
+    amqp_recovery_entry_t *entry = calls[i].entry;
+
+    replies[0] = calls[i].reply_id;
+    replies[1] = 0;
+
+    result = amqp_simple_rpc_wait_reply(state, calls[i].channel, replies);
+    if (AMQP_RESPONSE_NORMAL != result.reply_type) {
+      return result;
+    }
+
+    if (entry && AMQP_QUEUE_DECLARE_METHOD == entry->id &&
+        entry->server_named) {
+      amqp_queue_declare_ok_t *ok = result.reply.decoded;
+      amqp_bytes_t name;
+
+      if (bytes_equal(ok->queue, entry->name)) {
+        continue;
+      }
+      if (AMQP_STATUS_OK != amqp_bytes_dup(ok->queue, &name)) {
+        result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+        result.library_error = AMQP_STATUS_NO_MEMORY;
+        return result;
+      }
+      amqp_bytes_free(entry->replaced_name);
+      entry->replaced_name = entry->name;
+      entry->name = name;
+    }
+  }
+
+  return result;
+}
+
+static amqp_method_number_t
+reply_id_for(amqp_method_number_t id)
+{
+  switch (id) {
+  case AMQP_CHANNEL_OPEN_METHOD:
+    return AMQP_CHANNEL_OPEN_OK_METHOD;
+  case AMQP_CHANNEL_CLOSE_METHOD:
+    return AMQP_CHANNEL_CLOSE_OK_METHOD;
+  case AMQP_EXCHANGE_DECLARE_METHOD:
+    return AMQP_EXCHANGE_DECLARE_OK_METHOD;
+  case AMQP_EXCHANGE_BIND_METHOD:
+    return AMQP_EXCHANGE_BIND_OK_METHOD;
+  case AMQP_QUEUE_DECLARE_METHOD:
+    return AMQP_QUEUE_DECLARE_OK_METHOD;
+  case AMQP_QUEUE_BIND_METHOD:
+    return AMQP_QUEUE_BIND_OK_METHOD;
+  case AMQP_BASIC_QOS_METHOD:
+    return AMQP_BASIC_QOS_OK_METHOD;
+  case AMQP_BASIC_CONSUME_METHOD:
+    return AMQP_BASIC_CONSUME_OK_METHOD;
+  case AMQP_CONFIRM_SELECT_METHOD:
+    return AMQP_CONFIRM_SELECT_OK_METHOD;
+  default:
+    return 0;
+  }
+}
+
+static amqp_boolean_t
+is_topology(amqp_method_number_t id)
+{
+  return AMQP_EXCHANGE_DECLARE_METHOD == id ||
+         AMQP_QUEUE_DECLARE_METHOD == id ||
+         AMQP_EXCHANGE_BIND_METHOD == id ||
+         AMQP_QUEUE_BIND_METHOD == id;
+}
+
+/* Bindings and consumers may refer to server-named queues, so they go out
+ * once the declares have been answered */
+static amqp_boolean_t
+is_second_phase(amqp_method_number_t id)
+{
+  return AMQP_EXCHANGE_BIND_METHOD == id ||
+         AMQP_QUEUE_BIND_METHOD == id ||
+         AMQP_BASIC_CONSUME_METHOD == id;
+}
+
+amqp_rpc_reply_t
+amqp_recover(amqp_connection_state_t state, amqp_recovery_t *recovery)
+{
+  amqp_rpc_reply_t result;
+  amqp_recovery_entry_t *entry;
+  amqp_recovery_call_t *calls = NULL;
+  amqp_channel_t scratch = 0;
+  int nentries = 0;
+  int ncalls;
+  int phase;
+  int res;
+
+  memset(&result, 0, sizeof(result));
+
+  for (entry = recovery->first; entry; entry = entry->next) {
+    ++nentries;
+    if (0 == scratch && is_topology(entry->id) &&
+        !channel_is_open(recovery, entry->channel)) {
+      /* The channel this was declared on is gone, replay it on a channel of
+       * our own */
+      scratch = 1;
+      while (channel_is_open(recovery, scratch)) {
+        ++scratch;
+      }
+    }
+  }
+
+  calls = malloc((nentries + 1) * sizeof(amqp_recovery_call_t));
+  if (NULL == calls) {
+    res = AMQP_STATUS_NO_MEMORY;
+    goto error_res;
+  }
+
+  for (phase = 0; phase < 2; ++phase) {
+    ncalls = 0;
+
+    if (0 == phase) {
+      if (scratch) {
+        amqp_channel_open_t open;
+
+        open.out_of_band = amqp_empty_bytes;
+        res = amqp_send_method(state, scratch, AMQP_CHANNEL_OPEN_METHOD,
+                               &open);
+        if (AMQP_STATUS_OK != res) {
+          goto error_res;
+        }
+        calls[ncalls].entry = NULL;
+        calls[ncalls].channel = scratch;
+        calls[ncalls].reply_id = AMQP_CHANNEL_OPEN_OK_METHOD;
+        ++ncalls;
+      }
+
+      /* Channels have to be open before anything else is replayed on them */
+      for (entry = recovery->first; entry; entry = entry->next) {
+        if (AMQP_CHANNEL_OPEN_METHOD != entry->id) {
+          continue;
+        }
+        res = send_entry(state, recovery, entry, entry->channel);
+        if (AMQP_STATUS_OK != res) {
+          goto error_res;
+        }
+        calls[ncalls].entry = entry;
+        calls[ncalls].channel = entry->channel;
+        calls[ncalls].reply_id = AMQP_CHANNEL_OPEN_OK_METHOD;
+        ++ncalls;
+      }
+    }
+
+    for (entry = recovery->first; entry; entry = entry->next) {
+      amqp_channel_t channel = entry->channel;
+
+      if (AMQP_CHANNEL_OPEN_METHOD == entry->id ||
+          is_second_phase(entry->id) != (1 == phase)) {
+        continue;
+      }
+      if (is_topology(entry->id) && !channel_is_open(recovery, channel)) {
+        channel = scratch;
+      }
+
+      res = send_entry(state, recovery, entry, channel);
+      if (AMQP_STATUS_OK != res) {
+        goto error_res;
+      }
+      calls[ncalls].entry = entry;
+      calls[ncalls].channel = channel;
+      calls[ncalls].reply_id = reply_id_for(entry->id);
+      ++ncalls;
+    }
+
+    result = wait_replies(state, calls, ncalls);
+    if (AMQP_RESPONSE_NORMAL != result.reply_type) {
+      goto out;
+    }
+  }
+
+  if (scratch) {
+    amqp_method_number_t replies[] = { AMQP_CHANNEL_CLOSE_OK_METHOD, 0 };
+    amqp_channel_close_t close;
+
+    close.reply_code = AMQP_REPLY_SUCCESS;
+    close.reply_text = amqp_empty_bytes;
+    close.class_id = 0;
+    close.method_id = 0;
+    res = amqp_send_method(state, scratch, AMQP_CHANNEL_CLOSE_METHOD, &close);
+    if (AMQP_STATUS_OK != res) {
+      goto error_res;
+    }
+    result = amqp_simple_rpc_wait_reply(state, scratch, replies);
+    if (AMQP_RESPONSE_NORMAL != result.reply_type) {
+      goto out;
+    }
+  }
+
+  state->recovery = recovery;
+  result.reply_type = AMQP_RESPONSE_NORMAL;
+  result.reply.id = 0;
+  result.reply.decoded = NULL;
+  result.library_error = 0;
+  goto out;
+
+error_res:
+  result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+  result.reply.id = 0;
+  result.reply.decoded = NULL;
+  result.library_error = res;
+
+out:
+  for (entry = recovery->first; entry; entry = entry->next) {
+    amqp_bytes_free(entry->replaced_name);
+    entry->replaced_name = amqp_empty_bytes;
+  }
+  free(calls);
+  return result;
+}
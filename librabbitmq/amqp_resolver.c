@@ -0,0 +1,546 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_resolver.h"
+#include "amqp_timer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Lookups only run on a helper thread where pthreads are available, elsewhere
+ * they run on the calling thread and are not bounded by the timeout. Without
+ * a lock to protect it the cache is disabled in thread safe Win32 builds. */
+#if defined(ENABLE_THREAD_SAFETY) && !defined(_WIN32)
+# define AMQP_RESOLVER_THREADS
+# include <pthread.h>
+# include <time.h>
+# ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+#  define AMQP_RESOLVER_CLOCK CLOCK_MONOTONIC
+# else
+#  include <sys/time.h>
+# endif
+#endif
+
+#if defined(AMQP_RESOLVER_THREADS) || !defined(ENABLE_THREAD_SAFETY)
+# define AMQP_RESOLVER_CACHE
+#endif
+
+typedef struct amqp_resolver_entry_t_ {
+  struct amqp_resolver_entry_t_ *next;
+  char *key;
+  struct addrinfo *result;
+  uint64_t expires;
+} amqp_resolver_entry_t;
+
+#ifdef AMQP_RESOLVER_THREADS
+/* A lookup in progress, shared by every caller resolving the same name */
+typedef struct amqp_resolver_query_t_ {
+  struct amqp_resolver_query_t_ *next;
+  char *key;
+  char *hostname;
+  char port[16];
+  int refcount;
+  amqp_boolean_t done;
+  int status;
+  struct addrinfo *result;
+  pthread_cond_t cond;
+} amqp_resolver_query_t;
+
+static pthread_mutex_t resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static amqp_resolver_query_t *resolver_queries = NULL;
+#endif
+
+static amqp_resolver_entry_t *resolver_cache = NULL;
+static size_t resolver_cache_count = 0;
+static int resolver_cache_ttl = 0;
+
+static void
+resolver_lock(void)
+{
+#ifdef AMQP_RESOLVER_THREADS
+  pthread_mutex_lock(&resolver_mutex);
+#endif
+}
+
+static void
+resolver_unlock(void)
+{
+#ifdef AMQP_RESOLVER_THREADS
+  pthread_mutex_unlock(&resolver_mutex);
+#endif
+}
+
+void
+amqp_resolver_free(struct addrinfo *result)
+{
+  while (result) {
+    struct addrinfo *next = result->ai_next;
+    free(result);
+    result = next;
+  }
+}
+
+/* Copies an address list into memory owned by the library, each node holding
+ * its socket address in the same allocation */
+static struct addrinfo *
+copy_addrinfo(const struct addrinfo *list)
+{
+  struct addrinfo *head = NULL;
+  struct addrinfo **tail = &head;
+
+  for (; list; list = list->ai_next) {
+    struct addrinfo *node = malloc(sizeof(struct addrinfo) + list->ai_addrlen);
+    if (NULL == node) {
+      amqp_resolver_free(head);
+      return NULL;
+    }
+
+    memcpy(node, list, sizeof(struct addrinfo));
+    node->ai_canonname = NULL;
+    node->ai_addr = (struct sockaddr *)(node + 1);
+    node->ai_next = NULL;
+    memcpy(node->ai_addr, list->ai_addr, list->ai_addrlen);
+
+    *tail = node;
+    tail = &node->ai_next;
+  }
+
+  return head;
+}
+
+static int
+lookup(const char *hostname, const char *port, struct addrinfo **result)
+{
+  struct addrinfo hint;
+  struct addrinfo *address_list;
+
+  memset(&hint, 0, sizeof(hint));
+  hint.ai_family = PF_UNSPEC; /* PF_INET or PF_INET6 */
+  hint.ai_socktype = SOCK_STREAM;
+  hint.ai_protocol = IPPROTO_TCP;
+
+  if (0 != getaddrinfo(hostname, port, &hint, &address_list)) {
+    return AMQP_STATUS_HOSTNAME_RESOLUTION_FAILED;
+  }
+
+  *result = copy_addrinfo(address_list);
+  freeaddrinfo(address_list);
+
+  return *result ? AMQP_STATUS_OK : AMQP_STATUS_NO_MEMORY;
+}
+
+static void
+cache_remove(amqp_resolver_entry_t **link)
+{
+  amqp_resolver_entry_t *entry = *link;
+
+  *link = entry->next;
+  amqp_resolver_free(entry->result);
+  free(entry->key);
+  free(entry);
+  resolver_cache_count--;
+}
+
+/* Must be called with the resolver lock held */
+static void
+cache_flush(void)
+{
+  while (resolver_cache) {
+    cache_remove(&resolver_cache);
+  }
+}
+
+/* Must be called with the resolver lock held. Copies a fresh cached answer for
+ * key into *result, returns AMQP_STATUS_OK on a hit. */
+static int
+cache_get(const char *key, struct addrinfo **result)
+{
+#ifdef AMQP_RESOLVER_CACHE
+  amqp_resolver_entry_t **link;
+  uint64_t now;
+
+  if (0 == resolver_cache_ttl) {
+    return AMQP_STATUS_HOSTNAME_RESOLUTION_FAILED;
+  }
+
+  now = amqp_get_monotonic_timestamp();
+  for (link = &resolver_cache; *link; link = &(*link)->next) {
+    if (0 == strcmp((*link)->key, key)) {
+      if (now >= (*link)->expires) {
+        cache_remove(link);
+        break;
+      }
+      *result = copy_addrinfo((*link)->result);
+      return *result ? AMQP_STATUS_OK : AMQP_STATUS_NO_MEMORY;
+    }
+  }
+#else
+  (void)key;
+  (void)result;
+#endif
+  return AMQP_STATUS_HOSTNAME_RESOLUTION_FAILED;
+}
+
+/* Must be called with the resolver lock held */
+static void
+cache_put(const char *key, const struct addrinfo *result)
+{
+#ifdef AMQP_RESOLVER_CACHE
+  amqp_resolver_entry_t **link;
+  amqp_resolver_entry_t **oldest = NULL;
+  amqp_resolver_entry_t *entry;
+
+  if (0 == resolver_cache_ttl) {
+    return;
+  }
+
+  for (link = &resolver_cache; *link; link = &(*link)->next) {
+    if (0 == strcmp((*link)->key, key)) {
+      cache_remove(link);
+      break;
+    }
+  }
+
+  if (resolver_cache_count >= AMQP_RESOLVER_CACHE_SIZE) {
+    for (link = &resolver_cache; *link; link = &(*link)->next) {
+      if (NULL == oldest || (*link)->expires < (*oldest)->expires) {
+        oldest = link;
+      }
+    }
+    cache_remove(oldest);
+  }
+
+  entry = calloc(1, sizeof(amqp_resolver_entry_t));
+  if (NULL == entry) {
+    return;
+  }
+  entry->key = strdup(key);
+  entry->result = copy_addrinfo(result);
+  if (NULL == entry->key || NULL == entry->result) {
+    amqp_resolver_free(entry->result);
+    free(entry->key);
+    free(entry);
+    return;
+  }
+  entry->expires = amqp_get_monotonic_timestamp() +
+                   (uint64_t)resolver_cache_ttl * AMQP_NS_PER_S;
+  entry->next = resolver_cache;
+  resolver_cache = entry;
+  resolver_cache_count++;
+#else
+  (void)key;
+  (void)result;
+#endif
+}
+
+void
+amqp_set_resolver_cache_ttl(int ttl_seconds)
+{
+  resolver_lock();
+  resolver_cache_ttl = ttl_seconds > 0 ? ttl_seconds : 0;
+  if (0 == resolver_cache_ttl) {
+    cache_flush();
+  }
+  resolver_unlock();
+}
+
+void
+amqp_flush_resolver_cache(void)
+{
+  resolver_lock();
+  cache_flush();
+  resolver_unlock();
+}
+
+#ifdef AMQP_RESOLVER_THREADS
+/* Must be called with the resolver lock held */
+static void
+query_release(amqp_resolver_query_t *query)
+{
+  if (--query->refcount > 0) {
+    return;
+  }
+  pthread_cond_destroy(&query->cond);
+  amqp_resolver_free(query->result);
+  free(query->hostname);
+  free(query->key);
+  free(query);
+}
+
+/* Must be called with the resolver lock held. Publishes the outcome of the
+ * lookup to its waiters and the cache. */
+static void
+query_complete(amqp_resolver_query_t *query, int status,
+               struct addrinfo *result)
+{
+  amqp_resolver_query_t **link;
+
+  for (link = &resolver_queries; *link; link = &(*link)->next) {
+    if (*link == query) {
+      *link = query->next;
+      break;
+    }
+  }
+
+  query->status = status;
+  query->result = result;
+  query->done = 1;
+  if (AMQP_STATUS_OK == status) {
+    cache_put(query->key, result);
+  }
+  pthread_cond_broadcast(&query->cond);
+}
+
+static void *
+query_thread(void *arg)
+{
+  amqp_resolver_query_t *query = arg;
+  struct addrinfo *result = NULL;
+  int status;
+
+  status = lookup(query->hostname, query->port, &result);
+
+  pthread_mutex_lock(&resolver_mutex);
+  query_complete(query, status, result);
+  query_release(query);
+  pthread_mutex_unlock(&resolver_mutex);
+
+  return NULL;
+}
+
+/* Must be called with the resolver lock held. Finds the lookup in progress
+ * for key or starts a new one, either way taking a reference for the caller.
+ * *run_inline is set when the caller has to do the lookup itself. */
+/* Waits on a query time out by the monotonic clock where pthreads allows it,
+ * so that stepping the wall clock does not stretch or cut short a lookup */
+static int
+init_cond(pthread_cond_t *cond)
+{
+#ifdef AMQP_RESOLVER_CLOCK
+  pthread_condattr_t attr;
+  int res;
+
+  res = pthread_condattr_init(&attr);
+  if (0 != res) {
+    return res;
+  }
+  res = pthread_condattr_setclock(&attr, AMQP_RESOLVER_CLOCK);
+  if (0 == res) {
+    res = pthread_cond_init(cond, &attr);
+  }
+  pthread_condattr_destroy(&attr);
+  return res;
+#else
+  return pthread_cond_init(cond, NULL);
+#endif
+}
+
+/* The pthread_cond_timedwait() deadline timeout from now, by the clock
+ * init_cond() set up */
+static void
+get_deadline(struct timeval *timeout, struct timespec *deadline)
+{
+  long nsec;
+
+#ifdef AMQP_RESOLVER_CLOCK
+  clock_gettime(AMQP_RESOLVER_CLOCK, deadline);
+#else
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  deadline->tv_sec = now.tv_sec;
+  deadline->tv_nsec = now.tv_usec * AMQP_NS_PER_US;
+#endif
+
+  nsec = deadline->tv_nsec + timeout->tv_usec * AMQP_NS_PER_US;
+  deadline->tv_sec += timeout->tv_sec + nsec / AMQP_NS_PER_S;
+  deadline->tv_nsec = nsec % AMQP_NS_PER_S;
+}
+
+static amqp_resolver_query_t *
+query_start(const char *key, const char *hostname, int port,
+            struct timeval *timeout, amqp_boolean_t *run_inline)
+{
+  amqp_resolver_query_t *query;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int res;
+
+  *run_inline = 0;
+
+  for (query = resolver_queries; query; query = query->next) {
+    if (0 == strcmp(query->key, key)) {
+      query->refcount++;
+      return query;
+    }
+  }
+
+  query = calloc(1, sizeof(amqp_resolver_query_t));
+  if (NULL == query) {
+    return NULL;
+  }
+  query->key = strdup(key);
+  query->hostname = strdup(hostname);
+  if (NULL == query->key || NULL == query->hostname ||
+      0 != init_cond(&query->cond)) {
+    free(query->hostname);
+    free(query->key);
+    free(query);
+    return NULL;
+  }
+  (void)sprintf(query->port, "%d", port);
+  query->refcount = 1;
+  query->next = resolver_queries;
+  resolver_queries = query;
+
+  if (NULL == timeout) {
+    *run_inline = 1;
+    return query;
+  }
+
+  /* The helper thread holds its own reference so that it can outlive every
+   * caller that gave up waiting */
+  query->refcount++;
+  res = pthread_attr_init(&attr);
+  if (0 == res) {
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    res = pthread_create(&thread, &attr, query_thread, query);
+    pthread_attr_destroy(&attr);
+  }
+  if (0 != res) {
+    query->refcount--;
+    *run_inline = 1;
+  }
+
+  return query;
+}
+
+int
+amqp_resolve(const char *hostname, int port, struct timeval *timeout,
+             struct addrinfo **result)
+{
+  amqp_resolver_query_t *query;
+  amqp_boolean_t run_inline;
+  struct timespec deadline;
+  char *key;
+  int status;
+
+  key = malloc(strlen(hostname) + 16);
+  if (NULL == key) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  (void)sprintf(key, "%s:%d", hostname, port);
+
+  if (timeout) {
+    get_deadline(timeout, &deadline);
+  }
+
+  pthread_mutex_lock(&resolver_mutex);
+
+  status = cache_get(key, result);
+  if (AMQP_STATUS_OK == status || AMQP_STATUS_NO_MEMORY == status) {
+    goto out;
+  }
+
+  query = query_start(key, hostname, port, timeout, &run_inline);
+  if (NULL == query) {
+    status = AMQP_STATUS_NO_MEMORY;
+    goto out;
+  }
+
+  if (run_inline) {
+    struct addrinfo *query_result = NULL;
+
+    pthread_mutex_unlock(&resolver_mutex);
+    status = lookup(hostname, query->port, &query_result);
+    pthread_mutex_lock(&resolver_mutex);
+    query_complete(query, status, query_result);
+  }
+
+  while (!query->done) {
+    if (timeout) {
+      if (ETIMEDOUT == pthread_cond_timedwait(&query->cond, &resolver_mutex,
+                                              &deadline)) {
+        break;
+      }
+    } else {
+      pthread_cond_wait(&query->cond, &resolver_mutex);
+    }
+  }
+
+  if (!query->done) {
+    status = AMQP_STATUS_TIMEOUT;
+  } else {
+    status = query->status;
+    if (AMQP_STATUS_OK == status) {
+      *result = copy_addrinfo(query->result);
+      if (NULL == *result) {
+        status = AMQP_STATUS_NO_MEMORY;
+      }
+    }
+  }
+  query_release(query);
+
+out:
+  pthread_mutex_unlock(&resolver_mutex);
+  free(key);
+  return status;
+}
+
+#else /* AMQP_RESOLVER_THREADS */
+
+int
+amqp_resolve(const char *hostname, int port, AMQP_UNUSED struct timeval *timeout,
+             struct addrinfo **result)
+{
+  char port_string[16];
+  char *key;
+  int status;
+
+  key = malloc(strlen(hostname) + 16);
+  if (NULL == key) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  (void)sprintf(key, "%s:%d", hostname, port);
+  (void)sprintf(port_string, "%d", port);
+
+  status = cache_get(key, result);
+  if (AMQP_STATUS_OK != status && AMQP_STATUS_NO_MEMORY != status) {
+    status = lookup(hostname, port_string, result);
+    if (AMQP_STATUS_OK == status) {
+      cache_put(key, *result);
+    }
+  }
+
+  free(key);
+  return status;
+}
+
+#endif /* AMQP_RESOLVER_THREADS */
@@ -0,0 +1,65 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef AMQP_RESOLVER_H
+#define AMQP_RESOLVER_H
+
+#include "amqp_private.h"
+
+#ifdef _WIN32
+# ifndef WIN32_LEAN_AND_MEAN
+#  define WIN32_LEAN_AND_MEAN
+# endif
+# include <Winsock2.h>
+# include <ws2tcpip.h>
+#else
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <netdb.h>
+#endif
+
+/* Maximum number of hostnames kept in the resolver cache */
+#define AMQP_RESOLVER_CACHE_SIZE 64
+
+/*
+ * Resolves hostname and port to a list of TCP addresses.
+ *
+ * Answers are served from the resolver cache while they are fresh, see
+ * amqp_set_resolver_cache_ttl(). Otherwise the lookup runs on a helper thread
+ * so that it is bounded by timeout (NULL waits for as long as the lookup
+ * takes). Concurrent callers resolving the same name share a single lookup.
+ *
+ * On success *result must be released with amqp_resolver_free().
+ *
+ * Returns AMQP_STATUS_OK, AMQP_STATUS_TIMEOUT if the timeout elapsed before
+ * the lookup finished, or AMQP_STATUS_HOSTNAME_RESOLUTION_FAILED.
+ */
+int
+amqp_resolve(const char *hostname, int port, struct timeval *timeout,
+             struct addrinfo **result);
+
+/* Releases an address list returned by amqp_resolve() */
+void
+amqp_resolver_free(struct addrinfo *result);
+
+#endif /* AMQP_RESOLVER_H */
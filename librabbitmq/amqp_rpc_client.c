@@ -0,0 +1,579 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Replies arrive on the channel's amq.rabbitmq.reply-to consumer, so there
+ * is no queue to declare per call and any number of calls may be
+ * outstanding at once. Each call gets a correlation id made from a 64 bit
+ * counter; pending calls are found by that number in an open addressing
+ * hash table, and those with a deadline are also kept in a binary heap
+ * ordered by deadline so the next one to expire is always at the top.
+ */
+
+#define REPLY_TO_QUEUE "amq.rabbitmq.reply-to"
+#define CORRELATION_ID_LEN 16
+#define INITIAL_SLOTS 64
+
+struct rpc_call {
+  uint64_t id;
+  uint64_t deadline;
+  size_t heap_index;
+  amqp_rpc_reply_fn callback;
+  void *user_data;
+};
+
+struct amqp_rpc_client_t_ {
+  amqp_connection_state_t state;
+  amqp_channel_t channel;
+  amqp_bytes_t consumer_tag;
+  uint64_t next_id;
+  uint64_t completed;
+
+  struct rpc_call **slots;
+  size_t slot_count;
+  size_t pending;
+
+  struct rpc_call **heap;
+  size_t heap_size;
+  size_t heap_capacity;
+};
+
+static size_t
+slot_of(amqp_rpc_client_t const *client, uint64_t id)
+{
+  /* ids are sequential, so spread them before masking */
+  id *= 0x9E3779B97F4A7C15ULL;
+  return (size_t)(id >> 32) & (client->slot_count - 1);
+}
+
+static int
+grow_slots(amqp_rpc_client_t *client)
+{
+  size_t old_count = client->slot_count;
+  struct rpc_call **old_slots = client->slots;
+  size_t i;
+
+  client->slots = calloc(old_count * 2, sizeof(struct rpc_call *));
+  if (NULL == client->slots) {
+    client->slots = old_slots;
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  client->slot_count = old_count * 2;
+
+  for (i = 0; i < old_count; i++) {
+    if (old_slots[i] != NULL) {
+      size_t slot = slot_of(client, old_slots[i]->id);
+      while (client->slots[slot] != NULL) {
+        slot = (slot + 1) & (client->slot_count - 1);
+      }
+      client->slots[slot] = old_slots[i];
+    }
+  }
+  free(old_slots);
+  return AMQP_STATUS_OK;
+}
+
+/* Room must have been made with grow_slots() first */
+static void
+insert_call(amqp_rpc_client_t *client, struct rpc_call *call)
+{
+  size_t slot = slot_of(client, call->id);
+  while (client->slots[slot] != NULL) {
+    slot = (slot + 1) & (client->slot_count - 1);
+  }
+  client->slots[slot] = call;
+  client->pending++;
+}
+
+static struct rpc_call *
+remove_call(amqp_rpc_client_t *client, uint64_t id)
+{
+  size_t mask = client->slot_count - 1;
+  size_t slot = slot_of(client, id);
+  size_t next;
+  struct rpc_call *call;
+
+  for (;;) {
+    call = client->slots[slot];
+    if (NULL == call) {
+      return NULL;
+    }
+    if (call->id == id) {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  /* Shift later entries of the run back so lookups never stop early */
+  client->slots[slot] = NULL;
+  client->pending--;
+  for (next = (slot + 1) & mask; client->slots[next] != NULL;
+       next = (next + 1) & mask) {
+    size_t home = slot_of(client, client->slots[next]->id);
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      client->slots[slot] = client->slots[next];
+      client->slots[next] = NULL;
+      slot = next;
+    }
+  }
+  return call;
+}
+
+static void
+heap_set(amqp_rpc_client_t *client, size_t index, struct rpc_call *call)
+{
+  client->heap[index] = call;
+  call->heap_index = index;
+}
+
+static void
+heap_up(amqp_rpc_client_t *client, size_t index)
+{
+  struct rpc_call *call = client->heap[index];
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (client->heap[parent]->deadline <= call->deadline) {
+      break;
+    }
+    heap_set(client, index, client->heap[parent]);
+    index = parent;
+  }
+  heap_set(client, index, call);
+}
+
+static void
+heap_down(amqp_rpc_client_t *client, size_t index)
+{
+  struct rpc_call *call = client->heap[index];
+  for (;;) {
+    size_t child = index * 2 + 1;
+    if (child >= client->heap_size) {
+      break;
+    }
+    if (child + 1 < client->heap_size &&
+        client->heap[child + 1]->deadline < client->heap[child]->deadline) {
+      child++;
+    }
+    if (call->deadline <= client->heap[child]->deadline) {
+      break;
+    }
+    heap_set(client, index, client->heap[child]);
+    index = child;
+  }
+  heap_set(client, index, call);
+}
+
+static int
+reserve_heap(amqp_rpc_client_t *client)
+{
+  struct rpc_call **heap;
+  size_t capacity;
+
+  if (client->heap_size < client->heap_capacity) {
+    return AMQP_STATUS_OK;
+  }
+  capacity = client->heap_capacity ? client->heap_capacity * 2 : INITIAL_SLOTS;
+  heap = realloc(client->heap, capacity * sizeof(struct rpc_call *));
+  if (NULL == heap) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  client->heap = heap;
+  client->heap_capacity = capacity;
+  return AMQP_STATUS_OK;
+}
+
+static void
+heap_remove(amqp_rpc_client_t *client, struct rpc_call *call)
+{
+  size_t index = call->heap_index;
+  struct rpc_call *last = client->heap[--client->heap_size];
+
+  if (last == call) {
+    return;
+  }
+  heap_set(client, index, last);
+  if (index > 0 && client->heap[(index - 1) / 2]->deadline > last->deadline) {
+    heap_up(client, index);
+  } else {
+    heap_down(client, index);
+  }
+}
+
+static void
+format_id(uint64_t id, char *buffer)
+{
+  static const char digits[] = "0123456789abcdef";
+  int i;
+  for (i = CORRELATION_ID_LEN - 1; i >= 0; i--) {
+    buffer[i] = digits[id & 0xF];
+    id >>= 4;
+  }
+}
+
+static int
+parse_id(amqp_bytes_t correlation_id, uint64_t *id)
+{
+  unsigned char const *p = correlation_id.bytes;
+  size_t i;
+
+  if (correlation_id.len != CORRELATION_ID_LEN) {
+    return 0;
+  }
+  *id = 0;
+  for (i = 0; i < CORRELATION_ID_LEN; i++) {
+    int digit;
+    if (p[i] >= '0' && p[i] <= '9') {
+      digit = p[i] - '0';
+    } else if (p[i] >= 'a' && p[i] <= 'f') {
+      digit = p[i] - 'a' + 10;
+    } else {
+      return 0;
+    }
+    *id = (*id << 4) | (uint64_t)digit;
+  }
+  return 1;
+}
+
+static int
+start_consuming(amqp_rpc_client_t *client)
+{
+  amqp_basic_consume_ok_t *ok;
+  amqp_rpc_reply_t reply;
+
+  /* direct reply-to requires no_ack */
+  ok = amqp_basic_consume(client->state, client->channel,
+                          amqp_cstring_bytes(REPLY_TO_QUEUE), amqp_empty_bytes,
+                          0, 1, 0, amqp_empty_table);
+  if (NULL == ok) {
+    reply = amqp_get_rpc_reply(client->state);
+    switch (reply.reply_type) {
+      case AMQP_RESPONSE_LIBRARY_EXCEPTION:
+        return reply.library_error;
+      default:
+        return AMQP_STATUS_UNEXPECTED_STATE;
+    }
+  }
+
+  client->consumer_tag = amqp_bytes_malloc_dup(ok->consumer_tag);
+  if (NULL == client->consumer_tag.bytes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_rpc_client_new(amqp_connection_state_t state, amqp_channel_t channel,
+                    amqp_rpc_client_t **client)
+{
+  amqp_rpc_client_t *c;
+  int res;
+
+  if (NULL == state || NULL == client) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  c = calloc(1, sizeof(amqp_rpc_client_t));
+  if (NULL == c) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  c->state = state;
+  c->channel = channel;
+  c->next_id = 1;
+  c->slot_count = INITIAL_SLOTS;
+  c->slots = calloc(c->slot_count, sizeof(struct rpc_call *));
+  if (NULL == c->slots) {
+    free(c);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  res = start_consuming(c);
+  if (AMQP_STATUS_OK != res) {
+    amqp_rpc_client_free(c);
+    return res;
+  }
+
+  *client = c;
+  return AMQP_STATUS_OK;
+}
+
+void
+amqp_rpc_client_free(amqp_rpc_client_t *client)
+{
+  size_t i;
+
+  if (NULL == client) {
+    return;
+  }
+  for (i = 0; i < client->slot_count; i++) {
+    free(client->slots[i]);
+  }
+  free(client->slots);
+  free(client->heap);
+  amqp_bytes_free(client->consumer_tag);
+  free(client);
+}
+
+int
+amqp_rpc_client_call(amqp_rpc_client_t *client, amqp_bytes_t exchange,
+                     amqp_bytes_t routing_key,
+                     amqp_basic_properties_t const *properties,
+                     amqp_bytes_t body, struct timeval *timeout,
+                     amqp_rpc_reply_fn callback, void *user_data)
+{
+  amqp_basic_properties_t props;
+  char correlation_id[CORRELATION_ID_LEN];
+  struct rpc_call *call;
+  uint64_t now;
+  int res;
+
+  if (NULL == client || NULL == callback ||
+      (timeout && (timeout->tv_sec < 0 || timeout->tv_usec < 0))) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  /* Make all the room needed up front, so a published request is always
+     tracked */
+  if ((client->pending + 1) * 4 > client->slot_count * 3) {
+    res = grow_slots(client);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  if (timeout) {
+    res = reserve_heap(client);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  call = malloc(sizeof(struct rpc_call));
+  if (NULL == call) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  call->id = client->next_id++;
+  call->callback = callback;
+  call->user_data = user_data;
+  call->deadline = 0;
+  if (timeout) {
+    now = amqp_clock_now(&client->state->clock);
+    if (0 == now) {
+      free(call);
+      return AMQP_STATUS_TIMER_FAILURE;
+    }
+    call->deadline = now + (uint64_t)timeout->tv_sec * AMQP_NS_PER_S +
+                     (uint64_t)timeout->tv_usec * AMQP_NS_PER_US;
+  }
+
+  if (properties) {
+    props = *properties;
+  } else {
+    memset(&props, 0, sizeof(props));
+  }
+  format_id(call->id, correlation_id);
+  props._flags |= AMQP_BASIC_REPLY_TO_FLAG | AMQP_BASIC_CORRELATION_ID_FLAG;
+  props.reply_to = amqp_cstring_bytes(REPLY_TO_QUEUE);
+  props.correlation_id.len = CORRELATION_ID_LEN;
+  props.correlation_id.bytes = correlation_id;
+
+  res = amqp_basic_publish(client->state, client->channel, exchange,
+                           routing_key, 0, 0, &props, body);
+  if (AMQP_STATUS_OK != res) {
+    free(call);
+    return res;
+  }
+
+  insert_call(client, call);
+  if (timeout) {
+    client->heap[client->heap_size++] = call;
+    heap_up(client, client->heap_size - 1);
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Calls back and forgets a call that is no longer in the table */
+static void
+complete_call(amqp_rpc_client_t *client, struct rpc_call *call, int status,
+              amqp_envelope_t const *reply)
+{
+  if (call->deadline) {
+    heap_remove(client, call);
+  }
+  client->completed++;
+  call->callback(call->user_data, status, reply);
+  free(call);
+}
+
+int
+amqp_rpc_client_handle(amqp_rpc_client_t *client,
+                       amqp_envelope_t const *envelope,
+                       amqp_boolean_t *handled)
+{
+  amqp_basic_properties_t const *props;
+  struct rpc_call *call;
+  uint64_t id;
+
+  if (NULL == client || NULL == envelope) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  if (envelope->channel != client->channel ||
+      envelope->consumer_tag.len != client->consumer_tag.len ||
+      0 != memcmp(envelope->consumer_tag.bytes, client->consumer_tag.bytes,
+                  client->consumer_tag.len)) {
+    if (handled) {
+      *handled = 0;
+    }
+    return AMQP_STATUS_OK;
+  }
+  if (handled) {
+    *handled = 1;
+  }
+
+  /* A reply without a known id most likely belongs to a call that has
+     already timed out */
+  props = &envelope->message.properties;
+  if (!(props->_flags & AMQP_BASIC_CORRELATION_ID_FLAG) ||
+      !parse_id(props->correlation_id, &id)) {
+    return AMQP_STATUS_OK;
+  }
+  call = remove_call(client, id);
+  if (call != NULL) {
+    complete_call(client, call, AMQP_STATUS_OK, envelope);
+  }
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_rpc_client_expire(amqp_rpc_client_t *client)
+{
+  uint64_t now;
+
+  if (NULL == client) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (0 == client->heap_size) {
+    return AMQP_STATUS_OK;
+  }
+
+  now = amqp_clock_now(&client->state->clock);
+  if (0 == now) {
+    return AMQP_STATUS_TIMER_FAILURE;
+  }
+  while (client->heap_size > 0 && client->heap[0]->deadline <= now) {
+    struct rpc_call *call = remove_call(client, client->heap[0]->id);
+    complete_call(client, call, AMQP_STATUS_TIMEOUT, NULL);
+  }
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_rpc_client_process(amqp_rpc_client_t *client, struct timeval *timeout)
+{
+  uint64_t deadline = 0;
+  uint64_t completed;
+  int res;
+
+  if (NULL == client ||
+      (timeout && (timeout->tv_sec < 0 || timeout->tv_usec < 0))) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  completed = client->completed;
+  for (;;) {
+    amqp_envelope_t envelope;
+    amqp_rpc_reply_t reply;
+    struct timeval tv;
+    uint64_t now;
+    uint64_t wait_until;
+
+    /* One clock read per iteration, amqp_rpc_client_expire() and the wait
+     * below reuse it through the connection's clock */
+    now = amqp_clock_refresh(&client->state->clock);
+    if (0 == now) {
+      return AMQP_STATUS_TIMER_FAILURE;
+    }
+    if (timeout && 0 == deadline) {
+      deadline = now + (uint64_t)timeout->tv_sec * AMQP_NS_PER_S +
+                 (uint64_t)timeout->tv_usec * AMQP_NS_PER_US;
+    }
+    wait_until = deadline;
+
+    res = amqp_rpc_client_expire(client);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    if (client->completed != completed || 0 == client->pending) {
+      return AMQP_STATUS_OK;
+    }
+
+    if (client->heap_size > 0 &&
+        (0 == wait_until || client->heap[0]->deadline < wait_until)) {
+      wait_until = client->heap[0]->deadline;
+    }
+    if (wait_until) {
+      if (deadline && now >= deadline) {
+        return AMQP_STATUS_TIMEOUT;
+      }
+      now = wait_until > now ? wait_until - now : 0;
+      tv.tv_sec = (long)(now / AMQP_NS_PER_S);
+      tv.tv_usec = (long)((now % AMQP_NS_PER_S) / AMQP_NS_PER_US);
+    }
+
+    amqp_maybe_release_buffers(client->state);
+    reply = amqp_consume_message(client->state, &envelope,
+                                 wait_until ? &tv : NULL, 0);
+    switch (reply.reply_type) {
+      case AMQP_RESPONSE_NORMAL:
+        res = amqp_rpc_client_handle(client, &envelope, NULL);
+        amqp_destroy_envelope(&envelope);
+        if (AMQP_STATUS_OK != res) {
+          return res;
+        }
+        break;
+      case AMQP_RESPONSE_LIBRARY_EXCEPTION:
+        if (AMQP_STATUS_TIMEOUT != reply.library_error) {
+          return reply.library_error;
+        }
+        break;
+      default:
+        return AMQP_STATUS_UNEXPECTED_STATE;
+    }
+  }
+}
+
+size_t
+amqp_rpc_client_pending(amqp_rpc_client_t const *client)
+{
+  return client ? client->pending : 0;
+}
@@ -0,0 +1,648 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_timer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The ring is a shared memory object holding a header, one slot per reader
+ * and the data area. Positions are byte offsets that only ever grow; a
+ * record at position p starts at p % capacity and never wraps, the space
+ * left at the end of the data area is filled with a padding record.
+ *
+ * There is a single writer. It announces the end of the region it is
+ * about to overwrite in write_begin, writes the record, and then publishes
+ * it by moving write_end. Readers copy a record out and then check
+ * write_begin to see whether the writer got to it in the meantime, the
+ * same way a seqlock works.
+ *
+ * With AMQP_SHM_RING_OVERWRITE, readers that fall more than capacity bytes
+ * behind lose the oldest messages and continue from tail, the oldest
+ * record still intact. With AMQP_SHM_RING_DROP_NEWEST the writer never
+ * overwrites what an attached reader has not read yet, and drops the new
+ * message instead.
+ */
+
+#define AMQP_SHM_RING_MAGIC 0x52515252 /* RQRR */
+#define AMQP_SHM_RING_VERSION 1
+#define AMQP_SHM_RING_MIN_CAPACITY 4096
+
+#define RECORD_MESSAGE 1
+#define RECORD_PADDING 2
+
+#define RING_LOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define RING_STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RING_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+struct ring_slot {
+  int32_t pid;                /* 0 when free */
+  uint32_t reserved;
+  uint64_t position;          /* the next record the reader will read */
+};
+
+struct ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  uint32_t policy;
+  uint32_t max_readers;
+  uint64_t data_offset;
+  uint64_t write_begin;
+  uint64_t write_end;
+  uint64_t tail;
+  uint64_t published;
+  uint64_t dropped;
+};
+
+struct ring_record {
+  uint32_t len;               /* the whole record, a multiple of 8 */
+  uint32_t kind;
+  uint64_t seq;
+  uint32_t properties_len;
+  uint32_t exchange_len;
+  uint32_t routing_key_len;
+  uint32_t body_len;
+};
+
+struct amqp_shm_ring_t_ {
+  char *name;
+  struct ring_header *header;
+  struct ring_slot *slots;
+  char *data;
+  size_t map_size;
+  amqp_flags_t property_mask;
+};
+
+struct amqp_shm_ring_reader_t_ {
+  struct ring_header *header;
+  struct ring_slot *slot;
+  char *data;
+  size_t map_size;
+  uint64_t position;
+  uint64_t next_seq;
+  uint64_t lost;
+};
+
+static size_t
+align8(size_t len)
+{
+  return (len + 7) & ~(size_t)7;
+}
+
+static size_t
+data_offset(uint32_t max_readers)
+{
+  size_t offset = sizeof(struct ring_header) +
+                  max_readers * sizeof(struct ring_slot);
+  /* keep the data area on its own cache line */
+  return (offset + 63) & ~(size_t)63;
+}
+
+static struct ring_slot *
+ring_slots(struct ring_header *header)
+{
+  return (struct ring_slot *)(header + 1);
+}
+
+static amqp_boolean_t
+pid_alive(int32_t pid)
+{
+  return 0 == kill((pid_t)pid, 0) || EPERM == errno;
+}
+
+int
+amqp_shm_ring_create(char const *name, size_t capacity, int max_readers,
+                     amqp_shm_ring_policy_enum policy,
+                     amqp_flags_t property_mask, amqp_shm_ring_t **ring)
+{
+  amqp_shm_ring_t *r;
+  struct ring_header *header;
+  size_t offset;
+  size_t size;
+  void *map;
+  int fd;
+
+  if (NULL == name || max_readers <= 0 ||
+      (AMQP_SHM_RING_OVERWRITE != policy &&
+       AMQP_SHM_RING_DROP_NEWEST != policy)) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (capacity < AMQP_SHM_RING_MIN_CAPACITY) {
+    capacity = AMQP_SHM_RING_MIN_CAPACITY;
+  }
+  capacity = align8(capacity);
+  offset = data_offset((uint32_t)max_readers);
+  size = offset + capacity;
+
+  r = calloc(1, sizeof(amqp_shm_ring_t));
+  if (NULL == r) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  r->name = strdup(name);
+  if (NULL == r->name) {
+    free(r);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  /* Readers still attached to a previous ring of the same name keep it,
+   * new readers get this one */
+  shm_unlink(name);
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (-1 == fd) {
+    goto error;
+  }
+  if (ftruncate(fd, (off_t)size)) {
+    close(fd);
+    shm_unlink(name);
+    goto error;
+  }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) {
+    shm_unlink(name);
+    goto error;
+  }
+
+  header = map;
+  header->version = AMQP_SHM_RING_VERSION;
+  header->capacity = capacity;
+  header->policy = policy;
+  header->max_readers = (uint32_t)max_readers;
+  header->data_offset = offset;
+  /* readers check the magic last */
+  RING_STORE(header->magic, AMQP_SHM_RING_MAGIC);
+
+  r->header = header;
+  r->slots = ring_slots(header);
+  r->data = (char *)map + offset;
+  r->map_size = size;
+  r->property_mask = property_mask;
+
+  *ring = r;
+  return AMQP_STATUS_OK;
+
+error:
+  free(r->name);
+  free(r);
+  return AMQP_STATUS_FILE_ERROR;
+}
+
+void
+amqp_shm_ring_destroy(amqp_shm_ring_t *ring)
+{
+  if (NULL == ring) {
+    return;
+  }
+  munmap(ring->header, ring->map_size);
+  shm_unlink(ring->name);
+  free(ring->name);
+  free(ring);
+}
+
+uint64_t
+amqp_shm_ring_dropped(amqp_shm_ring_t *ring)
+{
+  return ring->header->dropped;
+}
+
+/* The position of the slowest attached reader, or end if there are none */
+static uint64_t
+slowest_reader(amqp_shm_ring_t *ring, uint64_t end, amqp_boolean_t reap)
+{
+  uint64_t slowest = end;
+  uint32_t i;
+
+  for (i = 0; i < ring->header->max_readers; i++) {
+    struct ring_slot *slot = &ring->slots[i];
+    int32_t pid = RING_LOAD(slot->pid);
+
+    if (0 == pid) {
+      continue;
+    }
+    if (reap && !pid_alive(pid)) {
+      __atomic_compare_exchange_n(&slot->pid, &pid, 0, 0, __ATOMIC_ACQ_REL,
+                                  __ATOMIC_ACQUIRE);
+      continue;
+    }
+    {
+      uint64_t position = RING_LOAD(slot->position);
+      if (position < slowest) {
+        slowest = position;
+      }
+    }
+  }
+  return slowest;
+}
+
+static void
+copy_bytes(char **dest, amqp_bytes_t src)
+{
+  if (src.len) {
+    memcpy(*dest, src.bytes, src.len);
+    *dest += src.len;
+  }
+}
+
+int
+amqp_shm_ring_publish(amqp_shm_ring_t *ring, amqp_envelope_t const *envelope)
+{
+  struct ring_header *header = ring->header;
+  uint64_t capacity = header->capacity;
+  amqp_basic_properties_t properties = envelope->message.properties;
+  amqp_bytes_t encoded = amqp_empty_bytes;
+  struct ring_record record;
+  uint64_t position = header->write_end;
+  uint64_t offset = position % capacity;
+  uint64_t padding = 0;
+  uint64_t end;
+  uint64_t tail;
+  size_t len;
+  char *dest;
+  int res;
+
+  properties._flags &= ring->property_mask;
+  if (properties._flags) {
+    res = amqp_encode_basic_properties(&properties, &encoded);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  len = align8(sizeof(struct ring_record) + encoded.len +
+               envelope->exchange.len + envelope->routing_key.len +
+               envelope->message.body.len);
+  if (len > capacity / 4) {
+    amqp_bytes_free(encoded);
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  if (capacity - offset < len) {
+    padding = capacity - offset;
+  }
+  end = position + padding + len;
+
+  if (AMQP_SHM_RING_DROP_NEWEST == header->policy &&
+      end - slowest_reader(ring, end, 0) > capacity &&
+      end - slowest_reader(ring, end, 1) > capacity) {
+    amqp_bytes_free(encoded);
+    RING_STORE(header->dropped, header->dropped + 1);
+    return AMQP_STATUS_OK;
+  }
+
+  /* Tell readers what is about to be overwritten, and move the tail past
+   * the records that will be gone */
+  RING_STORE(header->write_begin, end);
+  tail = header->tail;
+  while (end - tail > capacity) {
+    struct ring_record *oldest =
+        (struct ring_record *)(ring->data + tail % capacity);
+    tail += oldest->len;
+  }
+  RING_STORE(header->tail, tail);
+  RING_FENCE();
+
+  if (padding) {
+    struct ring_record *pad = (struct ring_record *)(ring->data + offset);
+    pad->len = (uint32_t)padding;
+    pad->kind = RECORD_PADDING;
+    offset = 0;
+  }
+
+  memset(&record, 0, sizeof(record));
+  record.len = (uint32_t)len;
+  record.kind = RECORD_MESSAGE;
+  record.seq = header->published + 1;
+  record.properties_len = (uint32_t)encoded.len;
+  record.exchange_len = (uint32_t)envelope->exchange.len;
+  record.routing_key_len = (uint32_t)envelope->routing_key.len;
+  record.body_len = (uint32_t)envelope->message.body.len;
+
+  dest = ring->data + offset;
+  memcpy(dest, &record, sizeof(record));
+  dest += sizeof(record);
+  copy_bytes(&dest, encoded);
+  copy_bytes(&dest, envelope->exchange);
+  copy_bytes(&dest, envelope->routing_key);
+  copy_bytes(&dest, envelope->message.body);
+  amqp_bytes_free(encoded);
+
+  RING_STORE(header->published, record.seq);
+  RING_STORE(header->write_end, end);
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_shm_ring_attach(char const *name, amqp_shm_ring_reader_t **reader)
+{
+  amqp_shm_ring_reader_t *r;
+  struct ring_header *header;
+  struct stat st;
+  void *map;
+  uint32_t i;
+  int fd;
+
+  fd = shm_open(name, O_RDWR, 0);
+  if (-1 == fd) {
+    return AMQP_STATUS_FILE_ERROR;
+  }
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct ring_header)) {
+    close(fd);
+    return AMQP_STATUS_FILE_ERROR;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+             fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) {
+    return AMQP_STATUS_FILE_ERROR;
+  }
+
+  header = map;
+  if (AMQP_SHM_RING_MAGIC != RING_LOAD(header->magic) ||
+      AMQP_SHM_RING_VERSION != header->version ||
+      header->data_offset != data_offset(header->max_readers) ||
+      header->data_offset + header->capacity != (uint64_t)st.st_size) {
+    munmap(map, (size_t)st.st_size);
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  r = calloc(1, sizeof(amqp_shm_ring_reader_t));
+  if (NULL == r) {
+    munmap(map, (size_t)st.st_size);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  r->header = header;
+  r->data = (char *)map + header->data_offset;
+  r->map_size = (size_t)st.st_size;
+  r->position = RING_LOAD(header->write_end);
+
+  for (i = 0; i < header->max_readers && NULL == r->slot; i++) {
+    struct ring_slot *slot = &ring_slots(header)[i];
+    int32_t pid = RING_LOAD(slot->pid);
+
+    if (0 != pid && pid_alive(pid)) {
+      continue;
+    }
+    RING_STORE(slot->position, r->position);
+    if (__atomic_compare_exchange_n(&slot->pid, &pid, (int32_t)getpid(), 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      r->slot = slot;
+    }
+  }
+
+  /* Without a slot the writer can't hold back for this reader */
+  if (NULL == r->slot && AMQP_SHM_RING_DROP_NEWEST == header->policy) {
+    munmap(map, r->map_size);
+    free(r);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  *reader = r;
+  return AMQP_STATUS_OK;
+}
+
+void
+amqp_shm_ring_detach(amqp_shm_ring_reader_t *reader)
+{
+  if (NULL == reader) {
+    return;
+  }
+  if (reader->slot) {
+    RING_STORE(reader->slot->pid, 0);
+  }
+  munmap(reader->header, reader->map_size);
+  free(reader);
+}
+
+uint64_t
+amqp_shm_ring_lost(amqp_shm_ring_reader_t *reader)
+{
+  return reader->lost;
+}
+
+/* Whether the writer has started overwriting anything at or after
+ * position */
+static amqp_boolean_t
+overwritten(amqp_shm_ring_reader_t *reader, uint64_t position)
+{
+  return RING_LOAD(reader->header->write_begin) - position >
+         reader->header->capacity;
+}
+
+static int
+bytes_copy(amqp_bytes_t *dest, char const *src, size_t len)
+{
+  if (0 == len) {
+    *dest = amqp_empty_bytes;
+    return AMQP_STATUS_OK;
+  }
+  *dest = amqp_bytes_malloc(len);
+  if (NULL == dest->bytes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  memcpy(dest->bytes, src, len);
+  return AMQP_STATUS_OK;
+}
+
+static void
+free_envelope(amqp_envelope_t *envelope)
+{
+  amqp_destroy_envelope(envelope);
+  memset(envelope, 0, sizeof(amqp_envelope_t));
+}
+
+/* Copies the record at the reader's position into envelope. Returns
+ * AMQP_STATUS_OK with an empty envelope for padding, or
+ * AMQP_STATUS_UNEXPECTED_STATE if the writer overwrote the record. */
+static int
+copy_record(amqp_shm_ring_reader_t *reader, amqp_envelope_t *envelope,
+            uint64_t *record_len, uint64_t *seq)
+{
+  uint64_t capacity = reader->header->capacity;
+  uint64_t offset = reader->position % capacity;
+  char const *src = reader->data + offset;
+  struct ring_record record;
+  amqp_bytes_t properties = amqp_empty_bytes;
+  int res;
+
+  memset(envelope, 0, sizeof(amqp_envelope_t));
+
+  /* a padding record may be no bigger than its len and kind */
+  memcpy(&record, src, 8);
+  if (record.len < 8 || record.len % 8 || record.len > capacity - offset ||
+      (RECORD_MESSAGE == record.kind && record.len < sizeof(record))) {
+    return AMQP_STATUS_UNEXPECTED_STATE;
+  }
+  *record_len = record.len;
+  *seq = 0;
+  if (RECORD_MESSAGE != record.kind) {
+    return overwritten(reader, reader->position) ?
+           AMQP_STATUS_UNEXPECTED_STATE : AMQP_STATUS_OK;
+  }
+
+  memcpy(&record, src, sizeof(record));
+  if ((uint64_t)record.properties_len + record.exchange_len +
+      record.routing_key_len + record.body_len >
+      record.len - sizeof(record)) {
+    return AMQP_STATUS_UNEXPECTED_STATE;
+  }
+  src += sizeof(record);
+
+  init_amqp_pool(&envelope->message.pool, 4096);
+  if (record.properties_len) {
+    properties.len = record.properties_len;
+    properties.bytes = amqp_pool_alloc(&envelope->message.pool,
+                                       record.properties_len);
+    if (NULL == properties.bytes) {
+      res = AMQP_STATUS_NO_MEMORY;
+      goto error;
+    }
+    memcpy(properties.bytes, src, record.properties_len);
+    src += record.properties_len;
+  }
+  res = bytes_copy(&envelope->exchange, src, record.exchange_len);
+  if (AMQP_STATUS_OK != res) {
+    goto error;
+  }
+  src += record.exchange_len;
+  res = bytes_copy(&envelope->routing_key, src, record.routing_key_len);
+  if (AMQP_STATUS_OK != res) {
+    goto error;
+  }
+  src += record.routing_key_len;
+  res = bytes_copy(&envelope->message.body, src, record.body_len);
+  if (AMQP_STATUS_OK != res) {
+    goto error;
+  }
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (overwritten(reader, reader->position)) {
+    res = AMQP_STATUS_UNEXPECTED_STATE;
+    goto error;
+  }
+
+  /* the properties were copied out intact, they can be decoded now */
+  if (properties.len) {
+    amqp_basic_properties_t *decoded;
+
+    res = amqp_decode_properties(AMQP_BASIC_CLASS, &envelope->message.pool,
+                                 properties, (void **)&decoded);
+    if (AMQP_STATUS_OK != res) {
+      goto error;
+    }
+    envelope->message.properties = *decoded;
+  }
+  envelope->delivery_tag = record.seq;
+  *seq = record.seq;
+  return AMQP_STATUS_OK;
+
+error:
+  free_envelope(envelope);
+  return res;
+}
+
+int
+amqp_shm_ring_read(amqp_shm_ring_reader_t *reader, amqp_envelope_t *envelope,
+                   struct timeval const *timeout)
+{
+  uint64_t deadline = 0;
+  long backoff = 0;
+
+  if (timeout) {
+    deadline = amqp_get_monotonic_timestamp() +
+               (uint64_t)timeout->tv_sec * AMQP_NS_PER_S +
+               (uint64_t)timeout->tv_usec * AMQP_NS_PER_US;
+  }
+
+  while (1) {
+    uint64_t record_len;
+    uint64_t seq;
+    int res;
+
+    if (RING_LOAD(reader->header->write_end) == reader->position) {
+      struct timespec pause;
+
+      if (timeout && amqp_get_monotonic_timestamp() >= deadline) {
+        return AMQP_STATUS_TIMEOUT;
+      }
+      /* there is no cheap portable way to wait on another process, so
+       * poll, backing off to at most a millisecond */
+      backoff = backoff ? backoff * 2 : 1000;
+      if (backoff > 1000000) {
+        backoff = 1000000;
+      }
+      pause.tv_sec = 0;
+      pause.tv_nsec = backoff;
+      nanosleep(&pause, NULL);
+      continue;
+    }
+    backoff = 0;
+
+    if (overwritten(reader, reader->position)) {
+      reader->position = RING_LOAD(reader->header->tail);
+      continue;
+    }
+
+    res = copy_record(reader, envelope, &record_len, &seq);
+    if (AMQP_STATUS_UNEXPECTED_STATE == res) {
+      if (!overwritten(reader, reader->position)) {
+        return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      /* lapped while reading */
+      reader->position = RING_LOAD(reader->header->tail);
+      continue;
+    }
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    reader->position += record_len;
+    if (reader->slot) {
+      RING_STORE(reader->slot->position, reader->position);
+    }
+    if (0 == seq) {
+      continue;
+    }
+
+    if (reader->next_seq && seq > reader->next_seq) {
+      reader->lost += seq - reader->next_seq;
+    }
+    reader->next_seq = seq + 1;
+    return AMQP_STATUS_OK;
+  }
+}
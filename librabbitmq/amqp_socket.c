@@ -39,6 +39,7 @@
 #endif
 
 #include "amqp_private.h"
+#include "amqp_resolver.h"
 #include "amqp_timer.h"
 
 #include <assert.h>
@@ -139,7 +140,7 @@ amqp_os_socket_setsockopt(int sock, int level, int optname,
 #endif
 }
 
-static int
+int
 amqp_os_socket_setsockblock(int sock, int block)
 {
 
@@ -192,6 +193,39 @@ amqp_os_socket_close(int sockfd)
 #endif
 }
 
+int
+amqp_os_socket_wait(int sockfd, amqp_boolean_t for_write,
+                    amqp_timer_t *timer, struct timeval *timeout)
+{
+  while (1) {
+    struct pollfd pfd;
+    int timeout_ms = -1;
+    int res;
+
+    if (timeout) {
+      res = amqp_timer_update(timer, timeout);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+      timeout_ms = timer->tv.tv_sec * AMQP_MS_PER_S +
+          timer->tv.tv_usec / AMQP_US_PER_MS;
+    }
+
+    pfd.fd = sockfd;
+    pfd.events = for_write ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+
+    res = poll(&pfd, 1, timeout_ms);
+    if (0 < res) {
+      return AMQP_STATUS_OK;
+    } else if (0 == res) {
+      return AMQP_STATUS_TIMEOUT;
+    } else if (EINTR != amqp_os_socket_error()) {
+      return AMQP_STATUS_SOCKET_ERROR;
+    }
+  }
+}
+
 ssize_t
 amqp_socket_writev(amqp_socket_t *self, struct iovec *iov, int iovcnt)
 {
@@ -264,192 +298,314 @@ amqp_open_socket(char const *hostname,
   return amqp_open_socket_noblock(hostname, portnumber, NULL);
 }
 
-int amqp_open_socket_noblock(char const *hostname,
-                     int portnumber,
-                     struct timeval *timeout)
+/* Delay between starting successive connection attempts, see RFC 8305
+ * section 5 */
+#define AMQP_CONNECT_ATTEMPT_DELAY_MS 250
+
+/* Orders the resolved addresses so that address families alternate, starting
+ * with the family of the first address returned by the resolver (RFC 8305
+ * section 4). Returns the number of addresses written to ordered. */
+static size_t
+amqp_interleave_addresses(struct addrinfo *address_list,
+                          struct addrinfo **ordered, size_t count)
 {
-  struct addrinfo hint;
-  struct addrinfo *address_list;
   struct addrinfo *addr;
-  char portnumber_string[33];
-  int sockfd = -1;
-  int last_error = AMQP_STATUS_OK;
+  size_t used = 0;
+  int preferred_family = address_list->ai_family;
+  amqp_boolean_t want_preferred = 1;
+
+  while (used < count) {
+    struct addrinfo *fallback = NULL;
+    struct addrinfo *chosen = NULL;
+    size_t i;
+
+    for (addr = address_list; addr; addr = addr->ai_next) {
+      for (i = 0; i < used; ++i) {
+        if (ordered[i] == addr) {
+          break;
+        }
+      }
+      if (i != used) {
+        continue;
+      }
+      if ((addr->ai_family == preferred_family) == want_preferred) {
+        chosen = addr;
+        break;
+      }
+      if (NULL == fallback) {
+        fallback = addr;
+      }
+    }
+
+    ordered[used++] = chosen ? chosen : fallback;
+    want_preferred = !want_preferred;
+  }
+
+  return used;
+}
+
+/* Creates a non-blocking socket for addr and starts connecting it. Returns the
+ * socket fd, or an amqp_status_enum value on failure. *connected is set when
+ * the connect completed immediately. */
+static int
+amqp_start_connect(struct addrinfo *addr, amqp_boolean_t *connected)
+{
   int one = 1; /* for setsockopt */
+  int sockfd;
   int res;
-  int timer_error;
-  amqp_timer_t timer;
 
-  AMQP_INIT_TIMER(timer)
+  *connected = 0;
 
-  if (timeout && (timeout->tv_sec < 0 || timeout->tv_usec < 0 ||
-      INT_MAX < ((uint64_t)timeout->tv_sec * AMQP_MS_PER_S +
-      (uint64_t)timeout->tv_usec / AMQP_US_PER_MS))) {
-    return AMQP_STATUS_INVALID_PARAMETER;
+  sockfd = amqp_os_socket_socket(addr->ai_family, addr->ai_socktype,
+                                 addr->ai_protocol);
+  if (-1 == sockfd) {
+    return AMQP_STATUS_SOCKET_ERROR;
   }
 
-  last_error = amqp_os_socket_init();
-  if (AMQP_STATUS_OK != last_error) {
-    return last_error;
+#ifdef SO_NOSIGPIPE
+  if (0 != amqp_os_socket_setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one))) {
+    goto error_out;
   }
+#endif /* SO_NOSIGPIPE */
 
-  memset(&hint, 0, sizeof(hint));
-  hint.ai_family = PF_UNSPEC; /* PF_INET or PF_INET6 */
-  hint.ai_socktype = SOCK_STREAM;
-  hint.ai_protocol = IPPROTO_TCP;
+  if (0 != amqp_os_socket_setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
+    goto error_out;
+  }
 
-  (void)sprintf(portnumber_string, "%d", portnumber);
+  if (AMQP_STATUS_OK != amqp_os_socket_setsockblock(sockfd, 0)) {
+    goto error_out;
+  }
 
-  last_error = getaddrinfo(hostname, portnumber_string, &hint, &address_list);
+  res = connect(sockfd, addr->ai_addr, addr->ai_addrlen);
+  if (0 == res) {
+    *connected = 1;
+    return sockfd;
+  }
 
-  if (0 != last_error) {
-    return AMQP_STATUS_HOSTNAME_RESOLUTION_FAILED;
+#ifdef _WIN32
+  if (WSAEWOULDBLOCK == amqp_os_socket_error()) {
+#else
+  if (EINPROGRESS == amqp_os_socket_error()) {
+#endif
+    return sockfd;
   }
 
+error_out:
+  amqp_os_socket_close(sockfd);
+  return AMQP_STATUS_SOCKET_ERROR;
+}
+
+/* Connects to one of the addresses in address_list, racing attempts as
+ * described in RFC 8305 ("Happy Eyeballs"): a new attempt is started every
+ * AMQP_CONNECT_ATTEMPT_DELAY_MS, or as soon as the previous one fails, and the
+ * first attempt to complete wins. A NULL timeout waits until every attempt
+ * has failed. */
+static int
+amqp_connect_addrinfo(struct addrinfo *address_list, struct timeval *timeout)
+{
+  struct addrinfo *addr;
+  struct addrinfo **ordered;
+  struct pollfd *pending;
+  size_t count = 0;
+  size_t next = 0;
+  size_t npending = 0;
+  size_t i;
+  uint64_t now;
+  uint64_t deadline = 0;
+  uint64_t next_attempt = 0;
+  int sockfd = -1;
+  int last_error = AMQP_STATUS_SOCKET_ERROR;
+
   for (addr = address_list; addr; addr = addr->ai_next) {
-    if (-1 != sockfd) {
-      amqp_os_socket_close(sockfd);
-    }
+    ++count;
+  }
+  if (0 == count) {
+    return AMQP_STATUS_HOSTNAME_RESOLUTION_FAILED;
+  }
 
-    sockfd = amqp_os_socket_socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  ordered = malloc(count * sizeof(struct addrinfo *));
+  pending = malloc(count * sizeof(struct pollfd));
+  if (NULL == ordered || NULL == pending) {
+    free(ordered);
+    free(pending);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  amqp_interleave_addresses(address_list, ordered, count);
 
-    if (-1 == sockfd) {
-      last_error = AMQP_STATUS_SOCKET_ERROR;
-      continue;
-    }
+  now = amqp_get_monotonic_timestamp();
+  if (0 == now) {
+    last_error = AMQP_STATUS_TIMER_FAILURE;
+    goto out;
+  }
+  if (timeout) {
+    deadline = now + (uint64_t)timeout->tv_sec * AMQP_NS_PER_S +
+               (uint64_t)timeout->tv_usec * AMQP_NS_PER_US;
+  }
 
-#ifdef SO_NOSIGPIPE
-    if (0 != amqp_os_socket_setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one))) {
-      last_error = AMQP_STATUS_SOCKET_ERROR;
-      continue;
-    }
-#endif /* SO_NOSIGPIPE */
+  while (1) {
+    int timeout_ms = -1;
+    int res;
 
-    if (0 != amqp_os_socket_setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
-      last_error = AMQP_STATUS_SOCKET_ERROR;
-      continue;
+    now = amqp_get_monotonic_timestamp();
+    if (0 == now) {
+      last_error = AMQP_STATUS_TIMER_FAILURE;
+      break;
     }
 
-    if (timeout) {
-      /* Trying to connect with timeout, set socket to non-blocking mode */
-      if (AMQP_STATUS_OK != amqp_os_socket_setsockblock(sockfd, 0)) {
-        last_error = AMQP_STATUS_SOCKET_ERROR;
+    if (next < count && (0 == npending || now >= next_attempt)) {
+      amqp_boolean_t connected;
+
+      res = amqp_start_connect(ordered[next++], &connected);
+      if (res < 0) {
+        /* Failed outright, move on to the next address right away */
+        last_error = res;
+        next_attempt = now;
         continue;
       }
+      if (connected) {
+        sockfd = res;
+        break;
+      }
 
-      res = connect(sockfd, addr->ai_addr, addr->ai_addrlen);
+      pending[npending].fd = res;
+      /* Win32 requires POLLERR to be passed to detect connection failure.
+       * Other platforms only need POLLOUT, passing POLLERR seems to be
+       * harmless otherwise */
+      pending[npending].events = POLLERR | POLLOUT;
+      pending[npending].revents = 0;
+      ++npending;
+      next_attempt = now + (uint64_t)AMQP_CONNECT_ATTEMPT_DELAY_MS * AMQP_NS_PER_MS;
+    }
 
-      if (0 == res) {
-        /* Connected immediately, set to blocking mode again */
-        if (AMQP_STATUS_OK != amqp_os_socket_setsockblock(sockfd, 1)) {
-          last_error = AMQP_STATUS_SOCKET_ERROR;
-          continue;
-        }
+    if (0 == npending) {
+      /* Every address has been tried and failed */
+      break;
+    }
 
-        last_error = AMQP_STATUS_OK;
+    if (next < count) {
+      timeout_ms = next_attempt > now
+                   ? (int)((next_attempt - now + AMQP_NS_PER_MS - 1) / AMQP_NS_PER_MS)
+                   : 0;
+    }
+    if (timeout) {
+      int remaining_ms;
+
+      if (now >= deadline) {
+        last_error = AMQP_STATUS_TIMEOUT;
         break;
       }
+      remaining_ms = (int)((deadline - now + AMQP_NS_PER_MS - 1) / AMQP_NS_PER_MS);
+      if (-1 == timeout_ms || remaining_ms < timeout_ms) {
+        timeout_ms = remaining_ms;
+      }
+    }
 
-#ifdef _WIN32
-      if (WSAEWOULDBLOCK == amqp_os_socket_error()) {
-#else
-      if (EINPROGRESS == amqp_os_socket_error()) {
-#endif
-
-        while(1) {
-          struct pollfd pfd;
-          int timeout_ms;
+    res = poll(pending, npending, timeout_ms);
+    if (res < 0) {
+      if (EINTR == amqp_os_socket_error()) {
+        continue;
+      }
+      last_error = AMQP_STATUS_SOCKET_ERROR;
+      break;
+    }
 
-          pfd.fd = sockfd;
-          pfd.events = POLLERR | POLLOUT;
-          pfd.revents = 0;
+    for (i = 0; i < npending && res > 0;) {
+      int result;
+      socklen_t result_len = sizeof(result);
 
-          timer_error = amqp_timer_update(&timer, timeout);
+      if (0 == pending[i].revents) {
+        ++i;
+        continue;
+      }
+      --res;
 
-          if (timer_error < 0) {
-            last_error = timer_error;
-            break;
-          }
+      if (0 == getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, (void *)&result,
+                          &result_len) && 0 == result) {
+        sockfd = pending[i].fd;
+        pending[i] = pending[--npending];
+        goto out;
+      }
 
-          timeout_ms = timer.tv.tv_sec * AMQP_MS_PER_S +
-              timer.tv.tv_usec / AMQP_US_PER_MS;
-          /* Win32 requires except_fds to be passed to detect connection
-           * failure. Other platforms only need write_fds, passing except_fds
-           * seems to be harmless otherwise
-           */
-          res = poll(&pfd, 1, timeout_ms);
-
-          if (res > 0) {
-            int result;
-            socklen_t result_len = sizeof(result);
-
-            if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &result, &result_len) < 0) {
-              last_error = AMQP_STATUS_SOCKET_ERROR;
-              break;
-            }
+      /* This attempt failed, start the next one without waiting */
+      amqp_os_socket_close(pending[i].fd);
+      pending[i] = pending[--npending];
+      last_error = AMQP_STATUS_SOCKET_ERROR;
+      next_attempt = now;
+    }
+  }
 
-            if (result != 0) {
-              last_error = AMQP_STATUS_SOCKET_ERROR;
-              break;
-            }
+out:
+  for (i = 0; i < npending; ++i) {
+    amqp_os_socket_close(pending[i].fd);
+  }
+  free(pending);
+  free(ordered);
 
-            /* socket is ready to be written to, set to blocking mode again */
-            if (AMQP_STATUS_OK != amqp_os_socket_setsockblock(sockfd, 1)) {
-              last_error = AMQP_STATUS_SOCKET_ERROR;
-              continue;
-            }
+  if (-1 == sockfd) {
+    return last_error;
+  }
 
-            last_error = AMQP_STATUS_OK;
-            break;
-          } else if (0 == res) {
-            /* Timed out - return */
-            last_error = AMQP_STATUS_TIMEOUT;
-            break;
-          } else if (errno == EINTR) {
-            /* Try again */
-            continue;
-          } else {
-            /* Error connecting */
-            last_error = AMQP_STATUS_SOCKET_ERROR;
-            break;
-          }
-        } /* end while(1) loop */
+  /* Connection established, set the socket to blocking mode again */
+  if (AMQP_STATUS_OK != amqp_os_socket_setsockblock(sockfd, 1)) {
+    amqp_os_socket_close(sockfd);
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
 
-        if (last_error == AMQP_STATUS_OK
-            || last_error == AMQP_STATUS_TIMEOUT
-            || last_error == AMQP_STATUS_TIMER_FAILURE) {
-          /* Exit for loop on timer errors or when connection established */
-          break;
-        }
+  return sockfd;
+}
 
-      } else {
-        /* Error connecting */
-        last_error = AMQP_STATUS_SOCKET_ERROR;
-        break;
+int amqp_open_socket_noblock(char const *hostname,
+                     int portnumber,
+                     struct timeval *timeout)
+{
+  struct addrinfo *address_list;
+  struct timeval remaining;
+  uint64_t start = 0;
+  int last_error = AMQP_STATUS_OK;
 
-      }
+  if (timeout && (timeout->tv_sec < 0 || timeout->tv_usec < 0 ||
+      INT_MAX < ((uint64_t)timeout->tv_sec * AMQP_MS_PER_S +
+      (uint64_t)timeout->tv_usec / AMQP_US_PER_MS))) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
 
-    } else {
-      /* Connect in blocking mode */
-      if (0 != connect(sockfd, addr->ai_addr, addr->ai_addrlen)) {
-        last_error = AMQP_STATUS_SOCKET_ERROR;
-        continue;
-      } else {
-        last_error = AMQP_STATUS_OK;
-        break;
-      }
-    }
+  last_error = amqp_os_socket_init();
+  if (AMQP_STATUS_OK != last_error) {
+    return last_error;
   }
 
-  freeaddrinfo(address_list);
-  if (last_error != AMQP_STATUS_OK) {
-    if (-1 != sockfd) {
-      amqp_os_socket_close(sockfd);
+  if (timeout) {
+    start = amqp_get_monotonic_timestamp();
+    if (0 == start) {
+      return AMQP_STATUS_TIMER_FAILURE;
     }
+  }
 
+  last_error = amqp_resolve(hostname, portnumber, timeout, &address_list);
+  if (AMQP_STATUS_OK != last_error) {
     return last_error;
   }
 
-  return sockfd;
+  if (timeout) {
+    /* The lookup counts against the timeout */
+    uint64_t total = (uint64_t)timeout->tv_sec * AMQP_NS_PER_S +
+                     (uint64_t)timeout->tv_usec * AMQP_NS_PER_US;
+    uint64_t elapsed = amqp_get_monotonic_timestamp() - start;
+
+    if (elapsed >= total) {
+      amqp_resolver_free(address_list);
+      return AMQP_STATUS_TIMEOUT;
+    }
+    total -= elapsed;
+    remaining.tv_sec = (long)(total / AMQP_NS_PER_S);
+    remaining.tv_usec = (long)((total % AMQP_NS_PER_S) / AMQP_NS_PER_US);
+    timeout = &remaining;
+  }
+
+  last_error = amqp_connect_addrinfo(address_list, timeout);
+  amqp_resolver_free(address_list);
+
+  return last_error;
 }
 
 int amqp_send_header(amqp_connection_state_t state)
@@ -537,6 +693,17 @@ static int consume_one_frame(amqp_connection_state_t state, amqp_frame_t *decode
   buffer.len = state->sock_inbound_limit - state->sock_inbound_offset;
   buffer.bytes = ((char *) state->sock_inbound_buffer.bytes) + state->sock_inbound_offset;
 
+  if (CONNECTION_STATE_IDLE == state->state && buffer.len < HEADER_SIZE) {
+    /* Only part of the next frame header is here. Keep it at the front of the
+     * buffer and have the next read append to it rather than staging it in
+     * header_buffer */
+    memmove(state->sock_inbound_buffer.bytes, buffer.bytes, buffer.len);
+    state->sock_inbound_tail = buffer.len;
+    state->sock_inbound_offset = state->sock_inbound_limit;
+    decoded_frame->frame_type = 0;
+    return AMQP_STATUS_OK;
+  }
+
   res = amqp_handle_input(state, buffer, decoded_frame);
   if (res < 0) {
     return res;
@@ -544,13 +711,68 @@ static int consume_one_frame(amqp_connection_state_t state, amqp_frame_t *decode
 
   state->sock_inbound_offset += res;
 
+  if (AMQP_FRAME_METHOD == decoded_frame->frame_type &&
+      amqp_handle_blocked_method(state, decoded_frame->channel,
+                                 &decoded_frame->payload.method)) {
+    /* Consumed here, like a heartbeat */
+    amqp_maybe_release_buffers_on_channel(state, 0);
+    decoded_frame->frame_type = 0;
+  }
+
   return AMQP_STATUS_OK;
 }
 
 
+/*
+ * Size the socket read buffer to the traffic seen so far: a read that fills
+ * the buffer suggests more data was waiting, a read that barely uses it means
+ * the memory is wasted. Resizing is best effort, except for the first
+ * allocation.
+ */
+static int adapt_sock_inbound_buffer(amqp_connection_state_t state)
+{
+  size_t len = state->sock_inbound_buffer.len;
+  size_t new_len = len;
+  size_t min_len;
+  size_t max_len;
+  int grow_after;
+
+  if (NULL == state->sock_inbound_buffer.bytes) {
+    return amqp_resize_sock_inbound_buffer(state, state->low_memory ?
+                                           AMQP_LOW_MEMORY_BUFFER_SIZE :
+                                           AMQP_INITIAL_INBOUND_SOCK_BUFFER_SIZE);
+  }
+
+  if (state->low_memory) {
+    min_len = AMQP_LOW_MEMORY_BUFFER_SIZE;
+    max_len = state->frame_max;
+    grow_after = 1;
+  } else {
+    min_len = AMQP_MIN_INBOUND_SOCK_BUFFER_SIZE;
+    max_len = AMQP_MAX_INBOUND_SOCK_BUFFER_SIZE;
+    grow_after = AMQP_INBOUND_GROW_AFTER_FULL_READS;
+  }
+
+  if (state->sock_inbound_full_reads >= grow_after && len < max_len) {
+    new_len = (len * 2 > max_len) ? max_len : len * 2;
+  } else if (state->sock_inbound_sparse_reads >=
+             AMQP_INBOUND_SHRINK_AFTER_SPARSE_READS && len > min_len) {
+    new_len = (len / 2 < min_len) ? min_len : len / 2;
+  }
+
+  if (new_len != len) {
+    state->sock_inbound_full_reads = 0;
+    state->sock_inbound_sparse_reads = 0;
+    (void)amqp_resize_sock_inbound_buffer(state, new_len);
+  }
+
+  return AMQP_STATUS_OK;
+}
+
 static int recv_with_timeout(amqp_connection_state_t state, uint64_t start, struct timeval *timeout)
 {
   int res;
+  size_t tail;
 
   if (timeout) {
     int fd;
@@ -587,7 +809,7 @@ static int recv_with_timeout(amqp_connection_state_t state, uint64_t start, stru
           if (timeout) {
             uint64_t end_timestamp;
             uint64_t time_left;
-            uint64_t current_timestamp = amqp_get_monotonic_timestamp();
+            uint64_t current_timestamp = amqp_clock_refresh(&state->clock);
             if (0 == current_timestamp) {
               return AMQP_STATUS_TIMER_FAILURE;
             }
@@ -610,18 +832,43 @@ static int recv_with_timeout(amqp_connection_state_t state, uint64_t start, stru
     }
   }
 
-  res = amqp_socket_recv(state->socket, state->sock_inbound_buffer.bytes,
-                         state->sock_inbound_buffer.len, 0);
+  res = adapt_sock_inbound_buffer(state);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  tail = state->sock_inbound_tail;
+  res = amqp_socket_recv(state->socket,
+                         (char *)state->sock_inbound_buffer.bytes + tail,
+                         state->sock_inbound_buffer.len - tail, 0);
 
   if (res < 0) {
     return res;
   }
 
-  state->sock_inbound_limit = res;
+  if ((size_t)res == state->sock_inbound_buffer.len - tail) {
+    state->sock_inbound_full_reads++;
+    state->sock_inbound_sparse_reads = 0;
+  } else if ((size_t)res < state->sock_inbound_buffer.len / 8) {
+    state->sock_inbound_sparse_reads++;
+    state->sock_inbound_full_reads = 0;
+  } else {
+    state->sock_inbound_full_reads = 0;
+    state->sock_inbound_sparse_reads = 0;
+  }
+
+  state->sock_inbound_limit = tail + res;
   state->sock_inbound_offset = 0;
+  state->sock_inbound_tail = 0;
 
   if (amqp_heartbeat_enabled(state)) {
-    uint64_t current_time = amqp_get_monotonic_timestamp();
+    uint64_t current_time;
+    /* A cached timestamp is fine unless we may have blocked in poll() */
+    if (timeout && (timeout->tv_sec || timeout->tv_usec)) {
+      current_time = amqp_clock_refresh(&state->clock);
+    } else {
+      current_time = amqp_clock_now(&state->clock);
+    }
     if (0 == current_time) {
       return AMQP_STATUS_TIMER_FAILURE;
     }
@@ -631,10 +878,8 @@ static int recv_with_timeout(amqp_connection_state_t state, uint64_t start, stru
   return AMQP_STATUS_OK;
 }
 
-int amqp_try_recv(amqp_connection_state_t state, uint64_t current_time)
+static int queue_buffered_frames(amqp_connection_state_t state)
 {
-  struct timeval tv;
-
   while (amqp_data_in_buffer(state)) {
     amqp_frame_t frame;
     int res = consume_one_frame(state, &frame);
@@ -673,6 +918,18 @@ int amqp_try_recv(amqp_connection_state_t state, uint64_t current_time)
       state->last_queued_frame = link;
     }
   }
+  return AMQP_STATUS_OK;
+}
+
+int amqp_try_recv(amqp_connection_state_t state, uint64_t current_time)
+{
+  struct timeval tv;
+  int res;
+
+  res = queue_buffered_frames(state);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
 
   memset(&tv, 0, sizeof(struct timeval));
   tv.tv_sec = 0;
@@ -681,9 +938,45 @@ int amqp_try_recv(amqp_connection_state_t state, uint64_t current_time)
   return recv_with_timeout(state, current_time, &tv);
 }
 
-static int wait_frame_inner(amqp_connection_state_t state,
+int amqp_poll_frames(amqp_connection_state_t state)
+{
+  struct timeval tv;
+  uint64_t current_time;
+  int res;
+
+  res = queue_buffered_frames(state);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  current_time = amqp_clock_now(&state->clock);
+  if (0 == current_time) {
+    return AMQP_STATUS_TIMER_FAILURE;
+  }
+  if (current_time < state->next_blocked_poll) {
+    /* keep the recv syscall off most publishes */
+    return AMQP_STATUS_OK;
+  }
+  state->next_blocked_poll = current_time + AMQP_BLOCKED_POLL_INTERVAL;
+
+  memset(&tv, 0, sizeof(struct timeval));
+  res = recv_with_timeout(state, current_time, &tv);
+  if (AMQP_STATUS_TIMEOUT == res) {
+    /* nothing arrived */
+    return AMQP_STATUS_OK;
+  } else if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  return queue_buffered_frames(state);
+}
+
+/* Returns the next frame, or with until_unblocked set a frame with type 0
+ * once the connection is no longer blocked */
+static int wait_frame_until(amqp_connection_state_t state,
                             amqp_frame_t *decoded_frame,
-                            struct timeval *timeout)
+                            struct timeval *timeout,
+                            amqp_boolean_t until_unblocked)
 {
   uint64_t current_timestamp = 0;
   uint64_t timeout_timestamp = 0;
@@ -707,6 +1000,10 @@ static int wait_frame_inner(amqp_connection_state_t state,
 
       if (AMQP_FRAME_HEARTBEAT == decoded_frame->frame_type) {
         amqp_maybe_release_buffers_on_channel(state, 0);
+        if (!amqp_data_in_buffer(state)) {
+          /* nothing but heartbeats: the connection is idle */
+          amqp_shrink_buffers(state);
+        }
         continue;
       }
 
@@ -716,11 +1013,16 @@ static int wait_frame_inner(amqp_connection_state_t state,
       }
     }
 
+    if (until_unblocked && !state->blocked) {
+      decoded_frame->frame_type = 0;
+      return AMQP_STATUS_OK;
+    }
+
 beginrecv:
     if (timeout || amqp_heartbeat_enabled(state)) {
       uint64_t ns_until_next_timeout;
 
-      current_timestamp = amqp_get_monotonic_timestamp();
+      current_timestamp = amqp_clock_refresh(&state->clock);
       if (0 == current_timestamp) {
         return AMQP_STATUS_TIMER_FAILURE;
       }
@@ -735,7 +1037,7 @@ beginrecv:
           return res;
         }
 
-        current_timestamp = amqp_get_monotonic_timestamp();
+        current_timestamp = amqp_clock_refresh(&state->clock);
         if (0 == current_timestamp) {
           return AMQP_STATUS_TIMER_FAILURE;
         }
@@ -800,6 +1102,13 @@ beginrecv:
   }
 }
 
+static int wait_frame_inner(amqp_connection_state_t state,
+                            amqp_frame_t *decoded_frame,
+                            struct timeval *timeout)
+{
+  return wait_frame_until(state, decoded_frame, timeout, 0);
+}
+
 static amqp_link_t * amqp_create_link_for_frame(amqp_connection_state_t state, amqp_frame_t *frame)
 {
   amqp_link_t *link;
@@ -903,6 +1212,72 @@ int amqp_simple_wait_frame_on_channel(amqp_connection_state_t state,
   }
 }
 
+static amqp_boolean_t is_connection_close(amqp_frame_t const *frame)
+{
+  return AMQP_FRAME_METHOD == frame->frame_type &&
+         AMQP_CONNECTION_CLOSE_METHOD == frame->payload.method.id;
+}
+
+int amqp_wait_frame_on_channel(amqp_connection_state_t state,
+                               amqp_channel_t channel,
+                               amqp_frame_t *decoded_frame,
+                               struct timeval *timeout)
+{
+  amqp_link_t *prev = NULL;
+  amqp_link_t *cur;
+  amqp_timer_t timer;
+  int res;
+
+  for (cur = state->first_queued_frame; NULL != cur;
+       prev = cur, cur = cur->next) {
+    amqp_frame_t *frame_ptr = cur->data;
+
+    if (channel == frame_ptr->channel || is_connection_close(frame_ptr)) {
+      if (NULL == prev) {
+        state->first_queued_frame = cur->next;
+      } else {
+        prev->next = cur->next;
+      }
+      if (state->last_queued_frame == cur) {
+        state->last_queued_frame = prev;
+      }
+
+      *decoded_frame = *frame_ptr;
+      return AMQP_STATUS_OK;
+    }
+  }
+
+  AMQP_INIT_TIMER(timer)
+
+  while (1) {
+    struct timeval *tvp = NULL;
+
+    if (timeout) {
+      res = amqp_timer_update(&timer, timeout);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+      tvp = &timer.tv;
+    }
+
+    res = wait_frame_inner(state, decoded_frame, tvp);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    if (channel == decoded_frame->channel ||
+        is_connection_close(decoded_frame)) {
+      return AMQP_STATUS_OK;
+    }
+
+    /* Leave it for whoever is waiting for it */
+    res = amqp_queue_frame(state, decoded_frame);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+}
+
 int amqp_simple_wait_frame(amqp_connection_state_t state,
                            amqp_frame_t *decoded_frame)
 {
@@ -926,6 +1301,43 @@ int amqp_simple_wait_frame_noblock(amqp_connection_state_t state,
   }
 }
 
+int amqp_wait_unblocked(amqp_connection_state_t state,
+                        struct timeval *timeout)
+{
+  amqp_timer_t timer;
+  amqp_frame_t frame;
+  int res;
+
+  AMQP_INIT_TIMER(timer)
+
+  while (state->blocked) {
+    struct timeval *tvp = NULL;
+
+    if (timeout) {
+      res = amqp_timer_update(&timer, timeout);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+      tvp = &timer.tv;
+    }
+
+    res = wait_frame_until(state, &frame, tvp, 1);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    if (0 != frame.frame_type) {
+      /* Leave it for whoever is waiting for it */
+      res = amqp_queue_frame(state, &frame);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+  }
+
+  return amqp_send_parked_publishes(state);
+}
+
 int amqp_simple_wait_method(amqp_connection_state_t state,
                             amqp_channel_t expected_channel,
                             amqp_method_number_t expected_method,
@@ -972,95 +1384,157 @@ static int amqp_id_in_reply_list( amqp_method_number_t expected, amqp_method_num
   return 0;
 }
 
-amqp_rpc_reply_t amqp_simple_rpc(amqp_connection_state_t state,
-                                 amqp_channel_t channel,
-                                 amqp_method_number_t request_id,
-                                 amqp_method_number_t *expected_reply_ids,
-                                 void *decoded_request_method)
+/*
+ * Is frame the reply an RPC on channel waits for? That is a method frame
+ * that is either
+ *  - on the channel we want, and of the expected type, or
+ *  - on the channel we want, and a channel.close frame, or
+ *  - on channel zero, and a connection.close frame.
+ */
+static amqp_boolean_t is_rpc_reply(amqp_frame_t *frame,
+                                   amqp_channel_t channel,
+                                   amqp_method_number_t *expected_reply_ids)
+{
+  return (frame->frame_type == AMQP_FRAME_METHOD)
+         && (
+           ((frame->channel == channel)
+            && (amqp_id_in_reply_list(frame->payload.method.id, expected_reply_ids)
+                || (frame->payload.method.id == AMQP_CHANNEL_CLOSE_METHOD)))
+           ||
+           ((frame->channel == 0)
+            && (frame->payload.method.id == AMQP_CONNECTION_CLOSE_METHOD))
+         );
+}
+
+static amqp_rpc_reply_t wait_rpc_reply(amqp_connection_state_t state,
+                                       amqp_channel_t channel,
+                                       amqp_method_number_t *expected_reply_ids)
 {
   int status;
   amqp_rpc_reply_t result;
+  amqp_frame_t frame;
 
   memset(&result, 0, sizeof(result));
 
-  status = amqp_send_method(state, channel, request_id, decoded_request_method);
+retry:
+  status = wait_frame_inner(state, &frame, NULL);
   if (status < 0) {
     result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
     result.library_error = status;
     return result;
   }
 
-  {
-    amqp_frame_t frame;
+  /*
+   * We store the frame for later processing unless it's something
+   * that directly affects us here.
+   */
+  if (!is_rpc_reply(&frame, channel, expected_reply_ids)) {
+    amqp_pool_t *channel_pool;
+    amqp_frame_t *frame_copy;
+    amqp_link_t *link;
 
-retry:
-    status = wait_frame_inner(state, &frame, NULL);
-    if (status < 0) {
+    channel_pool = amqp_get_or_create_channel_pool(state, frame.channel);
+    if (NULL == channel_pool) {
       result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-      result.library_error = status;
+      result.library_error = AMQP_STATUS_NO_MEMORY;
       return result;
     }
 
-    /*
-     * We store the frame for later processing unless it's something
-     * that directly affects us here, namely a method frame that is
-     * either
-     *  - on the channel we want, and of the expected type, or
-     *  - on the channel we want, and a channel.close frame, or
-     *  - on channel zero, and a connection.close frame.
-     */
-    if (!((frame.frame_type == AMQP_FRAME_METHOD)
-          && (
-            ((frame.channel == channel)
-             && (amqp_id_in_reply_list(frame.payload.method.id, expected_reply_ids)
-                 || (frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD)))
-            ||
-            ((frame.channel == 0)
-             && (frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD))
-          )
-         )) {
-      amqp_pool_t *channel_pool;
-      amqp_frame_t *frame_copy;
-      amqp_link_t *link;
+    frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
+    link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
 
-      channel_pool = amqp_get_or_create_channel_pool(state, frame.channel);
-      if (NULL == channel_pool) {
-        result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-        result.library_error = AMQP_STATUS_NO_MEMORY;
-        return result;
-      }
+    if (frame_copy == NULL || link == NULL) {
+      result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      result.library_error = AMQP_STATUS_NO_MEMORY;
+      return result;
+    }
 
-      frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
-      link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
+    *frame_copy = frame;
 
-      if (frame_copy == NULL || link == NULL) {
-        result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-        result.library_error = AMQP_STATUS_NO_MEMORY;
-        return result;
-      }
+    link->next = NULL;
+    link->data = frame_copy;
 
-      *frame_copy = frame;
+    if (state->last_queued_frame == NULL) {
+      state->first_queued_frame = link;
+    } else {
+      state->last_queued_frame->next = link;
+    }
+    state->last_queued_frame = link;
 
-      link->next = NULL;
-      link->data = frame_copy;
+    goto retry;
+  }
 
-      if (state->last_queued_frame == NULL) {
-        state->first_queued_frame = link;
-      } else {
-        state->last_queued_frame->next = link;
-      }
-      state->last_queued_frame = link;
+  result.reply_type = (amqp_id_in_reply_list(frame.payload.method.id, expected_reply_ids))
+                      ? AMQP_RESPONSE_NORMAL
+                      : AMQP_RESPONSE_SERVER_EXCEPTION;
+
+  result.reply = frame.payload.method;
+  return result;
+}
+
+amqp_rpc_reply_t amqp_simple_rpc_wait_reply(amqp_connection_state_t state,
+                                            amqp_channel_t channel,
+                                            amqp_method_number_t *expected_reply_ids)
+{
+  amqp_link_t *prev = NULL;
+  amqp_link_t *cur;
 
-      goto retry;
+  /* With several requests in flight the reply may already have been queued
+   * while waiting for the reply to another one */
+  for (cur = state->first_queued_frame; NULL != cur; prev = cur, cur = cur->next) {
+    amqp_frame_t *frame = cur->data;
+    amqp_rpc_reply_t result;
+
+    if (!is_rpc_reply(frame, channel, expected_reply_ids)) {
+      continue;
+    }
+
+    if (prev) {
+      prev->next = cur->next;
+    } else {
+      state->first_queued_frame = cur->next;
+    }
+    if (state->last_queued_frame == cur) {
+      state->last_queued_frame = prev;
     }
 
-    result.reply_type = (amqp_id_in_reply_list(frame.payload.method.id, expected_reply_ids))
+    memset(&result, 0, sizeof(result));
+    result.reply_type = (amqp_id_in_reply_list(frame->payload.method.id, expected_reply_ids))
                         ? AMQP_RESPONSE_NORMAL
                         : AMQP_RESPONSE_SERVER_EXCEPTION;
+    result.reply = frame->payload.method;
+    return result;
+  }
+
+  return wait_rpc_reply(state, channel, expected_reply_ids);
+}
+
+amqp_rpc_reply_t amqp_simple_rpc(amqp_connection_state_t state,
+                                 amqp_channel_t channel,
+                                 amqp_method_number_t request_id,
+                                 amqp_method_number_t *expected_reply_ids,
+                                 void *decoded_request_method)
+{
+  int status;
+  amqp_rpc_reply_t result;
 
-    result.reply = frame.payload.method;
+  memset(&result, 0, sizeof(result));
+
+  status = amqp_send_method(state, channel, request_id, decoded_request_method);
+  if (status < 0) {
+    result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    result.library_error = status;
     return result;
   }
+
+  result = wait_rpc_reply(state, channel, expected_reply_ids);
+
+  if (state->recovery) {
+    amqp_recovery_record(state->recovery, channel, request_id,
+                         decoded_request_method, &result);
+  }
+
+  return result;
 }
 
 void *amqp_simple_rpc_decoded(amqp_connection_state_t state,
@@ -1110,6 +1584,56 @@ static int amqp_table_contains_entry(const amqp_table_t *table,
   return 0;
 }
 
+/* The client properties we always send, in the order they are sent */
+enum {
+  DEFAULT_PROP_PRODUCT,
+  DEFAULT_PROP_VERSION,
+  DEFAULT_PROP_PLATFORM,
+  DEFAULT_PROP_COPYRIGHT,
+  DEFAULT_PROP_INFORMATION,
+  DEFAULT_PROP_CAPABILITIES,
+  DEFAULT_PROP_COUNT
+};
+
+/* Merges the caller's capabilities table with ours, the caller's entries
+ * win. A capabilities value that isn't a table is passed on as is. */
+static int merge_capabilities(amqp_pool_t *pool,
+                              const amqp_field_value_t *provided,
+                              const amqp_table_t *defaults,
+                              amqp_field_value_t *merged)
+{
+  const amqp_table_t *table;
+  amqp_table_entry_t *entries;
+  int i;
+  int num_entries;
+
+  if (AMQP_FIELD_KIND_TABLE != provided->kind) {
+    *merged = *provided;
+    return AMQP_STATUS_OK;
+  }
+  table = &provided->value.table;
+
+  entries = amqp_pool_alloc(pool, sizeof(amqp_table_entry_t) *
+                                  (table->num_entries + defaults->num_entries));
+  if (NULL == entries) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  memcpy(entries, table->entries,
+         sizeof(amqp_table_entry_t) * table->num_entries);
+  num_entries = table->num_entries;
+  for (i = 0; i < defaults->num_entries; ++i) {
+    if (!amqp_table_contains_entry(table, &defaults->entries[i])) {
+      entries[num_entries++] = defaults->entries[i];
+    }
+  }
+
+  merged->kind = AMQP_FIELD_KIND_TABLE;
+  merged->value.table.entries = entries;
+  merged->value.table.num_entries = num_entries;
+  return AMQP_STATUS_OK;
+}
+
 static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
     char const *vhost,
     int channel_max,
@@ -1158,7 +1682,8 @@ static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
   }
 
   {
-    amqp_table_entry_t default_properties[5];
+    amqp_table_entry_t default_properties[DEFAULT_PROP_COUNT];
+    amqp_table_entry_t default_capabilities[1];
     amqp_table_t default_table;
     amqp_connection_start_ok_t s;
     amqp_pool_t *channel_pool;
@@ -1177,34 +1702,45 @@ static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
       goto error_res;
     }
 
-    default_properties[0].key = amqp_cstring_bytes("product");
-    default_properties[0].value.kind = AMQP_FIELD_KIND_UTF8;
-    default_properties[0].value.value.bytes =
+    default_properties[DEFAULT_PROP_PRODUCT].key = amqp_cstring_bytes("product");
+    default_properties[DEFAULT_PROP_PRODUCT].value.kind = AMQP_FIELD_KIND_UTF8;
+    default_properties[DEFAULT_PROP_PRODUCT].value.value.bytes =
       amqp_cstring_bytes("rabbitmq-c");
 
     /* version */
-    default_properties[1].key = amqp_cstring_bytes("version");
-    default_properties[1].value.kind = AMQP_FIELD_KIND_UTF8;
-    default_properties[1].value.value.bytes =
+    default_properties[DEFAULT_PROP_VERSION].key = amqp_cstring_bytes("version");
+    default_properties[DEFAULT_PROP_VERSION].value.kind = AMQP_FIELD_KIND_UTF8;
+    default_properties[DEFAULT_PROP_VERSION].value.value.bytes =
         amqp_cstring_bytes(AMQP_VERSION_STRING);
 
     /* platform */
-    default_properties[2].key = amqp_cstring_bytes("platform");
-    default_properties[2].value.kind = AMQP_FIELD_KIND_UTF8;
-    default_properties[2].value.value.bytes =
+    default_properties[DEFAULT_PROP_PLATFORM].key = amqp_cstring_bytes("platform");
+    default_properties[DEFAULT_PROP_PLATFORM].value.kind = AMQP_FIELD_KIND_UTF8;
+    default_properties[DEFAULT_PROP_PLATFORM].value.value.bytes =
         amqp_cstring_bytes(AMQ_PLATFORM);
 
     /* copyright */
-    default_properties[3].key = amqp_cstring_bytes("copyright");
-    default_properties[3].value.kind = AMQP_FIELD_KIND_UTF8;
-    default_properties[3].value.value.bytes =
+    default_properties[DEFAULT_PROP_COPYRIGHT].key = amqp_cstring_bytes("copyright");
+    default_properties[DEFAULT_PROP_COPYRIGHT].value.kind = AMQP_FIELD_KIND_UTF8;
+    default_properties[DEFAULT_PROP_COPYRIGHT].value.value.bytes =
         amqp_cstring_bytes(AMQ_COPYRIGHT);
 
-    default_properties[4].key = amqp_cstring_bytes("information");
-    default_properties[4].value.kind = AMQP_FIELD_KIND_UTF8;
-    default_properties[4].value.value.bytes =
+    default_properties[DEFAULT_PROP_INFORMATION].key = amqp_cstring_bytes("information");
+    default_properties[DEFAULT_PROP_INFORMATION].value.kind = AMQP_FIELD_KIND_UTF8;
+    default_properties[DEFAULT_PROP_INFORMATION].value.value.bytes =
       amqp_cstring_bytes("See https://github.com/alanxz/rabbitmq-c");
 
+    /* capabilities: extensions the broker may use on this connection */
+    default_capabilities[0].key = amqp_cstring_bytes("connection.blocked");
+    default_capabilities[0].value.kind = AMQP_FIELD_KIND_BOOLEAN;
+    default_capabilities[0].value.value.boolean = 1;
+
+    default_properties[DEFAULT_PROP_CAPABILITIES].key = amqp_cstring_bytes("capabilities");
+    default_properties[DEFAULT_PROP_CAPABILITIES].value.kind = AMQP_FIELD_KIND_TABLE;
+    default_properties[DEFAULT_PROP_CAPABILITIES].value.value.table.entries = default_capabilities;
+    default_properties[DEFAULT_PROP_CAPABILITIES].value.value.table.num_entries =
+      sizeof(default_capabilities) / sizeof(amqp_table_entry_t);
+
     default_table.entries = default_properties;
     default_table.num_entries = sizeof(default_properties) / sizeof(amqp_table_entry_t);
 
@@ -1215,13 +1751,11 @@ static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
        * - Copy default properties.
        * - Any provided property that doesn't have the same key as a default
        *   property is also copied.
-       *
-       * TODO: if one of the default properties is a capabilities table, we will
-       * need to figure out how to merge this if the user provides a capabilites
-       * table
+       * - A provided capabilities table is merged with the default one.
        */
       int i;
       amqp_table_entry_t *current_entry;
+      amqp_table_entry_t *capabilities_entry;
 
       s.client_properties.entries = amqp_pool_alloc(channel_pool,
                                     sizeof(amqp_table_entry_t) * (default_table.num_entries + client_properties->num_entries));
@@ -1232,6 +1766,8 @@ static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
       s.client_properties.num_entries = 0;
 
       current_entry = s.client_properties.entries;
+      capabilities_entry =
+        &s.client_properties.entries[DEFAULT_PROP_CAPABILITIES];
 
       for (i = 0; i < default_table.num_entries; ++i) {
         memcpy(current_entry, &default_table.entries[i], sizeof(amqp_table_entry_t));
@@ -1240,6 +1776,17 @@ static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
       }
 
       for (i = 0; i < client_properties->num_entries; ++i) {
+        if (0 == amqp_table_entry_cmp(&client_properties->entries[i],
+                                      capabilities_entry)) {
+          res = merge_capabilities(channel_pool,
+                                   &client_properties->entries[i].value,
+                                   &default_table.entries[DEFAULT_PROP_CAPABILITIES].value.value.table,
+                                   &capabilities_entry->value);
+          if (AMQP_STATUS_OK != res) {
+            goto error_res;
+          }
+          continue;
+        }
         if (amqp_table_contains_entry(&default_table, &client_properties->entries[i])) {
           continue;
         }
@@ -33,6 +33,7 @@
 #define AMQP_SOCKET_H
 
 #include "amqp_private.h"
+#include "amqp_timer.h"
 
 AMQP_BEGIN_DECLS
 
@@ -42,6 +43,21 @@ amqp_os_socket_error(void);
 int
 amqp_os_socket_close(int sockfd);
 
+int
+amqp_os_socket_setsockblock(int sock, int block);
+
+/*
+ * Wait for a socket to become readable (or writable if for_write is set).
+ * If timeout is not NULL the wait ends at the deadline tracked by timer,
+ * see amqp_timer_update(), otherwise it waits indefinitely.
+ *
+ * Returns AMQP_STATUS_OK when the socket is ready, AMQP_STATUS_TIMEOUT at the
+ * deadline, or another amqp_status_enum value on failure.
+ */
+int
+amqp_os_socket_wait(int sockfd, amqp_boolean_t for_write,
+                    amqp_timer_t *timer, struct timeval *timeout);
+
 /* Socket callbacks. */
 typedef ssize_t (*amqp_socket_writev_fn)(void *, struct iovec *, int);
 typedef ssize_t (*amqp_socket_send_fn)(void *, const void *, size_t);
@@ -0,0 +1,797 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef ENABLE_THREAD_SAFETY
+# include <pthread.h>
+#endif
+
+/*
+ * A spool is a directory of segment files, each a fixed size file that is
+ * mapped into memory and filled with records from the start. A record is:
+ *
+ *   magic (32 bits), flags (32 bits), length (32 bits), reserved (32 bits)
+ *   mandatory (8 bits), immediate (8 bits), has properties (8 bits)
+ *   exchange (shortstr), routing key (shortstr)
+ *   properties (32 bit length, encoded basic properties)
+ *   body (32 bit length, bytes)
+ *
+ * padded to 8 bytes. The magic is written last, so a record cut short by a
+ * crash ends the segment. Confirmed records are flagged in place and a
+ * segment file is deleted once every record in it is confirmed.
+ */
+#define AMQP_SPOOL_RECORD_MAGIC 0x53504c31 /* "SPL1" */
+#define AMQP_SPOOL_RECORD_ACKED 0x1
+#define AMQP_SPOOL_HEADER_SIZE 16
+#define AMQP_SPOOL_FIXED_SIZE (AMQP_SPOOL_HEADER_SIZE + 3 + 1 + 1 + 4 + 4)
+#define AMQP_SPOOL_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define AMQP_SPOOL_DEFAULT_SEGMENT_SIZE (16 * 1024 * 1024)
+/* Room left for the properties when a segment is sized to fit a big body */
+#define AMQP_SPOOL_PROPERTIES_RESERVE (64 * 1024)
+#define AMQP_SPOOL_SUFFIX ".spool"
+
+typedef struct amqp_spool_segment_t_ {
+  struct amqp_spool_segment_t_ *next;
+  uint64_t id;
+  char *path;
+  unsigned char *data;
+  size_t size;
+  size_t end;                 /* end of the last complete record */
+  size_t unacked;             /* records not confirmed yet */
+} amqp_spool_segment_t;
+
+/* A record published on the draining connection, awaiting its confirm */
+typedef struct amqp_spool_inflight_t_ {
+  uint64_t delivery_tag;
+  amqp_spool_segment_t *segment;
+  size_t offset;
+} amqp_spool_inflight_t;
+
+struct amqp_spool_t_ {
+  char *directory;
+  size_t segment_size;
+  uint64_t next_id;
+  amqp_spool_segment_t *first;
+  amqp_spool_segment_t *last;
+  amqp_spool_segment_t *writing; /* segment appended to, NULL until needed */
+  size_t pending;
+
+  /* Only used by the thread draining the spool */
+  amqp_connection_state_t state;
+  amqp_channel_t channel;
+  uint64_t next_delivery_tag;
+  amqp_spool_segment_t *cursor; /* next record to publish */
+  size_t cursor_offset;
+  amqp_boolean_t rewind;
+  amqp_spool_inflight_t *inflight;
+  size_t inflight_count;
+  size_t inflight_capacity;
+  amqp_pool_t pool;
+
+#ifdef ENABLE_THREAD_SAFETY
+  pthread_mutex_t mutex;
+#endif
+};
+
+static void
+spool_lock(amqp_spool_t *spool)
+{
+#ifdef ENABLE_THREAD_SAFETY
+  pthread_mutex_lock(&spool->mutex);
+#else
+  (void)spool;
+#endif
+}
+
+static void
+spool_unlock(amqp_spool_t *spool)
+{
+#ifdef ENABLE_THREAD_SAFETY
+  pthread_mutex_unlock(&spool->mutex);
+#else
+  (void)spool;
+#endif
+}
+
+static char *
+segment_path(const char *directory, uint64_t id)
+{
+  size_t len = strlen(directory) + 1 + 16 + sizeof(AMQP_SPOOL_SUFFIX);
+  char *path = malloc(len);
+  if (path) {
+    snprintf(path, len, "%s/%016llx" AMQP_SPOOL_SUFFIX, directory,
+             (unsigned long long)id);
+  }
+  return path;
+}
+
+static void
+segment_free(amqp_spool_segment_t *segment)
+{
+  if (segment->data) {
+    munmap(segment->data, segment->size);
+  }
+  free(segment->path);
+  free(segment);
+}
+
+/* Maps the segment file at path, creating it with size bytes if create is
+ * set */
+static int
+segment_map(uint64_t id, char *path, size_t size, amqp_boolean_t create,
+            amqp_spool_segment_t **segment)
+{
+  amqp_spool_segment_t *s;
+  struct stat st;
+  void *data;
+  int fd;
+
+  s = calloc(1, sizeof(amqp_spool_segment_t));
+  if (NULL == s) {
+    free(path);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  s->id = id;
+  s->path = path;
+
+  fd = open(path, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+  if (-1 == fd) {
+    goto error;
+  }
+  if (create) {
+    if (-1 == ftruncate(fd, size)) {
+      close(fd);
+      unlink(path);
+      goto error;
+    }
+  } else {
+    if (-1 == fstat(fd, &st)) {
+      close(fd);
+      goto error;
+    }
+    size = st.st_size;
+  }
+
+  /* An empty file is left if a crash hit before it was sized */
+  data = NULL;
+  if (size) {
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (MAP_FAILED == data) {
+    if (create) {
+      unlink(path);
+    }
+    goto error;
+  }
+
+  s->data = data;
+  s->size = size;
+  *segment = s;
+  return AMQP_STATUS_OK;
+
+error:
+  segment_free(s);
+  return AMQP_STATUS_FILE_ERROR;
+}
+
+/* Finds where the complete records of a segment left by an earlier run end
+ * and counts the unconfirmed ones */
+static void
+segment_scan(amqp_spool_segment_t *segment)
+{
+  size_t offset = 0;
+
+  while (offset + AMQP_SPOOL_HEADER_SIZE <= segment->size &&
+         AMQP_SPOOL_RECORD_MAGIC == amqp_d32(segment->data, offset)) {
+    size_t length = amqp_d32(segment->data, offset + 8);
+    size_t next = AMQP_SPOOL_ALIGN(offset + AMQP_SPOOL_HEADER_SIZE + length);
+
+    if (length > segment->size - offset - AMQP_SPOOL_HEADER_SIZE) {
+      break;
+    }
+    if (!(amqp_d32(segment->data, offset + 4) & AMQP_SPOOL_RECORD_ACKED)) {
+      segment->unacked++;
+    }
+    offset = next < segment->size ? next : segment->size;
+  }
+  segment->end = offset;
+}
+
+static void
+append_segment(amqp_spool_t *spool, amqp_spool_segment_t *segment)
+{
+  if (spool->last) {
+    spool->last->next = segment;
+  } else {
+    spool->first = segment;
+  }
+  spool->last = segment;
+  spool->pending += segment->unacked;
+}
+
+static int
+compare_ids(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Maps the segments an earlier run left in the spool directory, oldest
+ * first. Segments with nothing left to publish are removed. */
+static int
+load_segments(amqp_spool_t *spool)
+{
+  uint64_t *ids = NULL;
+  size_t count = 0, capacity = 0, i;
+  struct dirent *entry;
+  int res = AMQP_STATUS_OK;
+  DIR *dir;
+
+  dir = opendir(spool->directory);
+  if (NULL == dir) {
+    return AMQP_STATUS_FILE_ERROR;
+  }
+
+  while ((entry = readdir(dir))) {
+    unsigned long long id;
+    char suffix[sizeof(AMQP_SPOOL_SUFFIX) + 1];
+
+    if (strlen(entry->d_name) != 16 + sizeof(AMQP_SPOOL_SUFFIX) - 1 ||
+        2 != sscanf(entry->d_name, "%16llx%7s", &id, suffix) ||
+        strcmp(suffix, AMQP_SPOOL_SUFFIX)) {
+      continue;
+    }
+    if (count == capacity) {
+      uint64_t *grown;
+      capacity = capacity ? capacity * 2 : 16;
+      grown = realloc(ids, capacity * sizeof(uint64_t));
+      if (NULL == grown) {
+        res = AMQP_STATUS_NO_MEMORY;
+        goto out;
+      }
+      ids = grown;
+    }
+    ids[count++] = id;
+  }
+
+  if (count > 1) {
+    qsort(ids, count, sizeof(uint64_t), compare_ids);
+  }
+
+  for (i = 0; i < count; i++) {
+    amqp_spool_segment_t *segment;
+    char *path = segment_path(spool->directory, ids[i]);
+
+    if (NULL == path) {
+      res = AMQP_STATUS_NO_MEMORY;
+      goto out;
+    }
+    res = segment_map(ids[i], path, 0, 0, &segment);
+    if (AMQP_STATUS_OK != res) {
+      goto out;
+    }
+    segment_scan(segment);
+    spool->next_id = ids[i] + 1;
+
+    if (0 == segment->unacked) {
+      unlink(segment->path);
+      segment_free(segment);
+      continue;
+    }
+    append_segment(spool, segment);
+  }
+
+out:
+  closedir(dir);
+  free(ids);
+  return res;
+}
+
+int
+amqp_spool_open(char const *directory, size_t segment_size,
+                amqp_spool_t **spool)
+{
+  amqp_spool_t *s;
+  int res;
+
+  if (NULL == directory || NULL == spool) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  s = calloc(1, sizeof(amqp_spool_t));
+  if (NULL == s) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  s->directory = strdup(directory);
+  if (NULL == s->directory) {
+    free(s);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  s->segment_size = segment_size ? segment_size
+                                 : AMQP_SPOOL_DEFAULT_SEGMENT_SIZE;
+  init_amqp_pool(&s->pool, 4096);
+#ifdef ENABLE_THREAD_SAFETY
+  pthread_mutex_init(&s->mutex, NULL);
+#endif
+
+  res = load_segments(s);
+  if (AMQP_STATUS_OK != res) {
+    amqp_spool_close(s);
+    return res;
+  }
+
+  *spool = s;
+  return AMQP_STATUS_OK;
+}
+
+void
+amqp_spool_close(amqp_spool_t *spool)
+{
+  amqp_spool_segment_t *segment;
+
+  if (NULL == spool) {
+    return;
+  }
+
+  segment = spool->first;
+  while (segment) {
+    amqp_spool_segment_t *next = segment->next;
+    segment_free(segment);
+    segment = next;
+  }
+
+  empty_amqp_pool(&spool->pool);
+  free(spool->inflight);
+  free(spool->directory);
+#ifdef ENABLE_THREAD_SAFETY
+  pthread_mutex_destroy(&spool->mutex);
+#endif
+  free(spool);
+}
+
+/* Starts a new segment to append to, at least size bytes long. Records are
+ * never appended to a segment from an earlier run, whatever follows its last
+ * record is unknown. */
+static int
+roll_segment(amqp_spool_t *spool, size_t size)
+{
+  amqp_spool_segment_t *segment;
+  char *path = segment_path(spool->directory, spool->next_id);
+  int res;
+
+  if (NULL == path) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  if (size < spool->segment_size) {
+    size = spool->segment_size;
+  }
+  res = segment_map(spool->next_id, path, size, 1, &segment);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  spool->next_id++;
+  append_segment(spool, segment);
+  spool->writing = segment;
+  return AMQP_STATUS_OK;
+}
+
+/* Writes the record at the end of the segment being appended to, returns
+ * AMQP_STATUS_TABLE_TOO_BIG if it does not fit */
+static int
+write_record(amqp_spool_segment_t *segment, amqp_bytes_t exchange,
+             amqp_bytes_t routing_key, amqp_boolean_t mandatory,
+             amqp_boolean_t immediate,
+             struct amqp_basic_properties_t_ const *properties,
+             amqp_bytes_t body)
+{
+  size_t start = segment->end;
+  size_t fixed = AMQP_SPOOL_FIXED_SIZE + exchange.len + routing_key.len +
+                 body.len;
+  size_t offset = start + AMQP_SPOOL_HEADER_SIZE;
+  int properties_len = 0;
+
+  if (fixed > segment->size - start) {
+    return AMQP_STATUS_TABLE_TOO_BIG;
+  }
+
+  amqp_e8(segment->data, offset++, mandatory ? 1 : 0);
+  amqp_e8(segment->data, offset++, immediate ? 1 : 0);
+  amqp_e8(segment->data, offset++, properties ? 1 : 0);
+  amqp_e8(segment->data, offset++, (uint8_t)exchange.len);
+  memcpy(amqp_offset(segment->data, offset), exchange.bytes, exchange.len);
+  offset += exchange.len;
+  amqp_e8(segment->data, offset++, (uint8_t)routing_key.len);
+  memcpy(amqp_offset(segment->data, offset), routing_key.bytes,
+         routing_key.len);
+  offset += routing_key.len;
+
+  if (properties) {
+    amqp_bytes_t space;
+    space.bytes = amqp_offset(segment->data, offset + 4);
+    space.len = segment->size - start - fixed;
+    properties_len = amqp_encode_properties(AMQP_BASIC_CLASS,
+                                            (void *)properties, space);
+    if (properties_len < 0) {
+      return AMQP_STATUS_BAD_AMQP_DATA == properties_len
+             ? AMQP_STATUS_TABLE_TOO_BIG : properties_len;
+    }
+  }
+  amqp_e32(segment->data, offset, properties_len);
+  offset += 4 + properties_len;
+
+  amqp_e32(segment->data, offset, (uint32_t)body.len);
+  offset += 4;
+  memcpy(amqp_offset(segment->data, offset), body.bytes, body.len);
+  offset += body.len;
+
+  amqp_e32(segment->data, start + 4, 0);
+  amqp_e32(segment->data, start + 8,
+           (uint32_t)(offset - start - AMQP_SPOOL_HEADER_SIZE));
+  amqp_e32(segment->data, start + 12, 0);
+  amqp_e32(segment->data, start, AMQP_SPOOL_RECORD_MAGIC);
+
+  offset = AMQP_SPOOL_ALIGN(offset);
+  segment->end = offset < segment->size ? offset : segment->size;
+  segment->unacked++;
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_spool_publish(amqp_spool_t *spool, amqp_bytes_t exchange,
+                   amqp_bytes_t routing_key, amqp_boolean_t mandatory,
+                   amqp_boolean_t immediate,
+                   struct amqp_basic_properties_t_ const *properties,
+                   amqp_bytes_t body)
+{
+  size_t fixed;
+  int res;
+
+  if (exchange.len > UINT8_MAX || routing_key.len > UINT8_MAX ||
+      body.len > UINT32_MAX - AMQP_SPOOL_PROPERTIES_RESERVE) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  fixed = AMQP_SPOOL_FIXED_SIZE + exchange.len + routing_key.len + body.len;
+
+  spool_lock(spool);
+  res = AMQP_STATUS_TABLE_TOO_BIG;
+  if (spool->writing) {
+    res = write_record(spool->writing, exchange, routing_key, mandatory,
+                       immediate, properties, body);
+  }
+  if (AMQP_STATUS_TABLE_TOO_BIG == res) {
+    res = roll_segment(spool, fixed);
+    if (AMQP_STATUS_OK == res) {
+      res = write_record(spool->writing, exchange, routing_key, mandatory,
+                         immediate, properties, body);
+    }
+  }
+  if (AMQP_STATUS_TABLE_TOO_BIG == res) {
+    /* The empty segment just started is deleted by the next drain */
+    res = roll_segment(spool, AMQP_SPOOL_ALIGN(fixed) +
+                       AMQP_SPOOL_PROPERTIES_RESERVE);
+    if (AMQP_STATUS_OK == res) {
+      res = write_record(spool->writing, exchange, routing_key, mandatory,
+                         immediate, properties, body);
+    }
+  }
+  if (AMQP_STATUS_OK == res) {
+    spool->pending++;
+  }
+  spool_unlock(spool);
+  return res;
+}
+
+int
+amqp_spool_sync(amqp_spool_t *spool)
+{
+  amqp_spool_segment_t *segment;
+  int res = AMQP_STATUS_OK;
+
+  spool_lock(spool);
+  for (segment = spool->first; segment; segment = segment->next) {
+    if (-1 == msync(segment->data, segment->size, MS_SYNC)) {
+      res = AMQP_STATUS_FILE_ERROR;
+    }
+  }
+  spool_unlock(spool);
+  return res;
+}
+
+size_t
+amqp_spool_pending(amqp_spool_t *spool)
+{
+  size_t pending;
+
+  spool_lock(spool);
+  pending = spool->pending;
+  spool_unlock(spool);
+  return pending;
+}
+
+/* Starts over on a new connection, or after a nack: everything unconfirmed
+ * is published again from the oldest record */
+static void
+restart_drain(amqp_spool_t *spool)
+{
+  spool->inflight_count = 0;
+  spool->rewind = 0;
+  spool_lock(spool);
+  spool->cursor = spool->first;
+  spool_unlock(spool);
+  spool->cursor_offset = 0;
+}
+
+static int
+publish_record(amqp_spool_t *spool, amqp_spool_segment_t *segment,
+               size_t offset)
+{
+  unsigned char *data = segment->data;
+  amqp_bytes_t exchange, routing_key, body;
+  amqp_basic_properties_t *properties = NULL;
+  amqp_boolean_t mandatory, immediate, has_properties;
+  amqp_spool_inflight_t *inflight;
+  uint32_t properties_len;
+  size_t record = offset;
+  int res;
+
+  offset += AMQP_SPOOL_HEADER_SIZE;
+  mandatory = amqp_d8(data, offset++);
+  immediate = amqp_d8(data, offset++);
+  has_properties = amqp_d8(data, offset++);
+  exchange.len = amqp_d8(data, offset++);
+  exchange.bytes = amqp_offset(data, offset);
+  offset += exchange.len;
+  routing_key.len = amqp_d8(data, offset++);
+  routing_key.bytes = amqp_offset(data, offset);
+  offset += routing_key.len;
+  properties_len = amqp_d32(data, offset);
+  offset += 4;
+
+  if (has_properties) {
+    amqp_bytes_t encoded;
+    encoded.len = properties_len;
+    encoded.bytes = amqp_offset(data, offset);
+    res = amqp_decode_properties(AMQP_BASIC_CLASS, &spool->pool, encoded,
+                                 (void **)&properties);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  offset += properties_len;
+  body.len = amqp_d32(data, offset);
+  body.bytes = amqp_offset(data, offset + 4);
+
+  if (spool->inflight_count == spool->inflight_capacity) {
+    size_t capacity = spool->inflight_capacity ? spool->inflight_capacity * 2
+                                               : 64;
+    inflight = realloc(spool->inflight,
+                       capacity * sizeof(amqp_spool_inflight_t));
+    if (NULL == inflight) {
+      recycle_amqp_pool(&spool->pool);
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    spool->inflight = inflight;
+    spool->inflight_capacity = capacity;
+  }
+
+  res = amqp_basic_publish(spool->state, spool->channel, exchange,
+                           routing_key, mandatory, immediate, properties,
+                           body);
+  recycle_amqp_pool(&spool->pool);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  inflight = &spool->inflight[spool->inflight_count++];
+  inflight->delivery_tag = spool->next_delivery_tag++;
+  inflight->segment = segment;
+  inflight->offset = record;
+  return AMQP_STATUS_OK;
+}
+
+/* Publishes every record not sent on the draining connection yet, up to the
+ * end of the segment being appended to when the drain started */
+static int
+publish_records(amqp_spool_t *spool)
+{
+  amqp_spool_segment_t *last;
+
+  spool_lock(spool);
+  last = spool->last;
+  if (NULL == spool->cursor) {
+    spool->cursor = spool->first;
+    spool->cursor_offset = 0;
+  }
+  spool_unlock(spool);
+
+  while (spool->cursor) {
+    amqp_spool_segment_t *segment = spool->cursor;
+    amqp_boolean_t sealed;
+    size_t end;
+
+    spool_lock(spool);
+    end = segment->end;
+    sealed = segment != spool->writing;
+    spool_unlock(spool);
+
+    while (spool->cursor_offset < end) {
+      size_t offset = spool->cursor_offset;
+      uint32_t flags = amqp_d32(segment->data, offset + 4);
+      size_t length = amqp_d32(segment->data, offset + 8);
+
+      if (!(flags & AMQP_SPOOL_RECORD_ACKED)) {
+        int res = publish_record(spool, segment, offset);
+        if (AMQP_STATUS_OK != res) {
+          return res;
+        }
+      }
+      spool->cursor_offset = AMQP_SPOOL_ALIGN(offset + AMQP_SPOOL_HEADER_SIZE
+                                              + length);
+    }
+
+    if (!sealed || segment == last) {
+      break;
+    }
+    spool_lock(spool);
+    spool->cursor = segment->next;
+    spool_unlock(spool);
+    spool->cursor_offset = 0;
+  }
+  return AMQP_STATUS_OK;
+}
+
+static void
+confirm(void *context, uint64_t delivery_tag, amqp_boolean_t multiple,
+        amqp_boolean_t nack)
+{
+  amqp_spool_t *spool = context;
+  size_t i, kept = 0;
+
+  for (i = 0; i < spool->inflight_count; i++) {
+    amqp_spool_inflight_t *inflight = &spool->inflight[i];
+
+    if (inflight->delivery_tag > delivery_tag ||
+        (!multiple && inflight->delivery_tag != delivery_tag)) {
+      spool->inflight[kept++] = *inflight;
+      continue;
+    }
+
+    if (nack) {
+      /* Left in the spool, published again by the next drain */
+      spool->rewind = 1;
+      continue;
+    }
+
+    amqp_e32(inflight->segment->data, inflight->offset + 4,
+             AMQP_SPOOL_RECORD_ACKED);
+    spool_lock(spool);
+    inflight->segment->unacked--;
+    spool->pending--;
+    spool_unlock(spool);
+  }
+  spool->inflight_count = kept;
+}
+
+/* Deletes the segments no longer appended to whose records are all
+ * confirmed */
+static void
+reclaim_segments(amqp_spool_t *spool)
+{
+  amqp_spool_segment_t **link = &spool->first;
+  amqp_spool_segment_t *prev = NULL;
+
+  spool_lock(spool);
+  while (*link) {
+    amqp_spool_segment_t *segment = *link;
+
+    /* The drain carries on from the end of the last segment */
+    if (segment == spool->writing || 0 != segment->unacked ||
+        (segment == spool->cursor && NULL == segment->next)) {
+      prev = segment;
+      link = &segment->next;
+      continue;
+    }
+
+    *link = segment->next;
+    if (spool->last == segment) {
+      spool->last = prev;
+    }
+    if (spool->cursor == segment) {
+      spool->cursor = segment->next;
+      spool->cursor_offset = 0;
+    }
+    unlink(segment->path);
+    segment_free(segment);
+  }
+  spool_unlock(spool);
+}
+
+static int
+wait_confirms(amqp_spool_t *spool, struct timeval *timeout)
+{
+  while (spool->inflight_count) {
+    int res = amqp_wait_confirm(spool->state, spool->channel, timeout,
+                                confirm, spool);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_spool_drain(amqp_spool_t *spool, amqp_connection_state_t state,
+                 amqp_channel_t channel, struct timeval *timeout)
+{
+  int res;
+
+  if (NULL == spool || NULL == state) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  if (state != spool->state || channel != spool->channel) {
+    res = amqp_select_confirms(state, channel);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    spool->state = state;
+    spool->channel = channel;
+    spool->next_delivery_tag = 1;
+    restart_drain(spool);
+  } else if (spool->rewind && 0 == spool->inflight_count) {
+    restart_drain(spool);
+  }
+
+  res = publish_records(spool);
+  if (AMQP_STATUS_OK == res) {
+    res = wait_confirms(spool, timeout);
+  }
+  reclaim_segments(spool);
+
+  if (AMQP_STATUS_OK != res && AMQP_STATUS_TIMEOUT != res) {
+    /* Whatever was in flight is published again on the next connection */
+    spool->state = NULL;
+    spool->inflight_count = 0;
+  }
+  return res;
+}
@@ -0,0 +1,116 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_ssl_output.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static ssize_t
+flush_output(amqp_ssl_output_t *output,
+             amqp_ssl_output_write_fn write_fn,
+             void *socket)
+{
+  ssize_t res = write_fn(socket, output->buffer, output->used);
+  output->used = 0;
+  return res;
+}
+
+ssize_t
+amqp_ssl_output_writev(amqp_ssl_output_t *output,
+                       amqp_ssl_output_write_fn write_fn,
+                       void *socket,
+                       const struct iovec *iov,
+                       int iovcnt)
+{
+  ssize_t written = 0;
+  ssize_t res;
+  int i;
+
+  if (!output->buffer) {
+    output->buffer = malloc(AMQP_SSL_OUTPUT_BUFFER_SIZE);
+    if (!output->buffer) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+  }
+  output->used = 0;
+
+  for (i = 0; i < iovcnt; ++i) {
+    const char *data = iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+
+    while (len > 0) {
+      size_t n;
+
+      if (0 == output->used && len >= AMQP_SSL_OUTPUT_BUFFER_SIZE) {
+        /* whole records worth of data: write them in place, whatever is
+         * left over is staged with the next iovec */
+        n = len - len % AMQP_SSL_OUTPUT_BUFFER_SIZE;
+        res = write_fn(socket, data, n);
+        if (res < 0) {
+          return res;
+        }
+      } else {
+        n = AMQP_SSL_OUTPUT_BUFFER_SIZE - output->used;
+        if (n > len) {
+          n = len;
+        }
+        memcpy(output->buffer + output->used, data, n);
+        output->used += n;
+
+        if (AMQP_SSL_OUTPUT_BUFFER_SIZE == output->used) {
+          res = flush_output(output, write_fn, socket);
+          if (res < 0) {
+            return res;
+          }
+        }
+      }
+
+      data += n;
+      len -= n;
+      written += n;
+    }
+  }
+
+  if (output->used > 0) {
+    res = flush_output(output, write_fn, socket);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  return written;
+}
+
+void
+amqp_ssl_output_destroy(amqp_ssl_output_t *output)
+{
+  free(output->buffer);
+  output->buffer = NULL;
+  output->used = 0;
+}
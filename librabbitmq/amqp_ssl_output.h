@@ -0,0 +1,64 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef AMQP_SSL_OUTPUT_H
+#define AMQP_SSL_OUTPUT_H
+
+#include "amqp_private.h"
+
+/* The largest plaintext a single TLS record can carry */
+#define AMQP_SSL_OUTPUT_BUFFER_SIZE 16384
+
+/*
+ * Writes a buffer to the TLS stream. Returns a negative amqp_status_enum
+ * value on failure, anything else on success.
+ */
+typedef ssize_t (*amqp_ssl_output_write_fn)(void *socket,
+                                            const void *buf,
+                                            size_t len);
+
+/*
+ * Output staging shared by the SSL/TLS socket classes.
+ *
+ * The iovecs of a writev are packed into full TLS records: small pieces
+ * (frame headers, footers, method frames) are copied into a staging buffer
+ * of one record, while the record-aligned middle of a large body fragment is
+ * written straight from the caller's memory. The staging buffer is
+ * allocated on first use and never grows.
+ */
+typedef struct amqp_ssl_output_t_ {
+  char *buffer;
+  size_t used;
+} amqp_ssl_output_t;
+
+ssize_t
+amqp_ssl_output_writev(amqp_ssl_output_t *output,
+                       amqp_ssl_output_write_fn write_fn,
+                       void *socket,
+                       const struct iovec *iov,
+                       int iovcnt);
+
+void
+amqp_ssl_output_destroy(amqp_ssl_output_t *output);
+
+#endif /* AMQP_SSL_OUTPUT_H */
@@ -134,6 +134,46 @@ AMQP_CALL
 amqp_ssl_socket_set_verify(amqp_socket_t *self,
                            amqp_boolean_t verify);
 
+/**
+ * Enable or disable kernel TLS offload.
+ *
+ * When enabled, the socket asks the SSL library to hand the session keys to
+ * the kernel (kTLS) after the handshake. If the kernel accepts them, frames
+ * are written to the socket directly and encrypted by the kernel, avoiding
+ * a copy into a user-space buffer. Reads still go through the SSL library,
+ * which reads already decrypted data from the kernel when it supports kTLS
+ * receive.
+ *
+ * kTLS requires Linux with the tls module, OpenSSL 3.0 or later built with
+ * kTLS support, and a cipher the kernel supports. When any of these are
+ * missing the socket silently uses regular user-space TLS. Use
+ * amqp_ssl_socket_ktls_active() to check the outcome. kTLS is disabled by
+ * default, and the setting takes effect the next time the socket is opened.
+ *
+ * \param [in,out] self An SSL/TLS socket object.
+ * \param [in] enable Enable or disable kTLS.
+ *
+ * \since v0.6.0
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL
+amqp_ssl_socket_set_ktls(amqp_socket_t *self,
+                         amqp_boolean_t enable);
+
+/**
+ * Check whether writes on an open socket are offloaded to kernel TLS.
+ *
+ * \param [in] self An SSL/TLS socket object.
+ * \return 1 if kTLS transmit offload is active, 0 otherwise.
+ *
+ * \since v0.6.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_boolean_t
+AMQP_CALL
+amqp_ssl_socket_ktls_active(amqp_socket_t *self);
+
 /**
  * Sets whether rabbitmq-c initializes the underlying SSL library.
  *
@@ -163,6 +203,201 @@ void
 AMQP_CALL
 amqp_set_initialize_ssl_library(amqp_boolean_t do_initialize);
 
+/**
+ * An SSL/TLS context that can be shared by several SSL/TLS sockets.
+ *
+ * Certificates and keys loaded into a context are parsed once, all sockets
+ * created with amqp_ssl_socket_new_with_context() use the same in-memory
+ * copy. The context is reference counted: each socket holds a reference
+ * which is released when the socket is destroyed.
+ *
+ * A context should be fully configured before it is shared. Once configured
+ * it may be used to create and open sockets from several threads at the same
+ * time.
+ *
+ * Currently only implemented by the OpenSSL backend.
+ *
+ * \since v0.6.0
+ */
+typedef struct amqp_ssl_context_t_ amqp_ssl_context_t;
+
+/**
+ * Create a new SSL/TLS context.
+ *
+ * Calling this function may result in the underlying SSL library being initialized.
+ * \sa amqp_set_initialize_ssl_library()
+ *
+ * \return A new context holding one reference, or NULL if an error occurred.
+ *
+ * \since v0.6.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_ssl_context_t *
+AMQP_CALL
+amqp_ssl_context_new(void);
+
+/**
+ * Release a reference to an SSL/TLS context.
+ *
+ * The context is destroyed once the caller and all sockets using it have
+ * released their references.
+ *
+ * \param [in] context An SSL/TLS context, may be NULL.
+ *
+ * \since v0.6.0
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL
+amqp_ssl_context_free(amqp_ssl_context_t *context);
+
+/**
+ * Set the CA certificate of a context.
+ *
+ * \param [in,out] context An SSL/TLS context.
+ * \param [in] cacert Path to the CA cert file in PEM format.
+ *
+ * \return \ref AMQP_STATUS_OK on success an \ref amqp_status_enum value on
+ *  failure.
+ *
+ * \since v0.6.0
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL
+amqp_ssl_context_set_cacert(amqp_ssl_context_t *context,
+                            const char *cacert);
+
+/**
+ * Set the client key of a context.
+ *
+ * \param [in,out] context An SSL/TLS context.
+ * \param [in] cert Path to the client certificate in PEM foramt.
+ * \param [in] key Path to the client key in PEM format.
+ *
+ * \return \ref AMQP_STATUS_OK on success an \ref amqp_status_enum value on
+ *  failure.
+ *
+ * \since v0.6.0
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL
+amqp_ssl_context_set_key(amqp_ssl_context_t *context,
+                         const char *cert,
+                         const char *key);
+
+/**
+ * Set the client key of a context from a buffer.
+ *
+ * \param [in,out] context An SSL/TLS context.
+ * \param [in] cert Path to the client certificate in PEM foramt.
+ * \param [in] key A buffer containing client key in PEM format.
+ * \param [in] n The length of the buffer.
+ *
+ * \return \ref AMQP_STATUS_OK on success an \ref amqp_status_enum value on
+ *  failure.
+ *
+ * \since v0.6.0
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL
+amqp_ssl_context_set_key_buffer(amqp_ssl_context_t *context,
+                                const char *cert,
+                                const void *key,
+                                size_t n);
+
+/**
+ * Set the client certificate of a context.
+ *
+ * \param [in,out] context An SSL/TLS context.
+ * \param [in] cert Path to the client certificate in PEM foramt.
+ *
+ * \return \ref AMQP_STATUS_OK on success an \ref amqp_status_enum value on
+ *  failure.
+ *
+ * \since v0.6.0
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL
+amqp_ssl_context_set_cert(amqp_ssl_context_t *context,
+                          const char *cert);
+
+/**
+ * Enable or disable the client session cache of a context.
+ *
+ * With the session cache enabled, sockets using the context remember the
+ * TLS session (session ID or TLS 1.3 session ticket) of each host and port
+ * they connect to and offer it when connecting there again, allowing an
+ * abbreviated handshake. Up to 64 sessions are kept, the least recently
+ * stored is evicted first. Disabling the cache drops all cached sessions.
+ *
+ * The session cache is disabled by default.
+ *
+ * \param [in,out] context An SSL/TLS context.
+ * \param [in] enable Enable or disable the session cache.
+ *
+ * \return \ref AMQP_STATUS_OK
+ *
+ * \since v0.6.0
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL
+amqp_ssl_context_set_session_cache(amqp_ssl_context_t *context,
+                                   amqp_boolean_t enable);
+
+/**
+ * Session cache statistics of an SSL/TLS context.
+ *
+ * \since v0.6.0
+ */
+typedef struct amqp_ssl_session_stats_t_ {
+  uint64_t hits;    /**< handshakes that resumed a cached session */
+  uint64_t misses;  /**< handshakes that did a full handshake */
+  size_t cached;    /**< sessions currently cached */
+} amqp_ssl_session_stats_t;
+
+/**
+ * Get the session cache statistics of a context.
+ *
+ * Only handshakes made while the session cache is enabled are counted.
+ *
+ * \param [in] context An SSL/TLS context.
+ * \param [out] stats The statistics.
+ *
+ * \since v0.6.0
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL
+amqp_ssl_context_get_session_stats(amqp_ssl_context_t *context,
+                                   amqp_ssl_session_stats_t *stats);
+
+/**
+ * Create a new SSL/TLS socket object using a shared context.
+ *
+ * Behaves like amqp_ssl_socket_new(), except that the socket uses the
+ * given context instead of creating its own. The socket takes a reference to
+ * the context, the caller may release its own reference at any time.
+ *
+ * The amqp_ssl_socket_set_cacert() family of functions modify the context,
+ * and so affect every socket sharing it.
+ *
+ * \param [in,out] state The connection object that owns the SSL/TLS socket
+ * \param [in] context The SSL/TLS context to use
+ * \return A new socket object or NULL if an error occurred.
+ *
+ * \since v0.6.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_socket_t *
+AMQP_CALL
+amqp_ssl_socket_new_with_context(amqp_connection_state_t state,
+                                 amqp_ssl_context_t *context);
+
 AMQP_END_DECLS
 
 #endif /* AMQP_SSL_H */
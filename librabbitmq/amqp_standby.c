@@ -0,0 +1,391 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* A publish the broker has not confirmed yet */
+typedef struct amqp_standby_message_t_ {
+  struct amqp_standby_message_t_ *next;
+  uint64_t delivery_tag;
+  amqp_bytes_t exchange;
+  amqp_bytes_t routing_key;
+  amqp_boolean_t mandatory;
+  amqp_boolean_t immediate;
+  amqp_boolean_t has_properties;
+  amqp_bytes_t properties;    /* encoded */
+  amqp_bytes_t body;
+} amqp_standby_message_t;
+
+struct amqp_standby_publisher_t_ {
+  amqp_channel_t channel;
+  amqp_connection_state_t active;
+  amqp_connection_state_t standby;
+  uint64_t next_delivery_tag;
+  amqp_standby_message_t *first;
+  amqp_standby_message_t *last;
+  size_t outstanding;
+  uint64_t nacked;
+  amqp_pool_t pool;
+};
+
+static void
+free_message(amqp_standby_message_t *message)
+{
+  amqp_bytes_free(message->exchange);
+  amqp_bytes_free(message->routing_key);
+  amqp_bytes_free(message->properties);
+  amqp_bytes_free(message->body);
+  free(message);
+}
+
+static void
+append_message(amqp_standby_publisher_t *publisher,
+               amqp_standby_message_t *message, uint64_t delivery_tag)
+{
+  message->delivery_tag = delivery_tag;
+  if (publisher->last) {
+    publisher->last->next = message;
+  } else {
+    publisher->first = message;
+  }
+  publisher->last = message;
+  publisher->outstanding++;
+}
+
+static int
+send_message(amqp_standby_publisher_t *publisher,
+             amqp_connection_state_t state, amqp_standby_message_t *message)
+{
+  amqp_basic_properties_t *properties = NULL;
+  int res;
+
+  if (message->has_properties) {
+    res = amqp_decode_properties(AMQP_BASIC_CLASS, &publisher->pool,
+                                 message->properties, (void **)&properties);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  res = amqp_basic_publish(state, publisher->channel,
+                           message->exchange, message->routing_key,
+                           message->mandatory, message->immediate,
+                           properties, message->body);
+  recycle_amqp_pool(&publisher->pool);
+  return res;
+}
+
+/* Nothing outstanding is known to have reached the previous connection,
+ * publish it all again on state in the original order. Only once that
+ * worked does state become the active connection; otherwise every message
+ * is left untagged so no confirm can match it until the next replay. */
+static int
+replay(amqp_standby_publisher_t *publisher, amqp_connection_state_t state)
+{
+  amqp_standby_message_t *message;
+  uint64_t delivery_tag = 1;
+
+  for (message = publisher->first; message; message = message->next) {
+    int res = send_message(publisher, state, message);
+    if (AMQP_STATUS_OK != res) {
+      for (message = publisher->first; message; message = message->next) {
+        message->delivery_tag = 0;
+      }
+      return res;
+    }
+    message->delivery_tag = delivery_tag++;
+  }
+
+  publisher->active = state;
+  publisher->next_delivery_tag = delivery_tag;
+  return AMQP_STATUS_OK;
+}
+
+amqp_standby_publisher_t *
+amqp_standby_publisher_new(amqp_channel_t channel)
+{
+  amqp_standby_publisher_t *publisher =
+    calloc(1, sizeof(amqp_standby_publisher_t));
+  if (NULL == publisher) {
+    return NULL;
+  }
+
+  publisher->channel = channel;
+  publisher->next_delivery_tag = 1;
+  init_amqp_pool(&publisher->pool, 4096);
+  return publisher;
+}
+
+void
+amqp_standby_publisher_free(amqp_standby_publisher_t *publisher)
+{
+  amqp_standby_message_t *message;
+
+  if (NULL == publisher) {
+    return;
+  }
+
+  message = publisher->first;
+  while (message) {
+    amqp_standby_message_t *next = message->next;
+    free_message(message);
+    message = next;
+  }
+  empty_amqp_pool(&publisher->pool);
+  free(publisher);
+}
+
+int
+amqp_standby_publisher_set_primary(amqp_standby_publisher_t *publisher,
+                                   amqp_connection_state_t state)
+{
+  int res = amqp_select_confirms(state, publisher->channel);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  return replay(publisher, state);
+}
+
+int
+amqp_standby_publisher_set_standby(amqp_standby_publisher_t *publisher,
+                                   amqp_connection_state_t state)
+{
+  if (state) {
+    int res = amqp_select_confirms(state, publisher->channel);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  publisher->standby = state;
+  return AMQP_STATUS_OK;
+}
+
+amqp_connection_state_t
+amqp_standby_publisher_get_primary(amqp_standby_publisher_t *publisher)
+{
+  return publisher->active;
+}
+
+amqp_connection_state_t
+amqp_standby_publisher_get_standby(amqp_standby_publisher_t *publisher)
+{
+  return publisher->standby;
+}
+
+size_t
+amqp_standby_publisher_outstanding(amqp_standby_publisher_t *publisher)
+{
+  return publisher->outstanding;
+}
+
+uint64_t
+amqp_standby_publisher_nacked(amqp_standby_publisher_t *publisher)
+{
+  return publisher->nacked;
+}
+
+int
+amqp_standby_publisher_failover(amqp_standby_publisher_t *publisher)
+{
+  amqp_connection_state_t standby = publisher->standby;
+
+  if (NULL == standby) {
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+
+  /* Promoted or not, the standby is used up: a failed replay leaves its
+   * confirm sequence out of step with the outstanding messages */
+  publisher->standby = NULL;
+  return replay(publisher, standby);
+}
+
+/* Errors after which the connection is of no further use. A blocked
+ * connection is healthy, the broker is only flow-controlling it. */
+static amqp_boolean_t
+is_connection_failure(int status)
+{
+  return status < 0 &&
+         AMQP_STATUS_TIMEOUT != status &&
+         AMQP_STATUS_NO_MEMORY != status &&
+         AMQP_STATUS_TABLE_TOO_BIG != status &&
+         AMQP_STATUS_INVALID_PARAMETER != status &&
+         AMQP_STATUS_CONNECTION_BLOCKED != status;
+}
+
+/* Services heartbeats on the standby connection, dropping it if it failed */
+static void
+service_standby(amqp_standby_publisher_t *publisher)
+{
+  struct timeval zero;
+
+  while (publisher->standby) {
+    amqp_frame_t frame;
+    int res;
+
+    zero.tv_sec = 0;
+    zero.tv_usec = 0;
+    res = amqp_simple_wait_frame_noblock(publisher->standby, &frame, &zero);
+    if (AMQP_STATUS_TIMEOUT == res) {
+      break;
+    }
+    if (AMQP_STATUS_OK != res ||
+        (AMQP_FRAME_METHOD == frame.frame_type &&
+         (AMQP_CHANNEL_CLOSE_METHOD == frame.payload.method.id ||
+          AMQP_CONNECTION_CLOSE_METHOD == frame.payload.method.id))) {
+      publisher->standby = NULL;
+      break;
+    }
+    amqp_maybe_release_buffers(publisher->standby);
+  }
+}
+
+int
+amqp_standby_publish(amqp_standby_publisher_t *publisher,
+                     amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                     amqp_boolean_t mandatory, amqp_boolean_t immediate,
+                     struct amqp_basic_properties_t_ const *properties,
+                     amqp_bytes_t body)
+{
+  amqp_standby_message_t *message;
+  int res;
+
+  if (NULL == publisher->active) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  message = calloc(1, sizeof(amqp_standby_message_t));
+  if (NULL == message) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  message->mandatory = mandatory;
+  message->immediate = immediate;
+  message->has_properties = (NULL != properties);
+
+  res = amqp_bytes_dup(exchange, &message->exchange);
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_bytes_dup(routing_key, &message->routing_key);
+  }
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_bytes_dup(body, &message->body);
+  }
+  if (AMQP_STATUS_OK == res && properties) {
+    res = amqp_encode_basic_properties(properties, &message->properties);
+  }
+  if (AMQP_STATUS_OK != res) {
+    free_message(message);
+    return res;
+  }
+
+  res = send_message(publisher, publisher->active, message);
+  if (AMQP_STATUS_OK != res && !is_connection_failure(res)) {
+    free_message(message);
+    return res;
+  }
+
+  if (AMQP_STATUS_OK != res) {
+    /* Queue it untagged so the failover replays it along with the rest */
+    append_message(publisher, message, 0);
+    return amqp_standby_publisher_failover(publisher);
+  }
+
+  append_message(publisher, message, publisher->next_delivery_tag++);
+  service_standby(publisher);
+  return AMQP_STATUS_OK;
+}
+
+/* Drops the messages confirmed by a basic.ack or basic.nack */
+static void
+confirm(void *context, uint64_t delivery_tag, amqp_boolean_t multiple,
+        amqp_boolean_t nack)
+{
+  amqp_standby_publisher_t *publisher = context;
+  amqp_standby_message_t **link = &publisher->first;
+  amqp_standby_message_t *prev = NULL;
+
+  while (*link) {
+    amqp_standby_message_t *message = *link;
+
+    if (message->delivery_tag > delivery_tag) {
+      break;
+    }
+    /* A zero tag was never sent on the active connection */
+    if (0 != message->delivery_tag &&
+        (multiple || message->delivery_tag == delivery_tag)) {
+      *link = message->next;
+      if (publisher->last == message) {
+        publisher->last = prev;
+      }
+      publisher->outstanding--;
+      if (nack) {
+        publisher->nacked++;
+      }
+      free_message(message);
+      continue;
+    }
+    prev = message;
+    link = &message->next;
+  }
+}
+
+int
+amqp_standby_wait_confirms(amqp_standby_publisher_t *publisher,
+                           struct timeval *timeout)
+{
+  while (publisher->first) {
+    int res;
+
+    service_standby(publisher);
+
+    res = amqp_wait_confirm(publisher->active, publisher->channel, timeout,
+                            confirm, publisher);
+    if (AMQP_STATUS_OK != res && !is_connection_failure(res)) {
+      return res;
+    }
+    if (AMQP_STATUS_OK != res) {
+      res = amqp_standby_publisher_failover(publisher);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+  }
+
+  service_standby(publisher);
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_standby_publisher_service(amqp_standby_publisher_t *publisher)
+{
+  service_standby(publisher);
+  return publisher->standby ? AMQP_STATUS_OK : AMQP_STATUS_SOCKET_ERROR;
+}
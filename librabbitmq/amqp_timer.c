@@ -102,8 +102,64 @@ amqp_get_monotonic_timestamp(void)
   return ((uint64_t)tp.tv_sec * AMQP_NS_PER_S + (uint64_t)tp.tv_nsec);
 #endif
 }
+
+uint64_t
+amqp_get_coarse_monotonic_timestamp(void)
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+  struct timespec tp;
+  if (-1 == clock_gettime(CLOCK_MONOTONIC_COARSE, &tp)) {
+    return 0;
+  }
+
+  return ((uint64_t)tp.tv_sec * AMQP_NS_PER_S + (uint64_t)tp.tv_nsec);
+#else
+  return amqp_get_monotonic_timestamp();
+#endif
+}
 #endif /* AMQP_POSIX_TIMER_API */
 
+#ifndef AMQP_POSIX_TIMER_API
+uint64_t
+amqp_get_coarse_monotonic_timestamp(void)
+{
+  return amqp_get_monotonic_timestamp();
+}
+#endif
+
+uint64_t
+amqp_clock_refresh(amqp_clock_t *clock)
+{
+  switch (clock->source) {
+  case AMQP_CLOCK_SOURCE_MONOTONIC_COARSE:
+    clock->cached_timestamp = amqp_get_coarse_monotonic_timestamp();
+    break;
+
+  case AMQP_CLOCK_SOURCE_USER:
+    clock->cached_timestamp = clock->clock_fn(clock->user_data);
+    break;
+
+  case AMQP_CLOCK_SOURCE_MONOTONIC:
+  case AMQP_CLOCK_SOURCE_CACHED:
+  default:
+    clock->cached_timestamp = amqp_get_monotonic_timestamp();
+    break;
+  }
+
+  return clock->cached_timestamp;
+}
+
+uint64_t
+amqp_clock_now(amqp_clock_t *clock)
+{
+  if (AMQP_CLOCK_SOURCE_CACHED == clock->source
+      && 0 != clock->cached_timestamp) {
+    return clock->cached_timestamp;
+  }
+
+  return amqp_clock_refresh(clock);
+}
+
 int
 amqp_timer_update(amqp_timer_t *timer, struct timeval *timeout)
 {
@@ -26,6 +26,8 @@
 
 #include <stdint.h>
 
+#include "amqp.h"
+
 #ifdef _WIN32
 # ifndef WINVER
 #  define WINVER 0x0502
@@ -56,10 +58,34 @@ typedef struct amqp_timer_t_ {
   struct timeval tv;
 } amqp_timer_t;
 
+/* Per-connection clock, see amqp_set_clock_source() */
+typedef struct amqp_clock_t_ {
+  amqp_clock_source_enum source;
+  amqp_clock_fn clock_fn;
+  void *user_data;
+  uint64_t cached_timestamp;
+} amqp_clock_t;
+
 /* Gets a monotonic timestamp in ns */
 uint64_t
 amqp_get_monotonic_timestamp(void);
 
+/* Gets a cheaper, lower resolution monotonic timestamp in ns. Falls back to
+ * amqp_get_monotonic_timestamp() on platforms without a coarse clock. */
+uint64_t
+amqp_get_coarse_monotonic_timestamp(void);
+
+/* Reads the clock's source and stores the result as the cached timestamp.
+ * Returns 0 on failure. */
+uint64_t
+amqp_clock_refresh(amqp_clock_t *clock);
+
+/* Gets the current time according to the clock. For the cached source this
+ * returns the timestamp of the last refresh without reading a system clock.
+ * Returns 0 on failure. */
+uint64_t
+amqp_clock_now(amqp_clock_t *clock);
+
 /* Prepare timeout value and modify timer state based on timer state. */
 int
 amqp_timer_update(amqp_timer_t *timer, struct timeval *timeout);
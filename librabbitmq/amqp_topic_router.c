@@ -0,0 +1,485 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Portions created by Alan Antonuk are Copyright (c) 2014 Alan Antonuk.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Patterns are kept in a trie of words. Literal words are edges sorted for
+ * binary search, * and # are separate children. A routing key is matched
+ * by walking the trie with the set of nodes reachable so far, one word at
+ * a time, like an NFA: a # node stays in the set while it consumes words,
+ * and every node with a # child also brings that child in, since # may
+ * match no words at all.
+ *
+ * The work per word is bounded by the size of that set, which only grows
+ * with patterns that share a prefix and then use # or *, not with the
+ * total number of patterns.
+ */
+
+struct topic_node;
+
+struct topic_edge {
+  amqp_bytes_t word;
+  struct topic_node *node;
+};
+
+struct topic_binding {
+  uint64_t id;
+  amqp_topic_handler_fn handler;
+  void *user_data;
+  struct topic_node *node;
+  struct topic_binding *next_in_node;
+  struct topic_binding *next;
+};
+
+struct topic_node {
+  struct topic_edge *edges;
+  size_t edge_count;
+  size_t edge_capacity;
+  struct topic_node *star;
+  struct topic_node *hash;
+  amqp_boolean_t is_hash;
+  struct topic_binding *bindings;
+  unsigned mark;
+};
+
+struct node_set {
+  struct topic_node **nodes;
+  size_t count;
+  size_t capacity;
+};
+
+struct amqp_topic_router_t_ {
+  struct topic_node root;
+  struct topic_binding *bindings;
+  uint64_t next_id;
+  size_t node_count;
+  unsigned mark;
+  struct node_set current;
+  struct node_set next;
+  struct topic_binding **matched;
+  size_t matched_capacity;
+};
+
+int
+amqp_topic_router_new(amqp_topic_router_t **router)
+{
+  amqp_topic_router_t *r = calloc(1, sizeof(amqp_topic_router_t));
+
+  if (NULL == r) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  r->next_id = 1;
+  r->node_count = 1;
+  *router = r;
+  return AMQP_STATUS_OK;
+}
+
+static void
+free_node(struct topic_node *node)
+{
+  size_t i;
+
+  for (i = 0; i < node->edge_count; i++) {
+    free_node(node->edges[i].node);
+    free(node->edges[i].node);
+    amqp_bytes_free(node->edges[i].word);
+  }
+  free(node->edges);
+  if (node->star) {
+    free_node(node->star);
+    free(node->star);
+  }
+  if (node->hash) {
+    free_node(node->hash);
+    free(node->hash);
+  }
+}
+
+void
+amqp_topic_router_free(amqp_topic_router_t *router)
+{
+  if (NULL == router) {
+    return;
+  }
+  while (router->bindings) {
+    struct topic_binding *binding = router->bindings;
+    router->bindings = binding->next;
+    free(binding);
+  }
+  free_node(&router->root);
+  free(router->current.nodes);
+  free(router->next.nodes);
+  free(router->matched);
+  free(router);
+}
+
+/* Splits off the next word of a pattern or routing key */
+static amqp_bytes_t
+next_word(amqp_bytes_t key, size_t *offset)
+{
+  amqp_bytes_t word;
+  char *start = (char *)key.bytes + *offset;
+  char *dot = memchr(start, '.', key.len - *offset);
+
+  word.bytes = start;
+  word.len = dot ? (size_t)(dot - start) : key.len - *offset;
+  /* step over the dot; past the end when this was the last word */
+  *offset += word.len + 1;
+  return word;
+}
+
+static int
+compare_word(amqp_bytes_t a, amqp_bytes_t b)
+{
+  size_t len = a.len < b.len ? a.len : b.len;
+  int res = len ? memcmp(a.bytes, b.bytes, len) : 0;
+
+  if (res) {
+    return res;
+  }
+  return a.len < b.len ? -1 : a.len > b.len;
+}
+
+/* Finds the edge for word, or where it would be inserted */
+static size_t
+find_edge(struct topic_node *node, amqp_bytes_t word, amqp_boolean_t *found)
+{
+  size_t low = 0;
+  size_t high = node->edge_count;
+
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    int res = compare_word(node->edges[middle].word, word);
+
+    if (0 == res) {
+      *found = 1;
+      return middle;
+    }
+    if (res < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  *found = 0;
+  return low;
+}
+
+static struct topic_node *
+child_for_word(amqp_topic_router_t *router, struct topic_node *node,
+               amqp_bytes_t word)
+{
+  struct topic_node **special = NULL;
+  struct topic_node *child;
+  amqp_boolean_t found;
+  size_t index;
+
+  if (1 == word.len && '*' == *(char *)word.bytes) {
+    special = &node->star;
+  } else if (1 == word.len && '#' == *(char *)word.bytes) {
+    special = &node->hash;
+  }
+
+  if (special) {
+    if (NULL == *special) {
+      *special = calloc(1, sizeof(struct topic_node));
+      if (NULL == *special) {
+        return NULL;
+      }
+      (*special)->is_hash = special == &node->hash;
+      router->node_count++;
+    }
+    return *special;
+  }
+
+  index = find_edge(node, word, &found);
+  if (found) {
+    return node->edges[index].node;
+  }
+
+  if (node->edge_count == node->edge_capacity) {
+    size_t capacity = node->edge_capacity ? node->edge_capacity * 2 : 4;
+    struct topic_edge *edges =
+        realloc(node->edges, capacity * sizeof(struct topic_edge));
+    if (NULL == edges) {
+      return NULL;
+    }
+    node->edges = edges;
+    node->edge_capacity = capacity;
+  }
+
+  child = calloc(1, sizeof(struct topic_node));
+  if (NULL == child) {
+    return NULL;
+  }
+  if (word.len) {
+    amqp_bytes_t copy = amqp_bytes_malloc_dup(word);
+    if (NULL == copy.bytes) {
+      free(child);
+      return NULL;
+    }
+    word = copy;
+  }
+
+  memmove(&node->edges[index + 1], &node->edges[index],
+          (node->edge_count - index) * sizeof(struct topic_edge));
+  node->edges[index].word = word;
+  node->edges[index].node = child;
+  node->edge_count++;
+  router->node_count++;
+  return child;
+}
+
+int
+amqp_topic_router_add(amqp_topic_router_t *router, amqp_bytes_t pattern,
+                      amqp_topic_handler_fn handler, void *user_data,
+                      uint64_t *binding_id)
+{
+  struct topic_node *node = &router->root;
+  struct topic_binding *binding;
+  size_t offset = 0;
+
+  if (NULL == handler) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  binding = calloc(1, sizeof(struct topic_binding));
+  if (NULL == binding) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  while (offset < pattern.len + (pattern.len ? 1 : 0)) {
+    node = child_for_word(router, node, next_word(pattern, &offset));
+    if (NULL == node) {
+      /* nodes already added are left empty in the trie */
+      free(binding);
+      return AMQP_STATUS_NO_MEMORY;
+    }
+  }
+
+  binding->id = router->next_id++;
+  binding->handler = handler;
+  binding->user_data = user_data;
+  binding->node = node;
+  binding->next_in_node = node->bindings;
+  node->bindings = binding;
+  binding->next = router->bindings;
+  router->bindings = binding;
+
+  if (binding_id) {
+    *binding_id = binding->id;
+  }
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_topic_router_remove(amqp_topic_router_t *router, uint64_t binding_id)
+{
+  struct topic_binding **link;
+  struct topic_binding *binding;
+
+  for (link = &router->bindings; *link; link = &(*link)->next) {
+    if ((*link)->id == binding_id) {
+      break;
+    }
+  }
+  binding = *link;
+  if (NULL == binding) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  *link = binding->next;
+
+  for (link = &binding->node->bindings; *link != binding;
+       link = &(*link)->next_in_node) {
+  }
+  *link = binding->next_in_node;
+
+  free(binding);
+  return AMQP_STATUS_OK;
+}
+
+static int
+ensure_capacity(struct node_set *set, size_t capacity)
+{
+  struct topic_node **nodes;
+
+  if (set->capacity >= capacity) {
+    return AMQP_STATUS_OK;
+  }
+  nodes = realloc(set->nodes, capacity * sizeof(struct topic_node *));
+  if (NULL == nodes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  set->nodes = nodes;
+  set->capacity = capacity;
+  return AMQP_STATUS_OK;
+}
+
+/* Adds node, and the # nodes that can follow it without consuming a word */
+static void
+add_state(amqp_topic_router_t *router, struct node_set *set,
+          struct topic_node *node)
+{
+  while (node && node->mark != router->mark) {
+    node->mark = router->mark;
+    set->nodes[set->count++] = node;
+    node = node->hash;
+  }
+}
+
+static void
+clear_marks(struct topic_node *node)
+{
+  size_t i;
+
+  node->mark = 0;
+  for (i = 0; i < node->edge_count; i++) {
+    clear_marks(node->edges[i].node);
+  }
+  if (node->star) {
+    clear_marks(node->star);
+  }
+  if (node->hash) {
+    clear_marks(node->hash);
+  }
+}
+
+static void
+next_mark(amqp_topic_router_t *router)
+{
+  if (0 == ++router->mark) {
+    /* wrapped: a node marked long ago could now look current */
+    clear_marks(&router->root);
+    router->mark = 1;
+  }
+}
+
+static int
+compare_binding(void const *a, void const *b)
+{
+  uint64_t id_a = (*(struct topic_binding * const *)a)->id;
+  uint64_t id_b = (*(struct topic_binding * const *)b)->id;
+
+  return id_a < id_b ? -1 : id_a > id_b;
+}
+
+int
+amqp_topic_router_dispatch(amqp_topic_router_t *router,
+                           amqp_envelope_t const *envelope, size_t *matched)
+{
+  amqp_bytes_t key = envelope->routing_key;
+  size_t matched_count = 0;
+  size_t offset = 0;
+  size_t i;
+  int res;
+
+  if (matched) {
+    *matched = 0;
+  }
+
+  /* every node is in a set at most once per step */
+  res = ensure_capacity(&router->current, router->node_count);
+  if (AMQP_STATUS_OK == res) {
+    res = ensure_capacity(&router->next, router->node_count);
+  }
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  next_mark(router);
+  router->current.count = 0;
+  add_state(router, &router->current, &router->root);
+
+  while (offset < key.len + (key.len ? 1 : 0) && router->current.count) {
+    amqp_bytes_t word = next_word(key, &offset);
+    struct node_set swap;
+
+    next_mark(router);
+    router->next.count = 0;
+    for (i = 0; i < router->current.count; i++) {
+      struct topic_node *node = router->current.nodes[i];
+      amqp_boolean_t found;
+      size_t index;
+
+      if (node->is_hash) {
+        add_state(router, &router->next, node);
+      }
+      if (node->edge_count) {
+        index = find_edge(node, word, &found);
+        if (found) {
+          add_state(router, &router->next, node->edges[index].node);
+        }
+      }
+      add_state(router, &router->next, node->star);
+    }
+
+    swap = router->current;
+    router->current = router->next;
+    router->next = swap;
+  }
+
+  for (i = 0; i < router->current.count; i++) {
+    struct topic_binding *binding;
+
+    for (binding = router->current.nodes[i]->bindings; binding;
+         binding = binding->next_in_node) {
+      if (matched_count == router->matched_capacity) {
+        size_t capacity = matched_count ? matched_count * 2 : 16;
+        struct topic_binding **bindings =
+            realloc(router->matched, capacity * sizeof(struct topic_binding *));
+        if (NULL == bindings) {
+          return AMQP_STATUS_NO_MEMORY;
+        }
+        router->matched = bindings;
+        router->matched_capacity = capacity;
+      }
+      router->matched[matched_count++] = binding;
+    }
+  }
+
+  /* call handlers in the order they were added */
+  qsort(router->matched, matched_count, sizeof(struct topic_binding *),
+        compare_binding);
+
+  for (i = 0; i < matched_count; i++) {
+    struct topic_binding *binding = router->matched[i];
+
+    if (matched) {
+      *matched = i + 1;
+    }
+    res = binding->handler(binding->user_data, envelope);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  return AMQP_STATUS_OK;
+}
@@ -216,3 +216,139 @@ int amqp_parse_url(char *url, struct amqp_connection_info *parsed)
 out:
   return res;
 }
+
+/* Parse a single host[:port] or [ipv6][:port] item of a host list */
+static int parse_host_port(char *item, char **host, int *port)
+{
+  char delim;
+  char *start = item;
+  char *hostname = item;
+
+  delim = find_delim(&item, 1);
+
+  if (delim == '[') {
+    if (*start != 0) {
+      return AMQP_STATUS_BAD_URL;
+    }
+
+    hostname = item;
+    delim = find_delim(&item, 0);
+    if (delim != ']') {
+      return AMQP_STATUS_BAD_URL;
+    }
+
+    start = item;
+    delim = find_delim(&item, 1);
+    if (*start != 0) {
+      return AMQP_STATUS_BAD_URL;
+    }
+  }
+
+  if (*hostname == 0) {
+    return AMQP_STATUS_BAD_URL;
+  }
+
+  if (delim == ':') {
+    char *end;
+    long portnum;
+
+    start = item;
+    delim = find_delim(&item, 1);
+    portnum = strtol(start, &end, 10);
+    if (start == end || *end != 0 || portnum < 0 || portnum > 65535) {
+      return AMQP_STATUS_BAD_URL;
+    }
+    *port = portnum;
+  }
+
+  if (delim != 0) {
+    return AMQP_STATUS_BAD_URL;
+  }
+
+  *host = hostname;
+  return AMQP_STATUS_OK;
+}
+
+/* Parse an AMQP URL that may list several comma separated hosts. */
+int amqp_parse_url_host_list(char *url, struct amqp_connection_info *parsed,
+                             amqp_host_list_t *hosts)
+{
+  int res = AMQP_STATUS_BAD_URL;
+  int default_port = parsed->port;
+  char *authority;
+  char *host_part;
+  char *end;
+  char *comma;
+  char *extra_hosts = NULL;
+  char *p;
+
+  if (!strncmp(url, "amqp://", 7)) {
+    authority = url + 7;
+  } else if (!strncmp(url, "amqps://", 8)) {
+    authority = url + 8;
+    default_port = 5671;
+  } else {
+    goto out;
+  }
+
+  /* The hosts run from the end of the userinfo to the start of the path */
+  end = authority + strcspn(authority, "/?#");
+  host_part = authority;
+  for (p = authority; p < end; ++p) {
+    if (*p == '@') {
+      host_part = p + 1;
+    }
+  }
+
+  /* Stash every host but the first one, leaving a regular single host URL */
+  comma = memchr(host_part, ',', end - host_part);
+  if (comma) {
+    size_t extra_len = end - comma - 1;
+
+    extra_hosts = malloc(extra_len + 1);
+    if (NULL == extra_hosts) {
+      res = AMQP_STATUS_NO_MEMORY;
+      goto out;
+    }
+    memcpy(extra_hosts, comma + 1, extra_len);
+    extra_hosts[extra_len] = 0;
+    memmove(comma, end, strlen(end) + 1);
+  }
+
+  res = amqp_parse_url(url, parsed);
+  if (AMQP_STATUS_OK != res) {
+    goto out;
+  }
+
+  res = amqp_host_list_add(hosts, parsed->host, parsed->port);
+  if (AMQP_STATUS_OK != res) {
+    goto out;
+  }
+
+  p = extra_hosts;
+  while (p) {
+    char *next = strchr(p, ',');
+    char *host;
+    int port = default_port;
+
+    if (next) {
+      *next++ = 0;
+    }
+
+    res = parse_host_port(p, &host, &port);
+    if (AMQP_STATUS_OK != res) {
+      goto out;
+    }
+
+    res = amqp_host_list_add(hosts, host, port);
+    if (AMQP_STATUS_OK != res) {
+      goto out;
+    }
+
+    p = next;
+  }
+
+out:
+  free(extra_hosts);
+  return res;
+}
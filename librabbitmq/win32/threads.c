@@ -61,3 +61,16 @@ pthread_mutex_unlock(pthread_mutex_t *mutex)
   LeaveCriticalSection(*mutex);
   return 0;
 }
+
+int
+pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+  if (!*mutex) {
+    return 1;
+  }
+
+  DeleteCriticalSection(*mutex);
+  free(*mutex);
+  *mutex = NULL;
+  return 0;
+}
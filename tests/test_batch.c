@@ -0,0 +1,175 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <amqp.h>
+
+static void match_int(const char *what, int expect, int got)
+{
+  if (got != expect) {
+    fprintf(stderr, "Expected %s '%d', got '%d'\n",
+            what, expect, got);
+    abort();
+  }
+}
+
+static void match_bytes(const char *what, const char *expect, amqp_bytes_t got)
+{
+  if (got.len != strlen(expect) || memcmp(got.bytes, expect, got.len)) {
+    fprintf(stderr, "Expected %s '%s', got '%.*s'\n",
+            what, expect, (int)got.len, (char *)got.bytes);
+    abort();
+  }
+}
+
+static void test_round_trip(void)
+{
+  amqp_batch_packer_t *packer;
+  amqp_batch_reader_t reader;
+  amqp_pool_t pool;
+  amqp_table_entry_t entries[1];
+  amqp_table_t headers;
+  amqp_table_t got_headers;
+  amqp_bytes_t payload;
+
+  entries[0].key = amqp_cstring_bytes("seq");
+  entries[0].value.kind = AMQP_FIELD_KIND_I32;
+  entries[0].value.value.i32 = 42;
+  headers.num_entries = 1;
+  headers.entries = entries;
+
+  match_int("packer_new", AMQP_STATUS_OK,
+            amqp_batch_packer_new(NULL, 1, amqp_cstring_bytes("x"),
+                                  amqp_cstring_bytes("k"), NULL, 4096, 0,
+                                  &packer));
+  match_int("add first", AMQP_STATUS_OK,
+            amqp_batch_add(packer, NULL, amqp_cstring_bytes("first")));
+  match_int("add second", AMQP_STATUS_OK,
+            amqp_batch_add(packer, &headers, amqp_cstring_bytes("second")));
+  match_int("add empty", AMQP_STATUS_OK,
+            amqp_batch_add(packer, NULL, amqp_empty_bytes));
+  match_int("count", 3, (int)amqp_batch_packer_count(packer));
+  match_int("flush without connection", AMQP_STATUS_INVALID_PARAMETER,
+            amqp_batch_flush(packer));
+
+  init_amqp_pool(&pool, 4096);
+  amqp_batch_reader_init(&reader, amqp_batch_packer_body(packer));
+
+  match_int("next first", AMQP_STATUS_OK,
+            amqp_batch_next(&reader, &pool, &got_headers, &payload));
+  match_bytes("payload", "first", payload);
+  match_int("headers", 0, got_headers.num_entries);
+
+  match_int("next second", AMQP_STATUS_OK,
+            amqp_batch_next(&reader, &pool, &got_headers, &payload));
+  match_bytes("payload", "second", payload);
+  match_int("headers", 1, got_headers.num_entries);
+  match_bytes("header key", "seq", got_headers.entries[0].key);
+  match_int("header value", 42, got_headers.entries[0].value.value.i32);
+
+  match_int("next empty", AMQP_STATUS_OK,
+            amqp_batch_next(&reader, NULL, NULL, &payload));
+  match_int("payload length", 0, (int)payload.len);
+  match_int("has_next", 0, amqp_batch_has_next(&reader));
+
+  empty_amqp_pool(&pool);
+
+  amqp_batch_packer_clear(packer);
+  match_int("count after clear", 0, (int)amqp_batch_packer_count(packer));
+  amqp_batch_packer_free(packer);
+}
+
+static void test_truncated(void)
+{
+  amqp_batch_packer_t *packer;
+  amqp_batch_reader_t reader;
+  amqp_bytes_t body;
+  amqp_bytes_t payload;
+
+  amqp_batch_packer_new(NULL, 1, amqp_empty_bytes, amqp_empty_bytes, NULL,
+                        4096, 0, &packer);
+  amqp_batch_add(packer, NULL, amqp_cstring_bytes("payload"));
+
+  body = amqp_batch_packer_body(packer);
+  body.len -= 1;
+  amqp_batch_reader_init(&reader, body);
+  match_int("truncated", AMQP_STATUS_BAD_AMQP_DATA,
+            amqp_batch_next(&reader, NULL, NULL, &payload));
+
+  amqp_batch_packer_free(packer);
+}
+
+static uint64_t test_clock_fn(void *user_data)
+{
+  return *(uint64_t *)user_data;
+}
+
+static void test_clock(void)
+{
+  amqp_batch_packer_t *packer;
+  uint64_t now = 1000000000;
+
+  amqp_batch_packer_new(NULL, 1, amqp_empty_bytes, amqp_empty_bytes, NULL,
+                        4096, 10, &packer);
+  amqp_batch_packer_set_clock(packer, test_clock_fn, &now);
+  amqp_batch_add(packer, NULL, amqp_cstring_bytes("payload"));
+
+  now += 5000000;
+  match_int("not due", AMQP_STATUS_OK, amqp_batch_flush_due(packer));
+
+  /* Due, so it tries to publish, which needs a connection */
+  now += 5000000;
+  match_int("due", AMQP_STATUS_INVALID_PARAMETER,
+            amqp_batch_flush_due(packer));
+
+  amqp_batch_packer_free(packer);
+}
+
+int main(void)
+{
+  test_round_trip();
+  test_truncated();
+  test_clock();
+
+  fprintf(stderr, "ok\n");
+
+  return 0;
+}
@@ -0,0 +1,285 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_tcp_socket.h>
+
+/* Large enough to be mapped at the smallest threshold */
+#define BODY_LEN 100000
+#define FRAGMENT_LEN 30000
+
+/* The connection reads from a socket pair, the test plays the broker with
+ * a second connection on the other end */
+static amqp_connection_state_t conn;
+static amqp_connection_state_t broker_conn;
+static char dir[64];
+
+static void match_int(const char *what, int expect, int got)
+{
+  if (got != expect) {
+    fprintf(stderr, "Expected %s '%d', got '%d'\n",
+            what, expect, got);
+    abort();
+  }
+}
+
+static unsigned char body_byte(size_t i)
+{
+  return (unsigned char)(i * 31 % 251);
+}
+
+static void setup(void)
+{
+  int fds[2];
+
+  match_int("socketpair", 0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  conn = amqp_new_connection();
+  amqp_tcp_socket_set_sockfd(amqp_tcp_socket_new(conn), fds[0]);
+  broker_conn = amqp_new_connection();
+  amqp_tcp_socket_set_sockfd(amqp_tcp_socket_new(broker_conn), fds[1]);
+}
+
+static void teardown(void)
+{
+  amqp_destroy_connection(conn);
+  amqp_destroy_connection(broker_conn);
+}
+
+/* Sends the content of a delivery of len bytes on channel 1 */
+static void send_message(size_t len)
+{
+  amqp_basic_properties_t properties;
+  unsigned char *body = malloc(len);
+  amqp_frame_t frame;
+  size_t sent;
+
+  for (sent = 0; sent < len; sent++) {
+    body[sent] = body_byte(sent);
+  }
+  memset(&properties, 0, sizeof(properties));
+  frame.frame_type = AMQP_FRAME_HEADER;
+  frame.channel = 1;
+  frame.payload.properties.class_id = AMQP_BASIC_CLASS;
+  frame.payload.properties.body_size = len;
+  frame.payload.properties.decoded = &properties;
+  match_int("send header", AMQP_STATUS_OK,
+            amqp_send_frame(broker_conn, &frame));
+
+  for (sent = 0; sent < len; sent += frame.payload.body_fragment.len) {
+    frame.frame_type = AMQP_FRAME_BODY;
+    frame.payload.body_fragment.bytes = body + sent;
+    frame.payload.body_fragment.len =
+        len - sent < FRAGMENT_LEN ? len - sent : FRAGMENT_LEN;
+    match_int("send body", AMQP_STATUS_OK,
+              amqp_send_frame(broker_conn, &frame));
+  }
+  free(body);
+}
+
+static void match_body(unsigned char const *bytes, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (bytes[i] != body_byte(i)) {
+      fprintf(stderr, "Body differs at byte %d\n", (int)i);
+      abort();
+    }
+  }
+}
+
+/* Whether a file in dir is mapped, or -1 if there is no way to tell */
+static int mapped_from_dir(void)
+{
+  char line[512];
+  int found = 0;
+  FILE *maps = fopen("/proc/self/maps", "r");
+
+  if (NULL == maps) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), maps)) {
+    if (strstr(line, dir)) {
+      found = 1;
+    }
+  }
+  fclose(maps);
+  return found;
+}
+
+/* The bodies' files are unlinked as soon as they are created */
+static int files_in_dir(void)
+{
+  DIR *d = opendir(dir);
+  struct dirent *entry;
+  int files = 0;
+
+  while ((entry = readdir(d))) {
+    if (strcmp(".", entry->d_name) && strcmp("..", entry->d_name)) {
+      files++;
+    }
+  }
+  closedir(d);
+  return files;
+}
+
+/* Reads a message of len bytes and checks whether its body was mapped */
+static void read_body(size_t len, int mapped)
+{
+  amqp_message_t message;
+  amqp_rpc_reply_t reply;
+  int found;
+
+  send_message(len);
+  reply = amqp_read_message(conn, 1, &message, 0);
+  match_int("read", AMQP_RESPONSE_NORMAL, reply.reply_type);
+  match_int("body length", (int)len, (int)message.body.len);
+  match_body(message.body.bytes, len);
+  match_int("files", 0, files_in_dir());
+
+  found = mapped_from_dir();
+  if (-1 != found) {
+    match_int("mapped", mapped, found);
+  }
+  amqp_destroy_message(&message);
+  if (-1 != found) {
+    match_int("unmapped", 0, mapped_from_dir());
+  }
+}
+
+static void test_threshold(void)
+{
+  setup();
+
+  /* Anything under 64KiB is raised to it */
+  match_int("threshold", AMQP_STATUS_OK,
+            amqp_set_body_file_threshold(conn, 1, dir));
+  read_body(BODY_LEN, 1);
+  read_body(65536, 1);
+  read_body(65535, 0);
+  read_body(10, 0);
+
+  match_int("higher threshold", AMQP_STATUS_OK,
+            amqp_set_body_file_threshold(conn, BODY_LEN + 1, dir));
+  read_body(BODY_LEN, 0);
+  read_body(BODY_LEN + 1, 1);
+
+  match_int("no threshold", AMQP_STATUS_OK,
+            amqp_set_body_file_threshold(conn, 0, NULL));
+  read_body(BODY_LEN, 0);
+
+  teardown();
+}
+
+static void test_bad_dir(void)
+{
+  amqp_message_t message;
+  amqp_rpc_reply_t reply;
+
+  setup();
+  match_int("threshold", AMQP_STATUS_OK,
+            amqp_set_body_file_threshold(conn, 1, "/nonexistent/directory"));
+  send_message(BODY_LEN);
+  reply = amqp_read_message(conn, 1, &message, 0);
+  match_int("read", AMQP_RESPONSE_LIBRARY_EXCEPTION, reply.reply_type);
+  match_int("error", AMQP_STATUS_FILE_ERROR, reply.library_error);
+  teardown();
+}
+
+static void test_to_fd(void)
+{
+  char path[80];
+  unsigned char *written;
+  amqp_message_t message;
+  amqp_rpc_reply_t reply;
+  int fd;
+
+  setup();
+  sprintf(path, "%s/body-XXXXXX", dir);
+  fd = mkstemp(path);
+  match_int("mkstemp", 1, -1 != fd);
+  unlink(path);
+
+  send_message(BODY_LEN);
+  reply = amqp_read_message_to_fd(conn, 1, &message, fd, 0);
+  match_int("read", AMQP_RESPONSE_NORMAL, reply.reply_type);
+  match_int("no body in memory", 1, NULL == message.body.bytes);
+  match_int("body length", BODY_LEN, (int)message.body.len);
+  amqp_destroy_message(&message);
+
+  written = malloc(BODY_LEN + 1);
+  match_int("written", BODY_LEN, (int)pread(fd, written, BODY_LEN + 1, 0));
+  match_body(written, BODY_LEN);
+  free(written);
+  close(fd);
+
+  /* Failing to write ends the read */
+  fd = open("/dev/null", O_RDONLY);
+  send_message(BODY_LEN);
+  reply = amqp_read_message_to_fd(conn, 1, &message, fd, 0);
+  match_int("read to bad fd", AMQP_RESPONSE_LIBRARY_EXCEPTION,
+            reply.reply_type);
+  match_int("error", AMQP_STATUS_FILE_ERROR, reply.library_error);
+  close(fd);
+
+  teardown();
+}
+
+int main(void)
+{
+  strcpy(dir, "/tmp/rabbitmq-c-test-XXXXXX");
+  match_int("mkdtemp", 1, NULL != mkdtemp(dir));
+
+  test_threshold();
+  test_bad_dir();
+  test_to_fd();
+
+  rmdir(dir);
+
+  fprintf(stderr, "ok\n");
+
+  return 0;
+}
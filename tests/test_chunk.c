@@ -0,0 +1,262 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <amqp.h>
+
+static void match_int(const char *what, int expect, int got)
+{
+  if (got != expect) {
+    fprintf(stderr, "Expected %s '%d', got '%d'\n",
+            what, expect, got);
+    abort();
+  }
+}
+
+/* Collects the chunks passed to the sink of a reassembler */
+typedef struct sink_state_t_ {
+  char data[64];
+  size_t len;
+  int chunks;
+  int finished;
+} sink_state_t;
+
+static int sink(void *user_data, amqp_bytes_t transfer_id, uint64_t offset,
+                amqp_bytes_t data, amqp_boolean_t last)
+{
+  sink_state_t *state = user_data;
+
+  (void)transfer_id;
+  if (offset != state->len || state->len + data.len > sizeof(state->data)) {
+    fprintf(stderr, "Unexpected chunk at offset %d\n", (int)offset);
+    abort();
+  }
+  memcpy(state->data + state->len, data.bytes, data.len);
+  state->len += data.len;
+  state->chunks++;
+  if (last) {
+    state->finished++;
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Builds a chunk message the way amqp_chunk_publish() would */
+static void make_chunk(amqp_message_t *message, amqp_table_entry_t *entries,
+                       const char *transfer_id, int64_t index, int64_t offset,
+                       amqp_boolean_t last, const char *body)
+{
+  entries[0].key = amqp_cstring_bytes("x-chunk-id");
+  entries[0].value.kind = AMQP_FIELD_KIND_UTF8;
+  entries[0].value.value.bytes = amqp_cstring_bytes(transfer_id);
+  entries[1].key = amqp_cstring_bytes("x-chunk-index");
+  entries[1].value.kind = AMQP_FIELD_KIND_I64;
+  entries[1].value.value.i64 = index;
+  entries[2].key = amqp_cstring_bytes("x-chunk-offset");
+  entries[2].value.kind = AMQP_FIELD_KIND_I64;
+  entries[2].value.value.i64 = offset;
+  entries[3].key = amqp_cstring_bytes("x-chunk-last");
+  entries[3].value.kind = AMQP_FIELD_KIND_BOOLEAN;
+  entries[3].value.value.boolean = last;
+
+  memset(message, 0, sizeof(*message));
+  message->properties._flags = AMQP_BASIC_HEADERS_FLAG;
+  message->properties.headers.num_entries = 4;
+  message->properties.headers.entries = entries;
+  message->body = amqp_cstring_bytes(body);
+}
+
+static int add_chunk(amqp_chunk_reassembler_t *reassembler,
+                     const char *transfer_id, int64_t index, int64_t offset,
+                     amqp_boolean_t last, const char *body)
+{
+  amqp_message_t message;
+  amqp_table_entry_t entries[4];
+
+  make_chunk(&message, entries, transfer_id, index, offset, last, body);
+  return amqp_chunk_reassembler_add(reassembler, &message);
+}
+
+static void test_in_order(void)
+{
+  amqp_chunk_reassembler_t *reassembler;
+  sink_state_t state;
+
+  memset(&state, 0, sizeof(state));
+  match_int("new", AMQP_STATUS_OK,
+            amqp_chunk_reassembler_new(sink, &state, 4, &reassembler));
+
+  match_int("chunk 0", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 0, 0, 0, "hello "));
+  match_int("pending", 1, (int)amqp_chunk_reassembler_pending(reassembler));
+  match_int("chunk 1", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 1, 6, 0, "chunked "));
+  match_int("chunk 2", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 2, 14, 1, "world"));
+
+  match_int("chunks", 3, state.chunks);
+  match_int("finished", 1, state.finished);
+  match_int("length", 19, (int)state.len);
+  match_int("data", 0, memcmp(state.data, "hello chunked world", 19));
+  match_int("pending after last", 0,
+            (int)amqp_chunk_reassembler_pending(reassembler));
+
+  amqp_chunk_reassembler_free(reassembler);
+}
+
+static void test_missing(void)
+{
+  amqp_chunk_reassembler_t *reassembler;
+  sink_state_t state;
+
+  memset(&state, 0, sizeof(state));
+  amqp_chunk_reassembler_new(sink, &state, 4, &reassembler);
+
+  match_int("chunk 0", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 0, 0, 0, "abc"));
+  match_int("skipped chunk", AMQP_STATUS_CHUNK_MISSING,
+            add_chunk(reassembler, "a", 2, 6, 1, "ghi"));
+  match_int("pending after missing", 0,
+            (int)amqp_chunk_reassembler_pending(reassembler));
+
+  /* The transfer is abandoned, so the late chunk has no start */
+  match_int("late chunk", AMQP_STATUS_CHUNK_MISSING,
+            add_chunk(reassembler, "a", 1, 3, 0, "def"));
+  match_int("chunks", 1, state.chunks);
+  match_int("finished", 0, state.finished);
+
+  amqp_chunk_reassembler_free(reassembler);
+}
+
+static void test_duplicate(void)
+{
+  amqp_chunk_reassembler_t *reassembler;
+  sink_state_t state;
+
+  memset(&state, 0, sizeof(state));
+  amqp_chunk_reassembler_new(sink, &state, 4, &reassembler);
+
+  match_int("chunk 0", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 0, 0, 0, "abc"));
+  match_int("chunk 1", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 1, 3, 0, "def"));
+  match_int("duplicate chunk 0", AMQP_STATUS_CHUNK_DUPLICATE,
+            add_chunk(reassembler, "a", 0, 0, 0, "abc"));
+  match_int("duplicate chunk 1", AMQP_STATUS_CHUNK_DUPLICATE,
+            add_chunk(reassembler, "a", 1, 3, 0, "def"));
+  match_int("chunk 2", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 2, 6, 1, "ghi"));
+
+  match_int("chunks", 3, state.chunks);
+  match_int("data", 0, memcmp(state.data, "abcdefghi", 9));
+
+  /* Once finished a redelivered first chunk starts the transfer over */
+  memset(&state, 0, sizeof(state));
+  match_int("redelivered chunk 0", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 0, 0, 0, "abc"));
+  match_int("chunks after redelivery", 1, state.chunks);
+  match_int("pending after redelivery", 1,
+            (int)amqp_chunk_reassembler_pending(reassembler));
+
+  amqp_chunk_reassembler_free(reassembler);
+}
+
+static void test_empty_last(void)
+{
+  amqp_chunk_reassembler_t *reassembler;
+  sink_state_t state;
+
+  memset(&state, 0, sizeof(state));
+  amqp_chunk_reassembler_new(sink, &state, 4, &reassembler);
+
+  match_int("chunk 0", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 0, 0, 0, "abcd"));
+  match_int("chunk 1", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 1, 4, 0, "efgh"));
+  match_int("empty last chunk", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 2, 8, 1, ""));
+
+  match_int("chunks", 3, state.chunks);
+  match_int("finished", 1, state.finished);
+  match_int("length", 8, (int)state.len);
+  match_int("pending", 0, (int)amqp_chunk_reassembler_pending(reassembler));
+
+  amqp_chunk_reassembler_free(reassembler);
+}
+
+static void test_max_transfers(void)
+{
+  amqp_chunk_reassembler_t *reassembler;
+  sink_state_t state;
+
+  memset(&state, 0, sizeof(state));
+  amqp_chunk_reassembler_new(sink, &state, 2, &reassembler);
+
+  match_int("transfer a", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 0, 0, 0, ""));
+  match_int("transfer b", AMQP_STATUS_OK,
+            add_chunk(reassembler, "b", 0, 0, 0, ""));
+  match_int("transfer c", AMQP_STATUS_TOO_MANY_TRANSFERS,
+            add_chunk(reassembler, "c", 0, 0, 0, ""));
+  match_int("pending", 2, (int)amqp_chunk_reassembler_pending(reassembler));
+
+  /* Finishing a transfer makes room for another */
+  match_int("finish a", AMQP_STATUS_OK,
+            add_chunk(reassembler, "a", 1, 0, 1, ""));
+  match_int("transfer c again", AMQP_STATUS_OK,
+            add_chunk(reassembler, "c", 0, 0, 0, ""));
+  match_int("pending after retry", 2,
+            (int)amqp_chunk_reassembler_pending(reassembler));
+
+  amqp_chunk_reassembler_free(reassembler);
+}
+
+int main(void)
+{
+  test_in_order();
+  test_missing();
+  test_duplicate();
+  test_empty_last();
+  test_max_transfers();
+
+  fprintf(stderr, "ok\n");
+
+  return 0;
+}
@@ -0,0 +1,294 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/* amqp_compress.c is built into this test, with a small
+ * AMQP_MAX_INFLATED_BODY_SIZE, to reach its internal functions */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "amqp_private.h"
+
+#define MAX_INFLATED AMQP_MAX_INFLATED_BODY_SIZE
+
+/* Stands in for the library's, which handles mapped bodies as well */
+void amqp_free_message_body(amqp_bytes_t body)
+{
+  amqp_bytes_free(body);
+}
+
+static void match_int(const char *what, int expect, int got)
+{
+  if (got != expect) {
+    fprintf(stderr, "Expected %s '%d', got '%d'\n",
+            what, expect, got);
+    abort();
+  }
+}
+
+static void match_bytes(const char *what, amqp_bytes_t expect,
+                        amqp_bytes_t got)
+{
+  if (got.len != expect.len || memcmp(got.bytes, expect.bytes, got.len)) {
+    fprintf(stderr, "Expected %s of %d bytes, got %d different bytes\n",
+            what, (int)expect.len, (int)got.len);
+    abort();
+  }
+}
+
+/* A compressible body: a short phrase over and over */
+static amqp_bytes_t make_body(size_t len)
+{
+  static const char phrase[] = "the quick brown fox ";
+  amqp_bytes_t body = amqp_bytes_malloc(len);
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    ((char *)body.bytes)[i] = phrase[i % (sizeof(phrase) - 1)];
+  }
+  return body;
+}
+
+static void test_round_trip(amqp_connection_state_t state)
+{
+  amqp_bytes_t original = make_body(10000);
+  amqp_bytes_t body = original;
+  amqp_basic_properties_t const *properties = NULL;
+  amqp_basic_properties_t compressed_properties;
+  amqp_bytes_t compressed;
+  amqp_message_t message;
+
+  match_int("set compression", AMQP_STATUS_OK,
+            amqp_set_zlib_compression(state, 100, 6));
+
+  match_int("compress", AMQP_STATUS_OK,
+            amqp_compress_publish(state, &properties, &body,
+                                  &compressed_properties, &compressed));
+  match_int("compressed", 1, body.bytes == compressed.bytes);
+  match_int("smaller", 1, body.len < original.len);
+  match_int("properties", 1, properties == &compressed_properties);
+  match_int("content_encoding flag", AMQP_BASIC_CONTENT_ENCODING_FLAG,
+            properties->_flags & AMQP_BASIC_CONTENT_ENCODING_FLAG);
+  match_bytes("content_encoding", amqp_cstring_bytes("deflate"),
+              properties->content_encoding);
+
+  memset(&message, 0, sizeof(message));
+  message.properties = compressed_properties;
+  message.body = compressed;
+  amqp_decompress_message(state, &message);
+  match_bytes("decompressed body", original, message.body);
+  match_int("content_encoding cleared", 0,
+            message.properties._flags & AMQP_BASIC_CONTENT_ENCODING_FLAG);
+
+  amqp_bytes_free(message.body);
+  amqp_bytes_free(original);
+}
+
+static void test_skipped(amqp_connection_state_t state)
+{
+  amqp_bytes_t original = make_body(1000);
+  amqp_bytes_t body;
+  amqp_basic_properties_t encoded;
+  amqp_basic_properties_t const *properties;
+  amqp_basic_properties_t compressed_properties;
+  amqp_bytes_t compressed;
+  unsigned char random_bytes[1000];
+  size_t i;
+
+  amqp_set_zlib_compression(state, 1000, 6);
+
+  /* Under the threshold */
+  body = original;
+  body.len = 999;
+  properties = NULL;
+  match_int("under threshold", AMQP_STATUS_OK,
+            amqp_compress_publish(state, &properties, &body,
+                                  &compressed_properties, &compressed));
+  match_int("under threshold body", 1, body.bytes == original.bytes);
+  match_int("under threshold properties", 1, NULL == properties);
+  match_int("under threshold compressed", 0, (int)compressed.len);
+
+  /* At the threshold */
+  body = original;
+  match_int("at threshold", AMQP_STATUS_OK,
+            amqp_compress_publish(state, &properties, &body,
+                                  &compressed_properties, &compressed));
+  match_int("at threshold compressed", 1, body.bytes == compressed.bytes);
+  amqp_bytes_free(compressed);
+
+  /* The application already encoded the body */
+  memset(&encoded, 0, sizeof(encoded));
+  encoded._flags = AMQP_BASIC_CONTENT_ENCODING_FLAG;
+  encoded.content_encoding = amqp_cstring_bytes("gzip");
+  body = original;
+  properties = &encoded;
+  match_int("already encoded", AMQP_STATUS_OK,
+            amqp_compress_publish(state, &properties, &body,
+                                  &compressed_properties, &compressed));
+  match_int("already encoded body", 1, body.bytes == original.bytes);
+  match_int("already encoded properties", 1, properties == &encoded);
+
+  /* Compression would not make it smaller */
+  srand(1);
+  for (i = 0; i < sizeof(random_bytes); i++) {
+    random_bytes[i] = (unsigned char)rand();
+  }
+  body.bytes = random_bytes;
+  body.len = sizeof(random_bytes);
+  properties = NULL;
+  match_int("incompressible", AMQP_STATUS_OK,
+            amqp_compress_publish(state, &properties, &body,
+                                  &compressed_properties, &compressed));
+  match_int("incompressible body", 1, body.bytes == (void *)random_bytes);
+  match_int("incompressible properties", 1, NULL == properties);
+
+  amqp_bytes_free(original);
+}
+
+static void test_other_encoding(amqp_connection_state_t state)
+{
+  amqp_message_t message;
+  char body[] = "not deflated";
+
+  amqp_set_zlib_compression(state, 0, 6);
+
+  memset(&message, 0, sizeof(message));
+  message.properties._flags = AMQP_BASIC_CONTENT_ENCODING_FLAG;
+  message.properties.content_encoding = amqp_cstring_bytes("gzip");
+  message.body = amqp_cstring_bytes(body);
+  amqp_decompress_message(state, &message);
+  match_int("other encoding body", 1, message.body.bytes == (void *)body);
+  match_int("other encoding flag", AMQP_BASIC_CONTENT_ENCODING_FLAG,
+            message.properties._flags & AMQP_BASIC_CONTENT_ENCODING_FLAG);
+}
+
+static int compress_body(amqp_connection_state_t state, amqp_bytes_t body,
+                         amqp_bytes_t *compressed)
+{
+  return state->codec_compress(state->codec_user_data, body, compressed);
+}
+
+static int decompress_body(amqp_connection_state_t state, amqp_bytes_t body,
+                           amqp_bytes_t *decompressed)
+{
+  return state->codec_decompress(state->codec_user_data, body, decompressed);
+}
+
+static void test_truncated(amqp_connection_state_t state)
+{
+  amqp_bytes_t original = make_body(10000);
+  amqp_bytes_t compressed;
+  amqp_bytes_t truncated;
+  amqp_bytes_t decompressed;
+  amqp_message_t message;
+
+  amqp_set_zlib_compression(state, 0, 6);
+  match_int("compress", AMQP_STATUS_OK,
+            compress_body(state, original, &compressed));
+
+  truncated = compressed;
+  truncated.len -= 4;
+  match_int("truncated", AMQP_STATUS_BAD_AMQP_DATA,
+            decompress_body(state, truncated, &decompressed));
+  truncated.len = compressed.len / 2;
+  match_int("half", AMQP_STATUS_BAD_AMQP_DATA,
+            decompress_body(state, truncated, &decompressed));
+  truncated.len = 0;
+  match_int("empty", AMQP_STATUS_BAD_AMQP_DATA,
+            decompress_body(state, truncated, &decompressed));
+
+  /* A body that fails to inflate is delivered as received */
+  memset(&message, 0, sizeof(message));
+  message.properties._flags = AMQP_BASIC_CONTENT_ENCODING_FLAG;
+  message.properties.content_encoding = amqp_cstring_bytes("deflate");
+  message.body = compressed;
+  message.body.len = compressed.len / 2;
+  amqp_decompress_message(state, &message);
+  match_int("undecodable body", 1, message.body.bytes == compressed.bytes);
+  match_int("undecodable flag", AMQP_BASIC_CONTENT_ENCODING_FLAG,
+            message.properties._flags & AMQP_BASIC_CONTENT_ENCODING_FLAG);
+
+  amqp_bytes_free(compressed);
+  amqp_bytes_free(original);
+}
+
+static void test_limit(amqp_connection_state_t state)
+{
+  amqp_bytes_t original;
+  amqp_bytes_t compressed;
+  amqp_bytes_t decompressed;
+
+  amqp_set_zlib_compression(state, 0, 9);
+
+  /* Highly compressible, so the output buffer has to grow many times */
+  original = make_body(MAX_INFLATED - 1);
+  match_int("compress under limit", AMQP_STATUS_OK,
+            compress_body(state, original, &compressed));
+  match_int("grown to the limit", AMQP_STATUS_OK,
+            decompress_body(state, compressed, &decompressed));
+  match_bytes("grown body", original, decompressed);
+  amqp_bytes_free(decompressed);
+  amqp_bytes_free(compressed);
+  amqp_bytes_free(original);
+
+  original = make_body(MAX_INFLATED + 1);
+  match_int("compress over limit", AMQP_STATUS_OK,
+            compress_body(state, original, &compressed));
+  match_int("over the limit", AMQP_STATUS_BAD_AMQP_DATA,
+            decompress_body(state, compressed, &decompressed));
+  amqp_bytes_free(compressed);
+  amqp_bytes_free(original);
+}
+
+int main(void)
+{
+  amqp_connection_state_t state = amqp_new_connection();
+
+  test_round_trip(state);
+  test_skipped(state);
+  test_other_encoding(state);
+  test_truncated(state);
+  test_limit(state);
+
+  amqp_destroy_connection(state);
+
+  fprintf(stderr, "ok\n");
+
+  return 0;
+}
@@ -0,0 +1,119 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <amqp.h>
+
+static void check(const char *name, uint32_t got, uint32_t expect)
+{
+  if (got != expect) {
+    fprintf(stderr, "%s: expected 0x%08x got 0x%08x\n", name,
+            (unsigned)expect, (unsigned)got);
+    abort();
+  }
+}
+
+/* Bit at a time, as the polynomial is defined */
+static uint32_t reference_crc32c(unsigned char const *p, size_t len)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  int bit;
+
+  while (len--) {
+    crc ^= *p++;
+    for (bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+int main(void)
+{
+  unsigned char buffer[1100];
+  size_t len, offset, split;
+
+  /* Check values from RFC 3720 and the CRC catalogue */
+  check("check string", amqp_crc32c(0, "123456789", 9), 0xE3069283);
+  check("empty", amqp_crc32c(0, "", 0), 0);
+  memset(buffer, 0, 32);
+  check("32 zeros", amqp_crc32c(0, buffer, 32), 0x8A9136AA);
+  memset(buffer, 0xFF, 32);
+  check("32 ones", amqp_crc32c(0, buffer, 32), 0x62A8AB43);
+
+  for (len = 0; len < sizeof(buffer); len++) {
+    buffer[len] = (unsigned char)(len * 131 + (len >> 3));
+  }
+
+  /* Every length and alignment around the word size */
+  for (offset = 0; offset < 8; offset++) {
+    for (len = 0; len + offset <= 1024; len++) {
+      check("unaligned", amqp_crc32c(0, buffer + offset, len),
+            reference_crc32c(buffer + offset, len));
+    }
+  }
+
+  /* Long enough for the interleaved streams of the hardware version */
+  {
+    size_t big_len = 100000;
+    unsigned char *big = malloc(big_len);
+    if (NULL == big) {
+      abort();
+    }
+    for (len = 0; len < big_len; len++) {
+      big[len] = (unsigned char)(len * 2654435761u >> 13);
+    }
+    for (offset = 0; offset < 3; offset++) {
+      check("long", amqp_crc32c(0, big + offset, big_len - offset * 4001),
+            reference_crc32c(big + offset, big_len - offset * 4001));
+    }
+    free(big);
+  }
+
+  /* Piece by piece matches all at once */
+  for (split = 0; split <= 1000; split += 7) {
+    uint32_t crc = amqp_crc32c(0, buffer, split);
+    crc = amqp_crc32c(crc, buffer + split, 1000 - split);
+    check("incremental", crc, reference_crc32c(buffer, 1000));
+  }
+
+  return 0;
+}
@@ -0,0 +1,203 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+static amqp_header_filter_t *filter;
+
+static void add(const char *key, amqp_field_value_t const *value)
+{
+  int res = amqp_header_filter_add(filter, amqp_cstring_bytes(key), value);
+  if (res) {
+    fprintf(stderr, "Adding '%s' failed: %s\n", key, amqp_error_string2(res));
+    abort();
+  }
+}
+
+/* Checks a set of headers against the filter, both decoded and encoded */
+static void check(const char *name, amqp_table_entry_t *entries,
+                  int num_entries, amqp_boolean_t expect)
+{
+  amqp_basic_properties_t props;
+  char buffer[1024];
+  amqp_bytes_t encoded;
+  amqp_boolean_t matched;
+  int res;
+
+  memset(&props, 0, sizeof(props));
+  props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_DELIVERY_MODE_FLAG;
+  props.content_type = amqp_cstring_bytes("text/plain");
+  props.delivery_mode = 2;
+  if (entries != NULL) {
+    props._flags |= AMQP_BASIC_HEADERS_FLAG;
+    props.headers.num_entries = num_entries;
+    props.headers.entries = entries;
+  }
+
+  if (amqp_header_filter_match(filter, &props) != expect) {
+    fprintf(stderr, "%s: decoded match should be %d\n", name, expect);
+    abort();
+  }
+
+  encoded.bytes = buffer;
+  encoded.len = sizeof(buffer);
+  res = amqp_encode_properties(AMQP_BASIC_CLASS, &props, encoded);
+  if (res < 0) {
+    fprintf(stderr, "%s: encoding failed: %s\n", name, amqp_error_string2(res));
+    abort();
+  }
+  encoded.len = res;
+
+  res = amqp_header_filter_match_encoded(filter, encoded, &matched);
+  if (res) {
+    fprintf(stderr, "%s: encoded match failed: %s\n", name,
+            amqp_error_string2(res));
+    abort();
+  }
+  if (matched != expect) {
+    fprintf(stderr, "%s: encoded match should be %d\n", name, expect);
+    abort();
+  }
+
+  if (entries != NULL) {
+    /* Properties cut off inside the headers must be rejected, not read
+       past; the trailing delivery mode is one byte */
+    encoded.len -= 2;
+    res = amqp_header_filter_match_encoded(filter, encoded, &matched);
+    if (res != AMQP_STATUS_BAD_AMQP_DATA) {
+      fprintf(stderr, "%s: truncated properties were accepted\n", name);
+      abort();
+    }
+  }
+
+  printf("ok: %s\n", name);
+}
+
+static amqp_table_entry_t entry(const char *key, amqp_field_value_t value)
+{
+  amqp_table_entry_t e;
+  e.key = amqp_cstring_bytes(key);
+  e.value = value;
+  return e;
+}
+
+static amqp_field_value_t string_value(const char *s)
+{
+  amqp_field_value_t v;
+  v.kind = AMQP_FIELD_KIND_UTF8;
+  v.value.bytes = amqp_cstring_bytes(s);
+  return v;
+}
+
+int main(void)
+{
+  amqp_field_value_t value;
+  amqp_table_entry_t entries[4];
+
+  if (amqp_header_filter_new(&filter)) {
+    fprintf(stderr, "Creating the filter failed\n");
+    abort();
+  }
+
+  check("empty filter, no headers", NULL, 0, 1);
+
+  /* region is "eu" or "us", priority is 5, urgent is true, trace is set */
+  value = string_value("eu");
+  add("region", &value);
+  value.kind = AMQP_FIELD_KIND_BYTES;
+  value.value.bytes = amqp_cstring_bytes("us");
+  add("region", &value);
+  value.kind = AMQP_FIELD_KIND_I8;
+  value.value.i8 = 5;
+  add("priority", &value);
+  value.kind = AMQP_FIELD_KIND_BOOLEAN;
+  value.value.boolean = 1;
+  add("urgent", &value);
+  add("trace", NULL);
+
+  value.kind = AMQP_FIELD_KIND_TABLE;
+  if (amqp_header_filter_add(filter, amqp_cstring_bytes("nested"), &value) !=
+      AMQP_STATUS_INVALID_PARAMETER) {
+    fprintf(stderr, "Table values should not be accepted\n");
+    abort();
+  }
+
+  check("no headers", NULL, 0, 0);
+
+  entries[0] = entry("region", string_value("us"));
+  value.kind = AMQP_FIELD_KIND_U64;
+  value.value.u64 = 5;
+  entries[1] = entry("priority", value);
+  value.kind = AMQP_FIELD_KIND_BOOLEAN;
+  value.value.boolean = 1;
+  entries[2] = entry("urgent", value);
+  entries[3] = entry("trace", string_value("anything"));
+  check("all headers match", entries, 4, 1);
+
+  entries[0] = entry("region", string_value("ap"));
+  check("other region", entries, 4, 0);
+
+  entries[0] = entry("region", string_value("eu"));
+  value.kind = AMQP_FIELD_KIND_I32;
+  value.value.i32 = -5;
+  entries[1] = entry("priority", value);
+  check("negative priority", entries, 4, 0);
+
+  value.kind = AMQP_FIELD_KIND_I16;
+  value.value.i16 = 5;
+  entries[1] = entry("priority", value);
+  check("priority of another width", entries, 4, 1);
+
+  value.kind = AMQP_FIELD_KIND_UTF8;
+  value.value.bytes = amqp_cstring_bytes("5");
+  entries[1] = entry("priority", value);
+  check("priority as a string", entries, 4, 0);
+
+  value.kind = AMQP_FIELD_KIND_I16;
+  value.value.i16 = 5;
+  entries[1] = entry("priority", value);
+  check("no trace", entries, 3, 0);
+
+  amqp_header_filter_free(filter);
+  return 0;
+}
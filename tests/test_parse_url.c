@@ -107,6 +107,61 @@ static void parse_fail(const char *url)
   free(s);
 }
 
+static void parse_hosts_success(const char *url, const char *vhost,
+                                int count, const char **hosts,
+                                const int *ports)
+{
+  char *s = strdup(url);
+  struct amqp_connection_info ci;
+  amqp_host_list_t *list = amqp_host_list_new();
+  int res;
+  int i;
+
+  amqp_default_connection_info(&ci);
+  res = amqp_parse_url_host_list(s, &ci, list);
+  if (res) {
+    fprintf(stderr,
+            "Expected to successfully parse URL, but didn't: %s (%s)\n",
+            url, amqp_error_string2(res));
+    abort();
+  }
+
+  match_string("vhost", vhost, ci.vhost);
+  match_string("host", hosts[0], ci.host);
+  match_int("port", ports[0], ci.port);
+  match_int("host count", count, amqp_host_list_size(list));
+
+  for (i = 0; i < count; ++i) {
+    const char *host;
+    int port;
+
+    amqp_host_list_get(list, i, &host, &port);
+    match_string("host", hosts[i], host);
+    match_int("port", ports[i], port);
+  }
+
+  amqp_host_list_free(list);
+  free(s);
+}
+
+static void parse_hosts_fail(const char *url)
+{
+  char *s = strdup(url);
+  struct amqp_connection_info ci;
+  amqp_host_list_t *list = amqp_host_list_new();
+
+  amqp_default_connection_info(&ci);
+  if (amqp_parse_url_host_list(s, &ci, list) >= 0) {
+    fprintf(stderr,
+            "Expected to fail parsing URL, but didn't: %s\n",
+            url);
+    abort();
+  }
+
+  amqp_host_list_free(list);
+  free(s);
+}
+
 int main(void)
 {
   /* From the spec */
@@ -249,5 +304,37 @@ int main(void)
   parse_fail("amqp://foo%xy");
   parse_fail("amqps://foo%xy");
 
+  /* Host lists */
+  {
+    const char *hosts[] = { "h1", "h2", "h3" };
+    const int ports[] = { 10000, 10001, 5672 };
+    const int ssl_ports[] = { 10000, 10001, 5671 };
+
+    parse_hosts_success("amqp://user:pass@h1:10000,h2:10001,h3/vhost",
+                        "vhost", 3, hosts, ports);
+    parse_hosts_success("amqps://h1:10000,h2:10001,h3/vhost",
+                        "vhost", 3, hosts, ssl_ports);
+  }
+  {
+    const char *hosts[] = { "host" };
+    const int ports[] = { 5672 };
+
+    parse_hosts_success("amqp://host", "/", 1, hosts, ports);
+  }
+  {
+    const char *hosts[] = { "::1", "::2", "h%,3" };
+    const int ports[] = { 100, 5672, 101 };
+
+    parse_hosts_success("amqp://u@[::1]:100,[::2],h%25%2c3:101",
+                        "/", 3, hosts, ports);
+  }
+
+  parse_hosts_fail("amqp://h1,,h3");
+  parse_hosts_fail("amqp://h1,h2:xyz");
+  parse_hosts_fail("amqp://h1,h2:1000000");
+  parse_hosts_fail("amqp://h1,[::1]foo");
+  parse_hosts_fail("amqp://h1,h2/bar/baz");
+  parse_hosts_fail("http://h1,h2");
+
   return 0;
 }
@@ -0,0 +1,353 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include <amqp.h>
+#include <amqp_tcp_socket.h>
+
+#define NS_PER_S ((uint64_t)1000000000)
+
+/* The client talks to the test over a socket pair, the test plays the
+ * broker with a second connection on the other end */
+static amqp_connection_state_t client_conn;
+static amqp_connection_state_t broker_conn;
+static amqp_rpc_client_t *client;
+static uint64_t now;
+
+/* The order in which callbacks ran, across all calls */
+static int completions;
+
+typedef struct outcome_t_ {
+  int calls;
+  int status;
+  int order;
+  char reply[16];
+} outcome_t;
+
+static void match_int(const char *what, int expect, int got)
+{
+  if (got != expect) {
+    fprintf(stderr, "Expected %s '%d', got '%d'\n",
+            what, expect, got);
+    abort();
+  }
+}
+
+static uint64_t AMQP_CALL test_clock(void *user_data)
+{
+  return *(uint64_t *)user_data;
+}
+
+static void AMQP_CALL record_outcome(void *user_data, int status,
+                                     amqp_envelope_t const *reply)
+{
+  outcome_t *outcome = user_data;
+
+  outcome->calls++;
+  outcome->status = status;
+  outcome->order = ++completions;
+  if (reply) {
+    match_int("reply length", 1, reply->message.body.len < 16);
+    memcpy(outcome->reply, reply->message.body.bytes,
+           reply->message.body.len);
+    outcome->reply[reply->message.body.len] = '\0';
+  } else {
+    outcome->reply[0] = '\0';
+  }
+}
+
+/* Reads a frame the client sent */
+static void broker_frame(amqp_frame_t *frame, uint8_t frame_type)
+{
+  match_int("broker frame", AMQP_STATUS_OK,
+            amqp_simple_wait_frame(broker_conn, frame));
+  match_int("frame type", frame_type, frame->frame_type);
+  match_int("frame channel", 1, frame->channel);
+}
+
+static void setup(void)
+{
+  amqp_basic_consume_ok_t consume_ok;
+  amqp_basic_consume_t *consume;
+  amqp_frame_t frame;
+  int fds[2];
+
+  match_int("socketpair", 0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  client_conn = amqp_new_connection();
+  amqp_tcp_socket_set_sockfd(amqp_tcp_socket_new(client_conn), fds[0]);
+  broker_conn = amqp_new_connection();
+  amqp_tcp_socket_set_sockfd(amqp_tcp_socket_new(broker_conn), fds[1]);
+
+  now = NS_PER_S;
+  match_int("clock", AMQP_STATUS_OK,
+            amqp_set_clock_source(client_conn, AMQP_CLOCK_SOURCE_USER,
+                                  test_clock, &now));
+
+  /* Answer the reply-to consumer ahead of time */
+  consume_ok.consumer_tag = amqp_cstring_bytes("ctag");
+  match_int("consume-ok", AMQP_STATUS_OK,
+            amqp_send_method(broker_conn, 1, AMQP_BASIC_CONSUME_OK_METHOD,
+                             &consume_ok));
+  match_int("new", AMQP_STATUS_OK, amqp_rpc_client_new(client_conn, 1, &client));
+
+  broker_frame(&frame, AMQP_FRAME_METHOD);
+  match_int("consume", AMQP_BASIC_CONSUME_METHOD, (int)frame.payload.method.id);
+  consume = frame.payload.method.decoded;
+  match_int("consume queue", 0,
+            strncmp("amq.rabbitmq.reply-to", consume->queue.bytes,
+                    consume->queue.len));
+  match_int("consume no_ack", 1, consume->no_ack);
+  amqp_maybe_release_buffers(broker_conn);
+}
+
+static void teardown(void)
+{
+  amqp_rpc_client_free(client);
+  amqp_destroy_connection(client_conn);
+  amqp_destroy_connection(broker_conn);
+}
+
+/* Makes a call and returns the correlation id it was published with */
+static amqp_bytes_t call(struct timeval *timeout, outcome_t *outcome)
+{
+  amqp_basic_properties_t *properties;
+  amqp_bytes_t correlation_id;
+  amqp_frame_t frame;
+
+  memset(outcome, 0, sizeof(outcome_t));
+  match_int("call", AMQP_STATUS_OK,
+            amqp_rpc_client_call(client, amqp_empty_bytes,
+                                 amqp_cstring_bytes("service"), NULL,
+                                 amqp_cstring_bytes("request"), timeout,
+                                 record_outcome, outcome));
+
+  broker_frame(&frame, AMQP_FRAME_METHOD);
+  match_int("publish", AMQP_BASIC_PUBLISH_METHOD, (int)frame.payload.method.id);
+  broker_frame(&frame, AMQP_FRAME_HEADER);
+  properties = frame.payload.properties.decoded;
+  match_int("correlation_id flag", AMQP_BASIC_CORRELATION_ID_FLAG,
+            properties->_flags & AMQP_BASIC_CORRELATION_ID_FLAG);
+  match_int("reply_to", 0,
+            strncmp("amq.rabbitmq.reply-to", properties->reply_to.bytes,
+                    properties->reply_to.len));
+  correlation_id = amqp_bytes_malloc_dup(properties->correlation_id);
+  broker_frame(&frame, AMQP_FRAME_BODY);
+  amqp_maybe_release_buffers(broker_conn);
+  return correlation_id;
+}
+
+/* Hands the client a reply as amqp_consume_message() would */
+static amqp_boolean_t reply(amqp_channel_t channel, char const *consumer_tag,
+                            amqp_bytes_t const *correlation_id,
+                            char const *body)
+{
+  amqp_envelope_t envelope;
+  amqp_boolean_t handled = 2;
+
+  memset(&envelope, 0, sizeof(envelope));
+  envelope.channel = channel;
+  envelope.consumer_tag = amqp_cstring_bytes(consumer_tag);
+  if (correlation_id) {
+    envelope.message.properties._flags = AMQP_BASIC_CORRELATION_ID_FLAG;
+    envelope.message.properties.correlation_id = *correlation_id;
+  }
+  envelope.message.body = amqp_cstring_bytes(body);
+  match_int("handle", AMQP_STATUS_OK,
+            amqp_rpc_client_handle(client, &envelope, &handled));
+  return handled;
+}
+
+static void test_correlation(void)
+{
+  outcome_t outcomes[3];
+  amqp_bytes_t ids[3];
+  amqp_bytes_t unknown = amqp_cstring_bytes("ffffffffffffffff");
+  amqp_bytes_t malformed = amqp_cstring_bytes("not a call id");
+  int i;
+
+  setup();
+  for (i = 0; i < 3; i++) {
+    ids[i] = call(NULL, &outcomes[i]);
+  }
+  match_int("pending", 3, (int)amqp_rpc_client_pending(client));
+  match_int("distinct ids", 1,
+            ids[0].len != ids[1].len ||
+            memcmp(ids[0].bytes, ids[1].bytes, ids[0].len));
+
+  match_int("handled", 1, reply(1, "ctag", &ids[1], "two"));
+  match_int("reply calls", 1, outcomes[1].calls);
+  match_int("reply status", AMQP_STATUS_OK, outcomes[1].status);
+  match_int("reply body", 0, strcmp("two", outcomes[1].reply));
+  match_int("pending after reply", 2, (int)amqp_rpc_client_pending(client));
+
+  /* Duplicates and replies to nothing are consumed and ignored */
+  match_int("duplicate handled", 1, reply(1, "ctag", &ids[1], "again"));
+  match_int("unknown handled", 1, reply(1, "ctag", &unknown, "x"));
+  match_int("malformed handled", 1, reply(1, "ctag", &malformed, "x"));
+  match_int("no id handled", 1, reply(1, "ctag", NULL, "x"));
+  match_int("duplicate calls", 1, outcomes[1].calls);
+
+  /* Messages for other consumers are left alone, matching id or not */
+  match_int("other consumer", 0, reply(1, "other", &ids[0], "x"));
+  match_int("other channel", 0, reply(2, "ctag", &ids[0], "x"));
+  match_int("unhandled calls", 0, outcomes[0].calls);
+  match_int("pending after ignored", 2, (int)amqp_rpc_client_pending(client));
+
+  reply(1, "ctag", &ids[2], "three");
+  reply(1, "ctag", &ids[0], "one");
+  match_int("first body", 0, strcmp("one", outcomes[0].reply));
+  match_int("third body", 0, strcmp("three", outcomes[2].reply));
+  match_int("pending at end", 0, (int)amqp_rpc_client_pending(client));
+
+  for (i = 0; i < 3; i++) {
+    amqp_bytes_free(ids[i]);
+  }
+  teardown();
+}
+
+/* Enough calls to grow the table several times, answered out of order so
+ * removals shift entries around */
+static void test_many_calls(void)
+{
+  enum { CALLS = 500 };
+  static outcome_t outcomes[CALLS];
+  static amqp_bytes_t ids[CALLS];
+  int i;
+
+  setup();
+  for (i = 0; i < CALLS; i++) {
+    ids[i] = call(NULL, &outcomes[i]);
+  }
+  match_int("pending", CALLS, (int)amqp_rpc_client_pending(client));
+
+  for (i = 0; i < CALLS; i++) {
+    int which = (i * 7) % CALLS;
+    char body[16];
+
+    sprintf(body, "%d", which);
+    reply(1, "ctag", &ids[which], body);
+    match_int("pending", CALLS - i - 1,
+              (int)amqp_rpc_client_pending(client));
+  }
+  for (i = 0; i < CALLS; i++) {
+    match_int("calls", 1, outcomes[i].calls);
+    match_int("status", AMQP_STATUS_OK, outcomes[i].status);
+    match_int("matched", i, atoi(outcomes[i].reply));
+    amqp_bytes_free(ids[i]);
+  }
+  teardown();
+}
+
+static void test_expiry(void)
+{
+  struct timeval one = { 1, 0 };
+  struct timeval two = { 2, 0 };
+  struct timeval three = { 3, 0 };
+  struct timeval zero = { 0, 0 };
+  outcome_t in_one, in_two, in_three, never, at_once;
+  amqp_bytes_t id_one, id_two, id_three, id_never, id_at_once;
+  uint64_t start;
+
+  setup();
+  completions = 0;
+  start = now;
+  id_three = call(&three, &in_three);
+  id_one = call(&one, &in_one);
+  id_never = call(NULL, &never);
+  id_two = call(&two, &in_two);
+  id_at_once = call(&zero, &at_once);
+
+  /* A zero timeout is already due */
+  match_int("expire", AMQP_STATUS_OK, amqp_rpc_client_expire(client));
+  match_int("zero timeout", AMQP_STATUS_TIMEOUT, at_once.status);
+  match_int("nothing else due", 1, completions);
+
+  now = start + NS_PER_S - 1;
+  amqp_rpc_client_expire(client);
+  match_int("just before", 0, in_one.calls);
+
+  now = start + NS_PER_S;
+  amqp_rpc_client_expire(client);
+  match_int("one second calls", 1, in_one.calls);
+  match_int("one second status", AMQP_STATUS_TIMEOUT, in_one.status);
+  match_int("one second order", 2, in_one.order);
+  match_int("pending", 3, (int)amqp_rpc_client_pending(client));
+
+  /* A reply in time takes the call off the heap */
+  match_int("handled", 1, reply(1, "ctag", &id_two, "two"));
+  match_int("replied status", AMQP_STATUS_OK, in_two.status);
+
+  /* A reply after the timeout is dropped */
+  match_int("late handled", 1, reply(1, "ctag", &id_one, "late"));
+  match_int("late calls", 1, in_one.calls);
+
+  now = start + 10 * NS_PER_S;
+  amqp_rpc_client_expire(client);
+  match_int("three second calls", 1, in_three.calls);
+  match_int("three second status", AMQP_STATUS_TIMEOUT, in_three.status);
+  match_int("replied calls", 1, in_two.calls);
+  match_int("no timeout", 0, never.calls);
+  match_int("pending at end", 1, (int)amqp_rpc_client_pending(client));
+
+  /* A call without a timeout still gets its reply */
+  reply(1, "ctag", &id_never, "never");
+  match_int("no timeout status", AMQP_STATUS_OK, never.status);
+  match_int("completions", 5, completions);
+
+  amqp_bytes_free(id_one);
+  amqp_bytes_free(id_two);
+  amqp_bytes_free(id_three);
+  amqp_bytes_free(id_never);
+  amqp_bytes_free(id_at_once);
+  teardown();
+}
+
+int main(void)
+{
+  test_correlation();
+  test_many_calls();
+  test_expiry();
+
+  fprintf(stderr, "ok\n");
+
+  return 0;
+}
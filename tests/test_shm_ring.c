@@ -0,0 +1,284 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <amqp.h>
+
+/* Smallest ring the library creates */
+#define CAPACITY 4096
+/* Records are a 32 byte header, the routing key and the body, rounded up
+ * to a multiple of 8 */
+#define RECORD_LEN(body_len) ((32 + 2 + (body_len) + 7) & ~7)
+
+static void match_int(const char *what, int expect, int got)
+{
+  if (got != expect) {
+    fprintf(stderr, "Expected %s '%d', got '%d'\n",
+            what, expect, got);
+    abort();
+  }
+}
+
+/* A name no other test run is using */
+static char const *ring_name(char const *test)
+{
+  static char name[64];
+
+  sprintf(name, "/rabbitmq-c-test-%s-%d", test, (int)getpid());
+  return name;
+}
+
+/* Publishes a message whose body is len bytes of its sequence number */
+static void publish(amqp_shm_ring_t *ring, int seq, size_t len)
+{
+  amqp_envelope_t envelope;
+  char body[1024];
+
+  memset(&envelope, 0, sizeof(envelope));
+  memset(body, seq & 0xff, len);
+  envelope.routing_key = amqp_cstring_bytes("rk");
+  envelope.message.body.bytes = body;
+  envelope.message.body.len = len;
+  match_int("publish", AMQP_STATUS_OK, amqp_shm_ring_publish(ring, &envelope));
+}
+
+/* Reads a message and checks it is the one publish() made for seq */
+static void read_message(amqp_shm_ring_reader_t *reader, int seq, size_t len)
+{
+  struct timeval timeout = { 1, 0 };
+  amqp_envelope_t envelope;
+  size_t i;
+
+  match_int("read", AMQP_STATUS_OK,
+            amqp_shm_ring_read(reader, &envelope, &timeout));
+  match_int("delivery_tag", seq, (int)envelope.delivery_tag);
+  match_int("routing_key", 0,
+            envelope.routing_key.len != 2 ||
+            memcmp(envelope.routing_key.bytes, "rk", 2));
+  match_int("body length", (int)len, (int)envelope.message.body.len);
+  for (i = 0; i < len; i++) {
+    match_int("body", seq & 0xff,
+              ((unsigned char *)envelope.message.body.bytes)[i]);
+  }
+  amqp_destroy_envelope(&envelope);
+}
+
+static void read_nothing(amqp_shm_ring_reader_t *reader)
+{
+  struct timeval timeout = { 0, 0 };
+  amqp_envelope_t envelope;
+
+  match_int("empty read", AMQP_STATUS_TIMEOUT,
+            amqp_shm_ring_read(reader, &envelope, &timeout));
+}
+
+static void test_wrap_around(void)
+{
+  char const *name = ring_name("wrap");
+  amqp_shm_ring_t *ring;
+  amqp_shm_ring_reader_t *reader;
+  int seq;
+
+  match_int("create", AMQP_STATUS_OK,
+            amqp_shm_ring_create(name, CAPACITY, 1, AMQP_SHM_RING_OVERWRITE,
+                                 0, &ring));
+  match_int("attach", AMQP_STATUS_OK, amqp_shm_ring_attach(name, &reader));
+
+  /* Four 900 byte bodies fill all but 352 bytes of the ring, so the
+   * fifth message goes after padding; the mixed sizes move where the
+   * padding falls on later laps */
+  for (seq = 1; seq <= 100; seq++) {
+    size_t len = seq < 5 || seq % 2 ? 900 : 601 + seq;
+
+    publish(ring, seq, len);
+    read_message(reader, seq, len);
+  }
+  read_nothing(reader);
+  match_int("lost", 0, (int)amqp_shm_ring_lost(reader));
+
+  amqp_shm_ring_detach(reader);
+  amqp_shm_ring_destroy(ring);
+}
+
+static void test_overwrite_behind(void)
+{
+  char const *name = ring_name("overwrite");
+  amqp_shm_ring_t *ring;
+  amqp_shm_ring_reader_t *reader;
+  int first;
+  int seq;
+
+  match_int("create", AMQP_STATUS_OK,
+            amqp_shm_ring_create(name, CAPACITY, 1, AMQP_SHM_RING_OVERWRITE,
+                                 0, &ring));
+  match_int("attach", AMQP_STATUS_OK, amqp_shm_ring_attach(name, &reader));
+
+  publish(ring, 1, 100);
+  read_message(reader, 1, 100);
+
+  /* Twice what the ring holds; the reader resumes at the oldest record
+   * still in it */
+  for (seq = 2; seq <= 61; seq++) {
+    publish(ring, seq, 100);
+  }
+  first = 61 - CAPACITY / RECORD_LEN(100) + 1;
+  read_message(reader, first, 100);
+  match_int("lost", first - 2, (int)amqp_shm_ring_lost(reader));
+  for (seq = first + 1; seq <= 61; seq++) {
+    read_message(reader, seq, 100);
+  }
+  read_nothing(reader);
+  match_int("lost after catching up", first - 2,
+            (int)amqp_shm_ring_lost(reader));
+  match_int("dropped", 0, (int)amqp_shm_ring_dropped(ring));
+
+  amqp_shm_ring_detach(reader);
+  amqp_shm_ring_destroy(ring);
+}
+
+static void test_drop_newest(void)
+{
+  char const *name = ring_name("drop");
+  int fits = CAPACITY / RECORD_LEN(100);
+  amqp_shm_ring_t *ring;
+  amqp_shm_ring_reader_t *reader;
+  int seq;
+
+  match_int("create", AMQP_STATUS_OK,
+            amqp_shm_ring_create(name, CAPACITY, 1, AMQP_SHM_RING_DROP_NEWEST,
+                                 0, &ring));
+  match_int("attach", AMQP_STATUS_OK, amqp_shm_ring_attach(name, &reader));
+
+  for (seq = 1; seq <= fits + 10; seq++) {
+    publish(ring, seq, 100);
+  }
+  match_int("dropped", 10, (int)amqp_shm_ring_dropped(ring));
+
+  /* The reader gets everything that fit, and nothing is lost */
+  for (seq = 1; seq <= fits; seq++) {
+    read_message(reader, seq, 100);
+  }
+  read_nothing(reader);
+  match_int("lost", 0, (int)amqp_shm_ring_lost(reader));
+
+  /* Once read there is room again, and the dropped messages took no
+   * sequence numbers */
+  publish(ring, fits + 1, 100);
+  match_int("dropped after reading", 10, (int)amqp_shm_ring_dropped(ring));
+  read_message(reader, fits + 1, 100);
+
+  /* A detached reader no longer holds the writer back */
+  amqp_shm_ring_detach(reader);
+  for (seq = fits + 2; seq <= 2 * fits + 2; seq++) {
+    publish(ring, seq, 100);
+  }
+  match_int("dropped without readers", 10, (int)amqp_shm_ring_dropped(ring));
+
+  amqp_shm_ring_destroy(ring);
+}
+
+static void test_reader_slots(void)
+{
+  char const *name = ring_name("slots");
+  amqp_shm_ring_t *ring;
+  amqp_shm_ring_reader_t *first;
+  amqp_shm_ring_reader_t *second;
+  amqp_shm_ring_reader_t *third;
+
+  match_int("create", AMQP_STATUS_OK,
+            amqp_shm_ring_create(name, CAPACITY, 2, AMQP_SHM_RING_DROP_NEWEST,
+                                 0, &ring));
+  match_int("attach first", AMQP_STATUS_OK,
+            amqp_shm_ring_attach(name, &first));
+  match_int("attach second", AMQP_STATUS_OK,
+            amqp_shm_ring_attach(name, &second));
+  match_int("attach with no slot left", AMQP_STATUS_NO_MEMORY,
+            amqp_shm_ring_attach(name, &third));
+
+  /* Detaching frees the slot for the next reader, which starts at the
+   * end of the ring */
+  publish(ring, 1, 100);
+  amqp_shm_ring_detach(first);
+  match_int("attach after detach", AMQP_STATUS_OK,
+            amqp_shm_ring_attach(name, &third));
+  read_nothing(third);
+  publish(ring, 2, 100);
+  read_message(third, 2, 100);
+  read_message(second, 1, 100);
+  read_message(second, 2, 100);
+
+  amqp_shm_ring_detach(second);
+  amqp_shm_ring_detach(third);
+  amqp_shm_ring_destroy(ring);
+
+  /* An overwriting ring lets readers past max_readers attach, they just
+   * aren't tracked */
+  match_int("create", AMQP_STATUS_OK,
+            amqp_shm_ring_create(name, CAPACITY, 1, AMQP_SHM_RING_OVERWRITE,
+                                 0, &ring));
+  match_int("attach first", AMQP_STATUS_OK,
+            amqp_shm_ring_attach(name, &first));
+  match_int("attach untracked", AMQP_STATUS_OK,
+            amqp_shm_ring_attach(name, &second));
+  publish(ring, 1, 100);
+  read_message(first, 1, 100);
+  read_message(second, 1, 100);
+
+  amqp_shm_ring_detach(first);
+  amqp_shm_ring_detach(second);
+  amqp_shm_ring_destroy(ring);
+
+  match_int("attach destroyed", AMQP_STATUS_FILE_ERROR,
+            amqp_shm_ring_attach(name, &first));
+}
+
+int main(void)
+{
+  test_wrap_around();
+  test_overwrite_behind();
+  test_drop_newest();
+  test_reader_slots();
+
+  fprintf(stderr, "ok\n");
+
+  return 0;
+}
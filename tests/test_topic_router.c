@@ -0,0 +1,158 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <amqp.h>
+
+/* Each handler appends its name to the log */
+static char log_buffer[256];
+
+static int AMQP_CALL log_handler(void *user_data,
+                                 amqp_envelope_t const *envelope)
+{
+  (void)envelope;
+  strcat(log_buffer, (const char *)user_data);
+  strcat(log_buffer, " ");
+  return AMQP_STATUS_OK;
+}
+
+static int AMQP_CALL stop_handler(void *user_data,
+                                  amqp_envelope_t const *envelope)
+{
+  log_handler(user_data, envelope);
+  return AMQP_STATUS_INVALID_PARAMETER;
+}
+
+static amqp_topic_router_t *router;
+
+static void add(const char *pattern, amqp_topic_handler_fn handler,
+                const char *name, uint64_t *id)
+{
+  int res = amqp_topic_router_add(router, amqp_cstring_bytes(pattern),
+                                  handler, (void *)name, id);
+  if (res) {
+    fprintf(stderr, "Adding '%s' failed: %s\n", pattern,
+            amqp_error_string2(res));
+    abort();
+  }
+}
+
+static void dispatch(const char *key, const char *expect)
+{
+  amqp_envelope_t envelope;
+  int res;
+
+  memset(&envelope, 0, sizeof(envelope));
+  envelope.routing_key = amqp_cstring_bytes(key);
+  log_buffer[0] = '\0';
+
+  res = amqp_topic_router_dispatch(router, &envelope, NULL);
+  if (res != AMQP_STATUS_OK && res != AMQP_STATUS_INVALID_PARAMETER) {
+    fprintf(stderr, "Dispatching '%s' failed: %s\n", key,
+            amqp_error_string2(res));
+    abort();
+  }
+  if (strcmp(log_buffer, expect)) {
+    fprintf(stderr, "Expected '%s' to reach '%s', reached '%s'\n",
+            key, expect, log_buffer);
+    abort();
+  }
+}
+
+static void test_patterns(void)
+{
+  uint64_t id;
+
+  amqp_topic_router_new(&router);
+  add("stock.usd.nyse", log_handler, "exact", NULL);
+  add("stock.*.nyse", log_handler, "star", NULL);
+  add("stock.#", log_handler, "hash", NULL);
+  add("#.nyse", log_handler, "tail", NULL);
+  add("#", log_handler, "all", NULL);
+  add("*", log_handler, "one", NULL);
+  add("a.#.b", log_handler, "middle", NULL);
+  add("", log_handler, "empty", &id);
+
+  dispatch("stock.usd.nyse", "exact star hash tail all ");
+  dispatch("stock.eur.nyse", "star hash tail all ");
+  dispatch("stock", "hash all one ");
+  dispatch("stock.usd", "hash all ");
+  dispatch("nyse", "tail all one ");
+  dispatch("other.stock.nyse", "tail all ");
+  dispatch("a.b", "all middle ");
+  dispatch("a.x.y.b", "all middle ");
+  dispatch("a.x.y.c", "all ");
+  dispatch("", "all empty ");
+  dispatch("stock..nyse", "star hash tail all ");
+
+  amqp_topic_router_remove(router, id);
+  dispatch("", "all ");
+  if (AMQP_STATUS_INVALID_PARAMETER != amqp_topic_router_remove(router, id)) {
+    fprintf(stderr, "Removed a binding twice\n");
+    abort();
+  }
+
+  amqp_topic_router_free(router);
+}
+
+static void test_order_and_stop(void)
+{
+  amqp_topic_router_new(&router);
+  add("x.*", log_handler, "first", NULL);
+  add("x.y", stop_handler, "second", NULL);
+  add("#", log_handler, "third", NULL);
+  add("x.y", log_handler, "fourth", NULL);
+
+  dispatch("x.y", "first second ");
+  dispatch("x.z", "first third ");
+
+  amqp_topic_router_free(router);
+}
+
+int main(void)
+{
+  test_patterns();
+  test_order_and_stop();
+
+  fprintf(stderr, "ok\n");
+
+  return 0;
+}
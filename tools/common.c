@@ -225,6 +225,9 @@ struct poptOption connect_options[] = {
   { NULL, '\0', 0, NULL, 0, NULL, NULL }
 };
 
+/* Every host listed in --url, for failing over between them */
+static amqp_host_list_t *url_hosts = NULL;
+
 static void init_connection_info(struct amqp_connection_info *ci)
 {
   ci->user = NULL;
@@ -236,9 +239,14 @@ static void init_connection_info(struct amqp_connection_info *ci)
 
   amqp_default_connection_info(ci);
 
-  if (amqp_url)
-    die_amqp_error(amqp_parse_url(strdup(amqp_url), ci),
+  if (amqp_url) {
+    url_hosts = amqp_host_list_new();
+    if (!url_hosts) {
+      die("creating host list (out of memory)");
+    }
+    die_amqp_error(amqp_parse_url_host_list(strdup(amqp_url), ci, url_hosts),
                    "Parsing URL '%s'", amqp_url);
+  }
 
   if (amqp_server) {
     char *colon;
@@ -351,9 +359,16 @@ amqp_connection_state_t make_connection(void)
       die("creating TCP socket (out of memory)");
     }
   }
-  status = amqp_socket_open(socket, ci.host, ci.port);
-  if (status) {
-    die("opening socket to %s:%d", ci.host, ci.port);
+  if (url_hosts && amqp_host_list_size(url_hosts) > 1 && !amqp_server) {
+    status = amqp_host_list_open(url_hosts, socket, NULL, 3);
+    if (status) {
+      die("opening socket to any host in '%s'", amqp_url);
+    }
+  } else {
+    status = amqp_socket_open(socket, ci.host, ci.port);
+    if (status) {
+      die("opening socket to %s:%d", ci.host, ci.port);
+    }
   }
   die_rpc(amqp_login(conn, ci.vhost, 0, 131072, 0,
                      AMQP_SASL_METHOD_PLAIN,